@@ -0,0 +1,56 @@
+#ifndef CPP_ASYNC_HTTP_ARENA_H
+#define CPP_ASYNC_HTTP_ARENA_H
+
+#include <stdint.h>
+
+// Bump allocator over a buffer it doesn't own. Allocating only moves a
+// pointer, everything is freed at once with reset. The last allocation can be
+// given back early with release, so memory that is used like a stack is
+// reused right away.
+class Arena {
+   public:
+    Arena(char *buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    Arena(const Arena &other) = delete;
+    Arena &operator=(const Arena &other) = delete;
+
+    // Returns nullptr if the arena is full
+    void *allocate(size_t size, size_t alignment = alignof(max_align_t)) {
+        uintptr_t start = (uintptr_t)(buffer + used);
+        size_t padding = (alignment - start % alignment) % alignment;
+        if (padding + size > capacity - used) {
+            return nullptr;
+        }
+        used += padding + size;
+        return buffer + used - size;
+    }
+
+    // Frees data if it was the last allocation, otherwise it stays allocated
+    // until the next reset
+    void release(void *data, size_t size) {
+        if ((char *)data + size == buffer + used) {
+            used = (char *)data - buffer;
+        }
+    }
+
+    void reset() { used = 0; }
+
+    size_t getUsed() { return used; }
+    size_t getCapacity() { return capacity; }
+
+   private:
+    char *buffer;
+    size_t capacity;
+    size_t used = 0;
+};
+
+template <size_t Capacity>
+class SizedArena : public Arena {
+   public:
+    SizedArena() : Arena(storage, Capacity) {}
+
+   private:
+    alignas(max_align_t) char storage[Capacity];
+};
+
+#endif
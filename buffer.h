@@ -9,7 +9,8 @@ class BufferReadImpl {
    public:
     explicit BufferReadImpl(BufferRef buffer) : buffer(buffer), offset(0) {}
 
-    Optional<size_t> readIntoBuffer(char *buffer, size_t bufferLength) {
+    Optional<size_t> readIntoBuffer(Context *cx, char *buffer,
+                                    size_t bufferLength) {
         if (offset >= this->buffer.length) {
             return Optional<size_t>::empty();
         }
@@ -42,7 +43,8 @@ class BufferWriteImpl {
    public:
     explicit BufferWriteImpl(BufferRef buffer) : buffer(buffer), offset(0) {}
 
-    Optional<size_t> writeFromBuffer(const char *buffer, size_t bufferLength) {
+    Optional<size_t> writeFromBuffer(Context *cx, const char *buffer,
+                                     size_t bufferLength) {
         if (offset >= this->buffer.length) {
             return Optional<size_t>::empty();
         }
@@ -68,6 +70,26 @@ BufferWriter writeToBuffer(BufferRef buffer) {
     return BufferWriter(BufferWriteImpl(buffer));
 }
 
+// Doesn't write anything but counts the bytes, e.g. to know the length of a
+// response before writing it
+class CountWriteImpl {
+   public:
+    Optional<size_t> writeFromBuffer(Context *cx, const char *buffer,
+                                     size_t bufferLength) {
+        count += bufferLength;
+        return Optional<size_t>::of(bufferLength);
+    }
+
+    size_t getCount() { return count; }
+
+   private:
+    size_t count = 0;
+};
+
+typedef SimpleWriter<CountWriteImpl> CountWriter;
+
+CountWriter writeToCount() { return CountWriter(CountWriteImpl()); }
+
 template <int Base, size_t BufferLength>
 Optional<SizedBuffer<BufferLength>> writeDoubleToBuffer(double value) {
     SizedBuffer<BufferLength> buffer = SizedBuffer<BufferLength>();
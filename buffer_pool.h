@@ -0,0 +1,482 @@
+#ifndef CPP_ASYNC_HTTP_BUFFER_POOL_H
+#define CPP_ASYNC_HTTP_BUFFER_POOL_H
+
+#include <stdint.h>
+
+#include <string.h>
+
+#include <atomic>
+
+#include "future.h"
+#include "utils.h"
+
+// Lends fixed size buffers of two classes, small and large, from storage it
+// doesn't own, e.g. to the connections that have bytes in flight right now
+// instead of giving every connection its own buffers. The free buffers of a
+// class are a list linked through the buffers themselves.
+//
+// The pool can be shared by threads. Every thread keeps a few buffers of each
+// of the first THREAD_CACHES pools it uses in a cache, so most lends and gives
+// don't touch the shared lists. The buffers in the cache of a thread that
+// stops using the pool are only given back with flushThreadCache.
+//
+// Whoever finds no buffer can wait for one. While someone waits, given back
+// buffers skip the cache and wake the first waiter. Its waker is woken on the
+// thread that gave the buffer back.
+class BufferPool {
+   private:
+    struct FreeBuffer {
+        FreeBuffer *next;
+    };
+
+    struct SpinLock {
+        std::atomic_flag locked = ATOMIC_FLAG_INIT;
+
+        void lock() {
+            while (locked.test_and_set(std::memory_order_acquire)) {
+            }
+        }
+        void unlock() { locked.clear(std::memory_order_release); }
+    };
+
+    // The shared list of one class
+    struct SizeClass : SpinLock {
+        size_t length;
+        char *start;
+        char *end;
+        FreeBuffer *free = nullptr;
+
+        // Moves up to count buffers into buffers, returns how many
+        size_t take(char **buffers, size_t count) {
+            lock();
+            size_t taken = 0;
+            while (taken < count && free != nullptr) {
+                buffers[taken++] = (char *)free;
+                free = free->next;
+            }
+            unlock();
+            return taken;
+        }
+
+        void give(char **buffers, size_t count) {
+            lock();
+            for (size_t i = 0; i < count; i++) {
+                FreeBuffer *buffer = (FreeBuffer *)buffers[i];
+                buffer->next = free;
+                free = buffer;
+            }
+            unlock();
+        }
+
+        bool owns(char *buffer) { return buffer >= start && buffer < end; }
+    };
+
+    // Buffers move between a cache and the shared lists in batches of half
+    // the cache
+    static constexpr const size_t CACHE_LENGTH = 16;
+    // Pools a thread keeps a cache of
+    static constexpr const size_t THREAD_CACHES = 4;
+
+    // Bound to the generation of a pool, so a pool that's initialized again or
+    // a new pool at the same address never gets buffers of the old one
+    struct ThreadCache {
+        BufferPool *pool = nullptr;
+        uint64_t generation = 0;
+        size_t lengths[2] = {};
+        char *buffers[2][CACHE_LENGTH];
+    };
+
+   public:
+    // Queued in the pool while waiting for a buffer. It must not be moved
+    // while waiting, copies never wait.
+    class Waiter {
+       public:
+        Waiter() {}
+        Waiter(const Waiter &other) {}
+        Waiter &operator=(const Waiter &other) { return *this; }
+
+        // Only touched by the owner, so it can be checked without the lock
+        bool isWaiting() { return waiting; }
+
+       private:
+        friend class BufferPool;
+
+        Waker waker;
+        Waiter *prev = nullptr;
+        Waiter *next = nullptr;
+        bool queued = false;
+        // Woken, but it didn't stop waiting yet
+        bool woken = false;
+        bool waiting = false;
+    };
+
+    // small and large hold smallCount/largeCount buffers of
+    // smallLength/largeLength bytes, large buffers are longer
+    BufferPool(char *small, size_t smallLength, size_t smallCount, char *large,
+               size_t largeLength, size_t largeCount) {
+        init(small, smallLength, smallCount, large, largeLength, largeCount);
+    }
+
+    BufferPool(const BufferPool &other) = delete;
+    BufferPool &operator=(const BufferPool &other) = delete;
+
+    ~BufferPool() { flushThreadCache(); }
+
+    // Lends a buffer of the smallest class with at least length bytes, a large
+    // one if there are no small ones left. Returns nullptr if there is none.
+    char *lend(size_t length) {
+        for (size_t i = 0; i < 2; i++) {
+            if (classes[i].length < length) {
+                continue;
+            }
+            char *buffer = lendFrom(i);
+            if (buffer != nullptr) {
+                return buffer;
+            }
+        }
+        return nullptr;
+    }
+
+    void giveBack(char *buffer) {
+        size_t i = classes[0].owns(buffer) ? 0 : 1;
+
+        if (waitersLength.load(std::memory_order_seq_cst) > 0) {
+            classes[i].give(&buffer, 1);
+            wakeWaiter();
+            return;
+        }
+        ThreadCache *cache = threadCache();
+        if (cache == nullptr) {
+            classes[i].give(&buffer, 1);
+            return;
+        }
+        if (cache->lengths[i] == CACHE_LENGTH) {
+            cache->lengths[i] -= CACHE_LENGTH / 2;
+            classes[i].give(cache->buffers[i] + cache->lengths[i],
+                            CACHE_LENGTH / 2);
+        }
+        cache->buffers[i][cache->lengths[i]++] = buffer;
+    }
+
+    // The length of the buffers lent by lend
+    size_t lengthOf(char *buffer) {
+        return classes[0].owns(buffer) ? classes[0].length : classes[1].length;
+    }
+
+    // Gives the buffers cached by this thread back to the shared lists and
+    // frees the cache for another pool, e.g. once the server of the pool is
+    // closed
+    void flushThreadCache() {
+        ThreadCache *cache = findThreadCache();
+        if (cache == nullptr) {
+            return;
+        }
+        for (size_t i = 0; i < 2; i++) {
+            classes[i].give(cache->buffers[i], cache->lengths[i]);
+            cache->lengths[i] = 0;
+        }
+        cache->pool = nullptr;
+    }
+
+    // Queues waiter until a buffer is given back, then wakes waker. Lend again
+    // afterwards, a buffer may have come back before it was queued.
+    void wait(Waiter *waiter, Waker waker) {
+        waitersLock.lock();
+        waiter->waker = waker;
+        waiter->waiting = true;
+        if (!waiter->queued) {
+            waiter->queued = true;
+            waiter->woken = false;
+            waiter->prev = lastWaiter;
+            waiter->next = nullptr;
+            if (lastWaiter != nullptr) {
+                lastWaiter->next = waiter;
+            } else {
+                firstWaiter = waiter;
+            }
+            lastWaiter = waiter;
+            waitersLength.fetch_add(1, std::memory_order_seq_cst);
+        }
+        waitersLock.unlock();
+    }
+
+    // Dequeues waiter. If it was woken for a buffer it didn't take, the next
+    // waiter is woken instead.
+    void stopWaiting(Waiter *waiter, bool acquired) {
+        if (!waiter->waiting) {
+            return;
+        }
+        waiter->waiting = false;
+
+        waitersLock.lock();
+        bool passOn = waiter->woken && !acquired;
+        waiter->woken = false;
+        if (waiter->queued) {
+            unlinkWaiter(waiter);
+        }
+        waitersLock.unlock();
+
+        if (passOn) {
+            wakeWaiter();
+        }
+    }
+
+   protected:
+    // Every buffer is free afterwards. The thread caches of the last
+    // generation are dropped, no thread may use the pool meanwhile.
+    void init(char *small, size_t smallLength, size_t smallCount, char *large,
+              size_t largeLength, size_t largeCount) {
+        generation = nextGeneration();
+        classes[0].length = smallLength;
+        classes[1].length = largeLength;
+        initClass(&classes[0], small, smallCount);
+        initClass(&classes[1], large, largeCount);
+    }
+
+   private:
+    static void initClass(SizeClass *sizeClass, char *storage, size_t count) {
+        sizeClass->free = nullptr;
+        sizeClass->start = storage;
+        sizeClass->end = storage + sizeClass->length * count;
+        // Low addresses first
+        for (size_t i = count; i > 0; i--) {
+            char *buffer = storage + sizeClass->length * (i - 1);
+            sizeClass->give(&buffer, 1);
+        }
+    }
+
+    char *lendFrom(size_t i) {
+        ThreadCache *cache = threadCache();
+        if (cache == nullptr) {
+            char *buffer;
+            return classes[i].take(&buffer, 1) == 1 ? buffer : nullptr;
+        }
+        if (cache->lengths[i] == 0) {
+            cache->lengths[i] =
+                classes[i].take(cache->buffers[i], CACHE_LENGTH / 2);
+            if (cache->lengths[i] == 0) {
+                return nullptr;
+            }
+        }
+        return cache->buffers[i][--cache->lengths[i]];
+    }
+
+    static uint64_t nextGeneration() {
+        static std::atomic<uint64_t> generations(0);
+        return generations.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    static ThreadCache *threadCaches() {
+        static thread_local ThreadCache caches[THREAD_CACHES];
+        return caches;
+    }
+
+    // The cache of this pool in this thread, nullptr if there is none yet
+    ThreadCache *findThreadCache() {
+        ThreadCache *caches = threadCaches();
+        for (size_t i = 0; i < THREAD_CACHES; i++) {
+            if (caches[i].pool == this && caches[i].generation == generation) {
+                return &caches[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // The cache of this pool in this thread, nullptr if the thread caches
+    // other pools already
+    ThreadCache *threadCache() {
+        ThreadCache *caches = threadCaches();
+        ThreadCache *free = nullptr;
+        for (size_t i = 0; i < THREAD_CACHES; i++) {
+            ThreadCache *cache = &caches[i];
+            if (cache->pool == this) {
+                if (cache->generation != generation) {
+                    // Its buffers belong to the storage before init
+                    cache->generation = generation;
+                    cache->lengths[0] = 0;
+                    cache->lengths[1] = 0;
+                }
+                return cache;
+            }
+            if (cache->pool == nullptr && free == nullptr) {
+                free = cache;
+            }
+        }
+        if (free != nullptr) {
+            free->pool = this;
+            free->generation = generation;
+            free->lengths[0] = 0;
+            free->lengths[1] = 0;
+        }
+        return free;
+    }
+
+    // Must be called with the lock held
+    void unlinkWaiter(Waiter *waiter) {
+        if (waiter->prev != nullptr) {
+            waiter->prev->next = waiter->next;
+        } else {
+            firstWaiter = waiter->next;
+        }
+        if (waiter->next != nullptr) {
+            waiter->next->prev = waiter->prev;
+        } else {
+            lastWaiter = waiter->prev;
+        }
+        waiter->prev = nullptr;
+        waiter->next = nullptr;
+        waiter->queued = false;
+        waitersLength.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void wakeWaiter() {
+        waitersLock.lock();
+        Waiter *waiter = firstWaiter;
+        if (waiter == nullptr) {
+            waitersLock.unlock();
+            return;
+        }
+        unlinkWaiter(waiter);
+        waiter->woken = true;
+        Waker waker = waiter->waker;
+        waitersLock.unlock();
+
+        waker.wake();
+    }
+
+    SizeClass classes[2];
+    uint64_t generation = 0;
+
+    SpinLock waitersLock;
+    std::atomic<size_t> waitersLength{0};
+    Waiter *firstWaiter = nullptr;
+    Waiter *lastWaiter = nullptr;
+};
+
+template <size_t SmallLength, size_t SmallCount, size_t LargeLength,
+          size_t LargeCount>
+class SizedBufferPool : public BufferPool {
+    static_assert(SmallLength >= sizeof(void *) && SmallLength < LargeLength,
+                  "The free list is stored in the buffers");
+    static_assert(SmallCount > 0 && LargeCount > 0,
+                  "Both classes need buffers");
+
+   public:
+    SizedBufferPool()
+        : BufferPool(small, SmallLength, SmallCount, large, LargeLength,
+                     LargeCount) {}
+
+    // Copies are new pools, so an owner can be copied before it lends any
+    // buffer. Assigning starts over with every buffer free, the thread caches
+    // of the old buffers are dropped.
+    SizedBufferPool(const SizedBufferPool &other) : SizedBufferPool() {}
+    SizedBufferPool &operator=(const SizedBufferPool &other) {
+        init(small, SmallLength, SmallCount, large, LargeLength, LargeCount);
+        return *this;
+    }
+
+   private:
+    alignas(max_align_t) char small[SmallLength * SmallCount];
+    alignas(max_align_t) char large[LargeLength * LargeCount];
+};
+
+// Storage of BufferedReader/BufferedWriter
+
+// The buffer is part of the reader/writer
+template <size_t Capacity>
+class InlineBuffer {
+   public:
+    InlineBuffer() = default;
+    // The readers/writers copy the bytes they still need themselves
+    InlineBuffer(const InlineBuffer &other) {}
+    InlineBuffer &operator=(const InlineBuffer &other) { return *this; }
+
+    char *get() { return buffer; }
+    size_t capacity() { return Capacity; }
+
+    bool acquire(size_t length = Capacity) { return true; }
+    Poll<bool> pollAcquire(Context *cx, size_t length = Capacity) {
+        return Poll<bool>::ready(true);
+    }
+    void release() {}
+
+    // Takes over the buffer of other
+    void takeOver(InlineBuffer &other) {
+        memcpy(buffer, other.buffer, Capacity);
+    }
+
+   private:
+    char buffer[Capacity];
+};
+
+// The buffer is lent by a BufferPool between acquire and release, so a
+// reader/writer without buffered bytes holds no memory. Copies share the pool,
+// never the buffer.
+template <size_t Capacity>
+class PooledBuffer {
+   public:
+    explicit PooledBuffer(BufferPool *pool = nullptr) : pool(pool) {}
+    PooledBuffer(const PooledBuffer &other) : pool(other.pool) {}
+    PooledBuffer &operator=(const PooledBuffer &other) {
+        release();
+        pool = other.pool;
+        return *this;
+    }
+    ~PooledBuffer() { release(); }
+
+    char *get() { return buffer; }
+    // At most Capacity, 0 without a buffer
+    size_t capacity() {
+        return buffer == nullptr ? 0 : min(pool->lengthOf(buffer), Capacity);
+    }
+
+    // Lends a buffer of at least length bytes unless there already is one.
+    // Returns false if the pool has none left.
+    bool acquire(size_t length = Capacity) {
+        if (buffer == nullptr && pool != nullptr) {
+            buffer = pool->lend(min(length, Capacity));
+        }
+        return buffer != nullptr;
+    }
+
+    // Like acquire, but if the pool has none left cx is woken once a buffer
+    // was given back. Ready with false if there's no pool.
+    Poll<bool> pollAcquire(Context *cx, size_t length = Capacity) {
+        if (pool == nullptr) {
+            return Poll<bool>::ready(false);
+        }
+        if (!acquire(length)) {
+            pool->wait(&waiter, cx->getWaker());
+            if (!acquire(length)) {
+                return Poll<bool>::pending();
+            }
+        }
+        pool->stopWaiting(&waiter, true);
+        return Poll<bool>::ready(true);
+    }
+
+    // Also stops waiting for a buffer
+    void release() {
+        if (pool != nullptr) {
+            pool->stopWaiting(&waiter, false);
+        }
+        if (buffer != nullptr) {
+            pool->giveBack(buffer);
+            buffer = nullptr;
+        }
+    }
+
+    // Takes over the buffer of other, which must be of the same pool
+    void takeOver(PooledBuffer &other) {
+        release();
+        buffer = other.buffer;
+        other.buffer = nullptr;
+    }
+
+   private:
+    BufferPool *pool;
+    char *buffer = nullptr;
+    BufferPool::Waiter waiter;
+};
+
+#endif
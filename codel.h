@@ -0,0 +1,77 @@
+#ifndef CPP_ASYNC_HTTP_CODEL_H
+#define CPP_ASYNC_HTTP_CODEL_H
+
+#include <math.h>
+#include <stdint.h>
+
+// Controlled delay(CoDel, RFC 8289) on the dequeue side of a queue. Every
+// item that leaves the queue reports how long it waited. Once the waits stay
+// above target for a whole interval, items are dropped, each drop coming
+// sooner(interval / sqrt(drops)) until a wait is below target again. Short
+// bursts pass, a standing queue is drained.
+class CoDel {
+   public:
+    // A target of 0 never drops
+    explicit CoDel(uint64_t targetMillis = 5, uint64_t intervalMillis = 100)
+        : targetMillis(targetMillis), intervalMillis(intervalMillis) {}
+
+    // Returns if the item that left the queue at now after waiting sojourn
+    // milliseconds should be dropped
+    bool shouldDrop(uint64_t sojournMillis, uint64_t now) {
+        bool aboveTarget = isAboveTarget(sojournMillis, now);
+        if (dropping) {
+            if (!aboveTarget) {
+                dropping = false;
+                return false;
+            }
+            if (now < dropNext) {
+                return false;
+            }
+            count++;
+            dropNext = controlLaw(dropNext);
+            return true;
+        }
+        if (!aboveTarget) {
+            return false;
+        }
+
+        dropping = true;
+        // Start close to the last drop rate if the queue came back quickly
+        uint32_t delta = count - lastCount;
+        count = delta > 1 && now - dropNext < 16 * intervalMillis ? delta : 1;
+        lastCount = count;
+        dropNext = controlLaw(now);
+        return true;
+    }
+
+    bool isDropping() { return dropping; }
+
+   private:
+    // If the waits were above target for at least an interval
+    bool isAboveTarget(uint64_t sojournMillis, uint64_t now) {
+        if (targetMillis == 0 || sojournMillis < targetMillis) {
+            firstAboveTime = 0;
+            return false;
+        }
+        if (firstAboveTime == 0) {
+            firstAboveTime = now + intervalMillis;
+            return false;
+        }
+        return now >= firstAboveTime;
+    }
+
+    uint64_t controlLaw(uint64_t time) {
+        return time + (uint64_t)(intervalMillis / sqrt((double)count));
+    }
+
+    uint64_t targetMillis;
+    uint64_t intervalMillis;
+
+    bool dropping = false;
+    uint64_t firstAboveTime = 0;
+    uint64_t dropNext = 0;
+    uint32_t count = 0;
+    uint32_t lastCount = 0;
+};
+
+#endif
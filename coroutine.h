@@ -0,0 +1,247 @@
+#ifndef CPP_ASYNC_HTTP_COROUTINE_H
+#define CPP_ASYNC_HTTP_COROUTINE_H
+
+#include "arena.h"
+#include "future.h"
+#include "utils.h"
+
+// Needs C++20, the rest of the library doesn't
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+
+// A coroutine that is a Future, so futures can be written linearly instead of
+// as a state machine:
+//
+//   Co<bool> respond(Arena *arena, Writer *writer, Person *person) {
+//       bool result = co_await SerializeJson<Person>(writer, person);
+//       co_return result && co_await writer->flush();
+//   }
+//
+// co_await works on every future and on pointers to them. The frame is
+// allocated from the Arena that must be the first parameter(the second one of
+// member functions), it's never allocated with new. If the arena is full, the
+// returned Co is empty and must not be polled, check it with isAllocated.
+//
+// Like any future, the coroutine starts with the first poll and must not be
+// moved after that.
+template <typename T>
+class Co : public Future<Co<T>, T> {
+   public:
+    struct promise_type;
+
+   private:
+    // The arena and size of a frame are stored in front of it, so it can be
+    // released
+    struct FrameHeader {
+        Arena *arena;
+        size_t size;
+    };
+    static constexpr const size_t FRAME_HEADER =
+        (sizeof(FrameHeader) + alignof(max_align_t) - 1) /
+        alignof(max_align_t) * alignof(max_align_t);
+
+    template <typename F>
+    class FutureAwaiter {
+       private:
+        typedef typename template_utils::future_output<F>::type Output;
+
+       public:
+        FutureAwaiter(promise_type *promise, F *future)
+            : promise(promise), future(future) {}
+
+        bool await_ready() { return pollFuture(this, promise->cx); }
+
+        void await_suspend(std::coroutine_handle<>) {
+            promise->awaited = this;
+            promise->pollAwaited = pollFuture;
+        }
+
+        Output await_resume() { return output.get(); }
+
+       private:
+        // Returns if the future is ready
+        static bool pollFuture(void *data, Context *cx) {
+            FutureAwaiter *awaiter = (FutureAwaiter *)data;
+            Poll<Output> poll;
+            if constexpr (template_utils::is_pointer<F>::value) {
+                poll = (*awaiter->future)->poll(cx);
+            } else {
+                poll = awaiter->future->poll(cx);
+            }
+            if (poll.isPending()) {
+                return false;
+            }
+            awaiter->output = Optional<Output>::of(poll.get());
+            return true;
+        }
+
+        promise_type *promise;
+        F *future;
+        Optional<Output> output;
+    };
+
+   public:
+    // The state of the coroutine. The frame is allocated by the promises that
+    // std::coroutine_traits below picks by the parameters, so each operator
+    // new has the operator deletes of its own class.
+    struct promise_type {
+        Context *cx = nullptr;
+        // The future the coroutine is suspended on. It's polled by Co::poll,
+        // the coroutine is only resumed once it's ready.
+        void *awaited = nullptr;
+        bool (*pollAwaited)(void *awaited, Context *cx) = nullptr;
+        Optional<T> output;
+
+        // Coroutines without an arena don't compile
+        static void *operator new(size_t size) = delete;
+
+        static Co get_return_object_on_allocation_failure() { return Co(); }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_value(T value) { output = Optional<T>::of(value); }
+
+        // The library doesn't throw
+        void unhandled_exception() { std::terminate(); }
+
+        template <typename F>
+        FutureAwaiter<typename template_utils::remove_reference<F>::type>
+        await_transform(F &&future) {
+            // Temporaries of the co_await expression live in the frame until
+            // it's resumed, so the future is never moved
+            return FutureAwaiter<
+                typename template_utils::remove_reference<F>::type>(this,
+                                                                    &future);
+        }
+
+       protected:
+        // Rounded up, so nested frames are released without leaving padding
+        static size_t frameLength(size_t size) {
+            return FRAME_HEADER +
+                   (size + FRAME_HEADER - 1) / FRAME_HEADER * FRAME_HEADER;
+        }
+
+        static void *allocateFrame(Arena *arena, size_t size) {
+            char *start = (char *)arena->allocate(frameLength(size));
+            if (start == nullptr) {
+                return nullptr;
+            }
+            *(FrameHeader *)start = FrameHeader{arena, size};
+            return start + FRAME_HEADER;
+        }
+
+        static void releaseFrame(void *frame, size_t size) {
+            char *start = (char *)frame - FRAME_HEADER;
+            ((FrameHeader *)start)->arena->release(start, frameLength(size));
+        }
+
+        static size_t frameSize(void *frame) {
+            return ((FrameHeader *)((char *)frame - FRAME_HEADER))->size;
+        }
+    };
+
+    // Of functions whose first parameter is the arena
+    template <typename... Args>
+    struct ArenaPromise : promise_type {
+        static void *operator new(size_t size, Arena *arena,
+                                  Args &...args) noexcept {
+            return promise_type::allocateFrame(arena, size);
+        }
+        static void operator delete(void *frame, size_t size) {
+            promise_type::releaseFrame(frame, size);
+        }
+        static void operator delete(void *frame, Arena *arena,
+                                    Args &...args) {
+            promise_type::releaseFrame(frame, promise_type::frameSize(frame));
+        }
+
+        Co get_return_object() {
+            return Co(std::coroutine_handle<ArenaPromise>::from_promise(*this));
+        }
+    };
+
+    // Of member functions, the arena is the first parameter after the object
+    template <typename Self, typename... Args>
+    struct MemberArenaPromise : promise_type {
+        static void *operator new(size_t size, Self &self, Arena *arena,
+                                  Args &...args) noexcept {
+            return promise_type::allocateFrame(arena, size);
+        }
+        static void operator delete(void *frame, size_t size) {
+            promise_type::releaseFrame(frame, size);
+        }
+        static void operator delete(void *frame, Self &self, Arena *arena,
+                                    Args &...args) {
+            promise_type::releaseFrame(frame, promise_type::frameSize(frame));
+        }
+
+        Co get_return_object() {
+            return Co(std::coroutine_handle<MemberArenaPromise>::from_promise(
+                *this));
+        }
+    };
+
+    Co() : handle(nullptr), promise(nullptr) {}
+    Co(Co &&other) : handle(other.handle), promise(other.promise) {
+        other.handle = nullptr;
+    }
+    Co &operator=(Co &&other) {
+        destroy();
+        handle = other.handle;
+        promise = other.promise;
+        other.handle = nullptr;
+        return *this;
+    }
+    ~Co() { destroy(); }
+
+    bool isAllocated() { return handle != nullptr; }
+
+    Poll<T> poll(Context *cx) {
+        promise->cx = cx;
+        if (promise->awaited != nullptr) {
+            if (!promise->pollAwaited(promise->awaited, cx)) {
+                return Poll<T>::pending();
+            }
+            promise->awaited = nullptr;
+        }
+
+        handle.resume();
+        if (!handle.done()) {
+            return Poll<T>::pending();
+        }
+        READY(promise->output.get())
+    }
+
+   private:
+    template <typename Promise>
+    explicit Co(std::coroutine_handle<Promise> handle)
+        : handle(handle), promise(&handle.promise()) {}
+
+    void destroy() {
+        if (handle) {
+            handle.destroy();
+            handle = nullptr;
+        }
+    }
+
+    std::coroutine_handle<> handle;
+    promise_type *promise;
+};
+
+template <typename T, typename... Args>
+struct std::coroutine_traits<Co<T>, Arena *, Args...> {
+    typedef typename Co<T>::template ArenaPromise<Args...> promise_type;
+};
+
+template <typename T, typename Self, typename... Args>
+struct std::coroutine_traits<Co<T>, Self &, Arena *, Args...> {
+    typedef typename Co<T>::template MemberArenaPromise<Self, Args...>
+        promise_type;
+};
+
+#endif
+
+#endif
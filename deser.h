@@ -95,7 +95,7 @@ struct Deserialize {
                         DeserializingT* value)
                 : init({deserializer, name}), value(value) {}
 
-            Poll<bool> poll() {
+            Poll<bool> poll(Context* cx) {
                 switch (state) {
                     case State::INIT: {
                         state = State::DESERIALIZE;
@@ -107,7 +107,7 @@ struct Deserialize {
                         }
                     }
                     case State::DESERIALIZE: {
-                        Poll<bool> poll = pollMemberDeserialize();
+                        Poll<bool> poll = pollMemberDeserialize(cx);
                         if (poll.isPending()) {
                             return Poll<bool>::pending();
                         }
@@ -152,7 +152,7 @@ struct Deserialize {
             }
 
             template <size_t MemberIndex>
-            inline Poll<bool> pollMemberDeserialize2() {
+            inline Poll<bool> pollMemberDeserialize2(Context* cx) {
                 typedef
                     typename Reflection::member_types::template N<MemberIndex>
                         MemberType;
@@ -184,12 +184,12 @@ struct Deserialize {
                     READY(true)
                 }
                 if constexpr (MemberIndex > 0) {
-                    return pollMemberDeserialize2<MemberIndex - 1>();
+                    return pollMemberDeserialize2<MemberIndex - 1>(cx);
                 }
                 return Poll<bool>::ready(false);
             }
-            Poll<bool> pollMemberDeserialize() {
-                return pollMemberDeserialize2<Reflection::members - 1>();
+            Poll<bool> pollMemberDeserialize(Context* cx) {
+                return pollMemberDeserialize2<Reflection::members - 1>(cx);
             }
 
             enum class State { INIT, DESERIALIZE } state = State::INIT;
@@ -225,7 +225,7 @@ struct Deserialize {
         DeserializeFuture(Deserializer* deserializer)
             : deserializer(deserializer) {}
 
-        Poll<Optional<T>> poll() {
+        Poll<Optional<T>> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     auto future = deserializer->deserializeStruct(
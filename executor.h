@@ -0,0 +1,698 @@
+#ifndef CPP_ASYNC_HTTP_EXECUTOR_H
+#define CPP_ASYNC_HTTP_EXECUTOR_H
+
+// Linux only(pthreads)
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <new>
+
+#include "future.h"
+#include "remote_waker.h"
+#include "utils.h"
+
+namespace executor {
+
+enum class TaskState : uint8_t {
+    FREE,
+    IDLE,
+    // In a queue
+    SCHEDULED,
+    RUNNING,
+    // Woken while running, scheduled again after the poll
+    NOTIFIED,
+    COMPLETE
+};
+
+// The type erased part of every task, the future and its output follow it in
+// the same slot.
+struct TaskHeader {
+    std::atomic<TaskState> state;
+
+    // Protects the fields below, which are shared with the JoinHandle
+    std::atomic_flag joinLock;
+    bool complete;
+    bool detached;
+    Waker joinWaker;
+
+    // Returns true once the future completed and its output was stored
+    bool (*poll)(TaskHeader *task, Context *cx);
+    void (*moveOutput)(TaskHeader *task, void *output);
+    void (*dropOutput)(TaskHeader *task);
+
+    void *executor;
+    void (*schedule)(void *executor, TaskHeader *task);
+    void (*release)(void *executor, TaskHeader *task);
+
+    void lock() {
+        while (joinLock.test_and_set(std::memory_order_acquire)) {
+        }
+    }
+    void unlock() { joinLock.clear(std::memory_order_release); }
+};
+
+// Wakers of a task may outlive it. Waking a freed slot is ignored, waking a
+// slot that was reused for another task only causes a spurious poll.
+static void wakeTask(void *data) {
+    TaskHeader *task = (TaskHeader *)data;
+    TaskState state = task->state.load(std::memory_order_acquire);
+    while (true) {
+        switch (state) {
+            case TaskState::IDLE:
+                if (task->state.compare_exchange_weak(
+                        state, TaskState::SCHEDULED,
+                        std::memory_order_acq_rel)) {
+                    task->schedule(task->executor, task);
+                    return;
+                }
+                break;
+            case TaskState::RUNNING:
+                if (task->state.compare_exchange_weak(
+                        state, TaskState::NOTIFIED,
+                        std::memory_order_acq_rel)) {
+                    return;
+                }
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+template <typename F>
+struct Task {
+    typedef typename template_utils::future_output<F>::type Output;
+
+    TaskHeader header;
+    alignas(F) char future[sizeof(F)];
+    alignas(Output) char output[sizeof(Output)];
+
+    F *getFuture() { return (F *)future; }
+    Output *getOutput() { return (Output *)output; }
+
+    static bool poll(TaskHeader *header, Context *cx) {
+        Task *task = (Task *)header;
+        Poll<Output> poll = task->getFuture()->poll(cx);
+        if (poll.isPending()) {
+            return false;
+        }
+        new (task->output) Output(poll.get());
+        task->getFuture()->~F();
+        return true;
+    }
+
+    // output is an Optional<Output>, so Output needs no default constructor
+    static void moveOutput(TaskHeader *header, void *output) {
+        Task *task = (Task *)header;
+        *(Optional<Output> *)output = Optional<Output>::of(*task->getOutput());
+        task->getOutput()->~Output();
+    }
+
+    static void dropOutput(TaskHeader *header) {
+        ((Task *)header)->getOutput()->~Output();
+    }
+};
+
+// Resolves to the output of a spawned task. Every JoinHandle must either be
+// polled to completion or detached, otherwise the task's slot is never freed.
+template <typename T>
+class JoinHandle : public Future<JoinHandle<T>, T> {
+   public:
+    explicit JoinHandle() : task(nullptr) {}
+    explicit JoinHandle(TaskHeader *task) : task(task) {}
+
+    Poll<T> poll(Context *cx) {
+        task->lock();
+        if (!task->complete) {
+            task->joinWaker = cx->getWaker();
+            task->unlock();
+            return Poll<T>::pending();
+        }
+        task->unlock();
+
+        Optional<T> output;
+        task->moveOutput(task, &output);
+        task->release(task->executor, task);
+        task = nullptr;
+        return Poll<T>::ready(output.get());
+    }
+
+    // The task keeps running, its output is dropped
+    void detach() {
+        task->lock();
+        if (!task->complete) {
+            task->detached = true;
+            task->unlock();
+            task = nullptr;
+            return;
+        }
+        task->unlock();
+
+        task->dropOutput(task);
+        task->release(task->executor, task);
+        task = nullptr;
+    }
+
+   private:
+    TaskHeader *task;
+};
+
+// Awaits a task from a future that's polled by the thread of a server, e.g. a
+// handler with the Offload extractor. The workers can't wake the wakers of the
+// server, so the task wakes the RemoteWaker instead. If the request is dropped
+// before the task completed, e.g. because it timed out, the task is detached.
+// Resolves to an empty optional if the task couldn't be spawned or there's no
+// RemoteWaker to await it with.
+template <typename T>
+class Offloaded : public Future<Offloaded<T>, Optional<T>> {
+   public:
+    Offloaded(Optional<JoinHandle<T>> handle, RemoteWaker *waker)
+        : handle(handle), waker(waker) {}
+
+    Poll<Optional<T>> poll(Context *cx) {
+        if (handle.isEmpty()) {
+            READY(Optional<T>::empty())
+        }
+        if (waker == nullptr || !waker->hasQueue()) {
+            handle.getPtr()->detach();
+            handle = Optional<JoinHandle<T>>::empty();
+            READY(Optional<T>::empty())
+        }
+        // We aren't moved anymore once we're polled
+        waker->setAbandon(this, abandon);
+        waker->setWaker(cx->getWaker());
+
+        Context remoteCx = Context(waker->getWaker());
+        Poll<T> poll = handle.getPtr()->poll(&remoteCx);
+        if (poll.isPending()) {
+            return Poll<Optional<T>>::pending();
+        }
+        waker->clearAbandon();
+        handle = Optional<JoinHandle<T>>::empty();
+        READY(Optional<T>::of(poll.get()))
+    }
+
+   private:
+    static void abandon(void *data) {
+        Offloaded *offloaded = (Offloaded *)data;
+        offloaded->handle.getPtr()->detach();
+        offloaded->handle = Optional<JoinHandle<T>>::empty();
+    }
+
+    Optional<JoinHandle<T>> handle;
+    RemoteWaker *waker;
+};
+
+// Chase-Lev deque with a fixed capacity. Only the owner pushes and pops at the
+// bottom, other threads steal from the top.
+template <typename T, size_t Capacity>
+class WorkStealingDeque {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+   public:
+    // Returns false if the deque is full
+    bool push(T value) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= (int64_t)Capacity) {
+            return false;
+        }
+        buffer[b & (Capacity - 1)].store(value, std::memory_order_relaxed);
+        // Publishes the task to the thieves
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    Optional<T> pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // Empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return Optional<T>::empty();
+        }
+
+        T value = buffer[b & (Capacity - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            // The last one, race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1,
+                                                   std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            if (!won) {
+                return Optional<T>::empty();
+            }
+        }
+        return Optional<T>::of(value);
+    }
+
+    // Empty if there was nothing or another thread was faster
+    Optional<T> steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return Optional<T>::empty();
+        }
+
+        T value = buffer[t & (Capacity - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return Optional<T>::empty();
+        }
+        return Optional<T>::of(value);
+    }
+
+    bool isEmpty() {
+        int64_t t = top.load(std::memory_order_acquire);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        return t >= b;
+    }
+
+   private:
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<T> buffer[Capacity];
+};
+
+// Bounded multi producer, multi consumer queue(Vyukov) for tasks that are
+// scheduled from outside of the workers
+template <typename T, size_t Capacity>
+class InjectorQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+   public:
+    InjectorQueue() {
+        for (size_t i = 0; i < Capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(T value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell *cell = &cells[position & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+                    cell->value = value;
+                    cell->sequence.store(position + 1,
+                                         std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // Full
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    Optional<T> pop() {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell *cell = &cells[position & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+                    T value = cell->value;
+                    cell->sequence.store(position + Capacity,
+                                         std::memory_order_release);
+                    return Optional<T>::of(value);
+                }
+            } else if (diff < 0) {
+                // Empty
+                return Optional<T>::empty();
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool isEmpty() {
+        return head.load(std::memory_order_acquire) >=
+               tail.load(std::memory_order_acquire);
+    }
+
+   private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    Cell cells[Capacity];
+};
+
+}  // namespace executor
+
+// Runs spawned futures on Workers threads. Every worker has a deque of the
+// tasks that were woken on it and steals from the others once its own is
+// empty, so a few expensive tasks don't leave the other workers idle.
+// Tasks are woken by their waker like with blockOn, which may be called from
+// any thread.
+//
+// The reactors and timer wheels of the servers aren't thread safe, the
+// wakers and readiness flags of a socket belong to the thread that runs its
+// reactor. So connections are served by a server per thread(see
+// ShardedHttpServer) and handlers spawn their expensive parts here, e.g.
+// SerializeJson into a buffer. A handler gets the RemoteWaker of its
+// connection with the Offload extractor and awaits the JoinHandle with
+// Offloaded, the connection stays on its thread meanwhile:
+//
+//   auto handle = executor.spawn<CountPrimes>(limit);
+//   return executor::Offloaded<size_t>(handle, offload.waker);
+//
+// The tasks live in MaxTasks slots of TaskSize bytes, spawning fails if all
+// of them are in use. The future is constructed in its slot from the spawn
+// arguments, because futures like SerializeJson point into themselves. It's
+// big, so make it static:
+//
+//   static Executor<4> executor;
+//   executor.start();
+//   auto handle = executor.spawn<SerializeJson<Person>>(&writer, &person);
+//   executor::JoinHandle<bool> join = handle.get();
+//   bool result = blockOn(&join);
+template <size_t Workers, size_t MaxTasks = 1024, size_t TaskSize = 1024>
+class Executor {
+    static_assert(Workers > 0, "An executor needs at least one worker");
+    static_assert((MaxTasks & (MaxTasks - 1)) == 0,
+                  "MaxTasks must be a power of two");
+
+   private:
+    // Every task is in at most one queue, so they can't overflow
+    typedef executor::WorkStealingDeque<executor::TaskHeader *, MaxTasks>
+        Deque;
+    typedef executor::InjectorQueue<executor::TaskHeader *, MaxTasks>
+        Injector;
+
+    struct alignas(64) Slot {
+        char storage[TaskSize];
+    };
+
+    struct Worker {
+        Executor *executor;
+        size_t index;
+        pthread_t thread;
+        bool started = false;
+        // For choosing whom to steal from
+        uint32_t random;
+        Deque deque;
+    };
+
+    static constexpr const size_t FREE_WORDS = (MaxTasks + 63) / 64;
+    // Tries of a full injector push before yielding
+    static constexpr const size_t INJECTOR_SPINS = 64;
+
+   public:
+    explicit Executor() {
+        for (size_t i = 0; i < MaxTasks; i++) {
+            executor::TaskHeader *task =
+                new (slots[i].storage) executor::TaskHeader{};
+            task->state.store(executor::TaskState::FREE,
+                              std::memory_order_relaxed);
+        }
+        pthread_mutex_init(&sleepMutex, NULL);
+        pthread_cond_init(&sleepCondition, NULL);
+    }
+
+    Executor(const Executor &other) = delete;
+    Executor &operator=(const Executor &other) = delete;
+
+    // Returns false if not every worker could be started
+    bool start() {
+        bool allStarted = true;
+        for (size_t i = 0; i < Workers; i++) {
+            Worker *worker = &workers[i];
+            worker->executor = this;
+            worker->index = i;
+            worker->random = (uint32_t)(i * 2654435761u + 1);
+            worker->started =
+                pthread_create(&worker->thread, NULL, runWorker, worker) == 0;
+            allStarted = allStarted && worker->started;
+        }
+        return allStarted;
+    }
+
+    // Returns an empty optional if there's no free slot
+    template <typename F, typename... Args>
+    Optional<executor::JoinHandle<
+        typename template_utils::future_output<F>::type>>
+    spawn(Args... args) {
+        typedef typename template_utils::future_output<F>::type Output;
+        typedef Optional<executor::JoinHandle<Output>> Return;
+
+        executor::TaskHeader *task = spawnTask<F>(false, args...);
+        if (task == nullptr) {
+            return Return::empty();
+        }
+        return Return::of(executor::JoinHandle<Output>(task));
+    }
+
+    // Like spawn, but the slot is freed as soon as the future completed
+    template <typename F, typename... Args>
+    bool spawnDetached(Args... args) {
+        executor::TaskHeader *task = spawnTask<F>(true, args...);
+        return task != nullptr;
+    }
+
+    // Stops the workers after their current task and waits for them. Tasks
+    // that didn't complete yet are abandoned.
+    void shutdown() {
+        stopping.store(true, std::memory_order_seq_cst);
+        pthread_mutex_lock(&sleepMutex);
+        pthread_cond_broadcast(&sleepCondition);
+        pthread_mutex_unlock(&sleepMutex);
+
+        for (size_t i = 0; i < Workers; i++) {
+            if (workers[i].started) {
+                pthread_join(workers[i].thread, NULL);
+                workers[i].started = false;
+            }
+        }
+    }
+
+   private:
+    executor::TaskHeader *getTask(size_t index) {
+        return (executor::TaskHeader *)slots[index].storage;
+    }
+
+    template <typename F, typename... Args>
+    executor::TaskHeader *spawnTask(bool detached, Args... args) {
+        typedef executor::Task<F> Task;
+        static_assert(sizeof(Task) <= TaskSize,
+                      "The future doesn't fit into TaskSize");
+        static_assert(alignof(Task) <= alignof(Slot),
+                      "The future needs a bigger alignment");
+
+        Optional<size_t> index = allocateSlot();
+        if (index.isEmpty()) {
+            return nullptr;
+        }
+
+        Task *task = (Task *)getTask(index.get());
+        executor::TaskHeader *header = &task->header;
+        header->joinLock.clear(std::memory_order_relaxed);
+        header->complete = false;
+        header->detached = detached;
+        header->joinWaker = Waker();
+        header->poll = Task::poll;
+        header->moveOutput = Task::moveOutput;
+        header->dropOutput = Task::dropOutput;
+        header->executor = this;
+        header->schedule = schedule;
+        header->release = release;
+        new (task->future) F(args...);
+
+        header->state.store(executor::TaskState::SCHEDULED,
+                            std::memory_order_release);
+        schedule(this, header);
+        return header;
+    }
+
+    // One bit per slot, so allocating and freeing is a single CAS
+    Optional<size_t> allocateSlot() {
+        for (size_t i = 0; i < FREE_WORDS; i++) {
+            uint64_t word = used[i].load(std::memory_order_relaxed);
+            while (~word != 0) {
+                size_t bit = __builtin_ctzll(~word);
+                size_t index = i * 64 + bit;
+                if (index >= MaxTasks) {
+                    break;
+                }
+                if (used[i].compare_exchange_weak(word, word | (1ull << bit),
+                                                  std::memory_order_acquire)) {
+                    return Optional<size_t>::of(index);
+                }
+            }
+        }
+        return Optional<size_t>::empty();
+    }
+
+    static void release(void *data, executor::TaskHeader *task) {
+        Executor *executor = (Executor *)data;
+        size_t index = ((Slot *)task) - executor->slots;
+        task->state.store(executor::TaskState::FREE,
+                          std::memory_order_release);
+        executor->used[index / 64].fetch_and(~(1ull << (index % 64)),
+                                             std::memory_order_release);
+    }
+
+    static Worker *&currentWorker() {
+        static thread_local Worker *worker = nullptr;
+        return worker;
+    }
+
+    // Woken tasks go to the deque of the worker that woke them, if it's one
+    // of ours
+    static void schedule(void *data, executor::TaskHeader *task) {
+        Executor *executor = (Executor *)data;
+        Worker *worker = currentWorker();
+        if (worker == nullptr || worker->executor != executor ||
+            !worker->deque.push(task)) {
+            // Every task is in the injector at most once, so it only looks
+            // full while a pop that was preempted still holds the cell a lap
+            // ahead. Let it finish instead of spinning.
+            for (size_t tries = 0; !executor->injector.push(task); tries++) {
+                if (tries >= INJECTOR_SPINS) {
+                    sched_yield();
+                }
+            }
+        }
+
+        if (executor->sleepers.load(std::memory_order_seq_cst) > 0) {
+            pthread_mutex_lock(&executor->sleepMutex);
+            pthread_cond_signal(&executor->sleepCondition);
+            pthread_mutex_unlock(&executor->sleepMutex);
+        }
+    }
+
+    Optional<executor::TaskHeader *> findTask(Worker *worker) {
+        Optional<executor::TaskHeader *> task = worker->deque.pop();
+        if (task.isPresent()) {
+            return task;
+        }
+        task = injector.pop();
+        if (task.isPresent()) {
+            return task;
+        }
+
+        // Start at a random victim so the thieves spread out
+        worker->random ^= worker->random << 13;
+        worker->random ^= worker->random >> 17;
+        worker->random ^= worker->random << 5;
+        size_t start = worker->random % Workers;
+        for (size_t i = 0; i < Workers; i++) {
+            Worker *victim = &workers[(start + i) % Workers];
+            if (victim == worker) {
+                continue;
+            }
+            task = victim->deque.steal();
+            if (task.isPresent()) {
+                return task;
+            }
+        }
+        return Optional<executor::TaskHeader *>::empty();
+    }
+
+    bool hasTasks() {
+        if (!injector.isEmpty()) {
+            return true;
+        }
+        for (size_t i = 0; i < Workers; i++) {
+            if (!workers[i].deque.isEmpty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void runTask(executor::TaskHeader *task) {
+        task->state.store(executor::TaskState::RUNNING,
+                          std::memory_order_release);
+        Context cx = Context(Waker(task, executor::wakeTask));
+        if (task->poll(task, &cx)) {
+            task->state.store(executor::TaskState::COMPLETE,
+                              std::memory_order_release);
+
+            // Woken under the lock, the join handle and its waker could be gone
+            // as soon as it sees complete
+            task->lock();
+            task->complete = true;
+            bool detached = task->detached;
+            if (!detached) {
+                task->joinWaker.wake();
+            }
+            task->unlock();
+
+            if (detached) {
+                task->dropOutput(task);
+                release(this, task);
+            }
+            return;
+        }
+
+        executor::TaskState state = executor::TaskState::RUNNING;
+        if (!task->state.compare_exchange_strong(state,
+                                                 executor::TaskState::IDLE,
+                                                 std::memory_order_acq_rel)) {
+            // Woken while it was polled
+            task->state.store(executor::TaskState::SCHEDULED,
+                              std::memory_order_release);
+            schedule(this, task);
+        }
+    }
+
+    static void *runWorker(void *data) {
+        Worker *worker = (Worker *)data;
+        Executor *executor = worker->executor;
+        currentWorker() = worker;
+
+        while (!executor->stopping.load(std::memory_order_acquire)) {
+            Optional<executor::TaskHeader *> task = executor->findTask(worker);
+            if (task.isPresent()) {
+                executor->runTask(task.get());
+                continue;
+            }
+
+            // Sleep until a task is scheduled. The sleepers are counted before
+            // checking again, so either we see the task or schedule sees us.
+            pthread_mutex_lock(&executor->sleepMutex);
+            executor->sleepers.fetch_add(1, std::memory_order_seq_cst);
+            if (!executor->hasTasks() &&
+                !executor->stopping.load(std::memory_order_acquire)) {
+                pthread_cond_wait(&executor->sleepCondition,
+                                  &executor->sleepMutex);
+            }
+            executor->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            pthread_mutex_unlock(&executor->sleepMutex);
+        }
+
+        currentWorker() = nullptr;
+        return NULL;
+    }
+
+    std::atomic<bool> stopping{false};
+    std::atomic<size_t> sleepers{0};
+    pthread_mutex_t sleepMutex;
+    pthread_cond_t sleepCondition;
+
+    Injector injector;
+    Worker workers[Workers];
+
+    std::atomic<uint64_t> used[FREE_WORDS] = {};
+    Slot slots[MaxTasks];
+};
+
+#endif
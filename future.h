@@ -30,17 +30,49 @@ class Poll {
     operator bool() { return isReady(); }
 };
 
+// Wakes the task that polled a pending future so that it gets polled again.
+class Waker {
+   public:
+    Waker() : data(nullptr), wakeFn(nullptr) {}
+    Waker(void *data, void (*wakeFn)(void *)) : data(data), wakeFn(wakeFn) {}
+
+    void wake() {
+        if (wakeFn != nullptr) {
+            wakeFn(data);
+        }
+    }
+
+    bool isEmpty() { return wakeFn == nullptr; }
+
+   private:
+    void *data;
+    void (*wakeFn)(void *);
+};
+
+// Passed through every poll. A leaf future that returns pending must make sure
+// that the waker of the context is woken once it can make progress. Futures
+// that only await other futures just pass the context along.
+class Context {
+   public:
+    explicit Context(Waker waker) : waker(waker) {}
+
+    Waker getWaker() { return waker; }
+
+   private:
+    Waker waker;
+};
+
 // After the first call to poll, the future should never be moved or copied.
 template <class Derived, typename Output>
 class Future {
    public:
-    Poll<Output> poll() = delete;
+    Poll<Output> poll(Context *cx) = delete;
 };
 
 template <typename Output>
 class VirtualFuture : public Future<VirtualFuture<Output>, Output> {
    public:
-    Poll<Output> poll() { return Poll<Output>::pending(); }
+    Poll<Output> poll(Context *cx) { return Poll<Output>::pending(); }
 };
 
 template <typename T>
@@ -48,42 +80,79 @@ class Instant : public Future<Instant<T>, T> {
    public:
     explicit Instant(T t) : t(t) {}
 
-    Poll<T> poll() { return Poll<T>::ready(t); }
+    Poll<T> poll(Context *cx) { return Poll<T>::ready(t); }
 
    private:
     T t;
 };
 
+// Atomic, so wakers of blockOn can be woken from other threads, e.g. by a task
+// of the Executor
+static void wakeFlag(void *flag) {
+    __atomic_store_n((bool *)flag, true, __ATOMIC_RELEASE);
+}
+
 namespace template_utils {
 
 template <typename F>
 struct future_output {
-    typedef decltype(declval<typename remove_pointer<F>::type>().poll().get())
-        type;
+    typedef decltype(declval<typename remove_pointer<F>::type>()
+                         .poll(declval<Context *>())
+                         .get()) type;
 };
 
 };  // namespace template_utils
 
-template <typename F>
-typename template_utils::future_output<F>::type blockOn(F future) {
+// Park must have: void park(); which blocks until a waker that was registered
+// by a pending future could have been woken, e.g. by waiting for io events.
+// Parks of servers also have: void unpark(); which may be called from any
+// thread and makes the current or next park return(see RemoteWaker).
+struct SpinPark {
+    // Nothing to wait on, poll again.
+    void park() {}
+    void unpark() {}
+};
+
+// Runs the future to completion. The future is only polled again if its waker
+// was woken, otherwise the thread sleeps in park.
+template <typename F, typename Park>
+typename template_utils::future_output<F>::type blockOn(F future,
+                                                        Park *park) {
     Poll<typename template_utils::future_output<F>::type> poll;
 
-    // This should be compiler optimized
-    if constexpr (template_utils::is_pointer<F>::value) {
-        while ((poll = future->poll()).isPending()) {
+    bool woken = true;
+    Context cx = Context(Waker(&woken, wakeFlag));
+
+    while (true) {
+        __atomic_store_n(&woken, false, __ATOMIC_RELAXED);
+
+        // This should be compiler optimized
+        if constexpr (template_utils::is_pointer<F>::value) {
+            poll = future->poll(&cx);
+        } else {
+            poll = future.poll(&cx);
         }
-    } else {
-        while ((poll = future.poll()).isPending()) {
+        if (poll.isReady()) {
+            return poll.get();
+        }
+
+        if (!__atomic_load_n(&woken, __ATOMIC_ACQUIRE)) {
+            park->park();
         }
     }
+}
 
-    return poll.get();
+// Only use this for futures that never wait on io, like the BufferReader.
+template <typename F>
+typename template_utils::future_output<F>::type blockOn(F future) {
+    SpinPark park;
+    return blockOn(future, &park);
 }
 
 // TODO: Autodected pointers
 #define AWAIT(future, outputName)                                              \
     Poll<typename template_utils::future_output<decltype(future)>::type> poll; \
-    poll = future.poll();                                                      \
+    poll = future.poll(cx);                                                    \
     if (poll.isPending()) {                                                    \
         return Poll<typename template_utils::future_output<                    \
             decltype(this)>::type>::pending();                                 \
@@ -106,7 +175,7 @@ typename template_utils::future_output<F>::type blockOn(F future) {
 
 #define AWAIT_PTR(future, outputName)                                          \
     Poll<typename template_utils::future_output<decltype(future)>::type> poll; \
-    poll = future->poll();                                                     \
+    poll = future->poll(cx);                                                   \
     if (poll.isPending()) {                                                    \
         return Poll<typename template_utils::future_output<                    \
             decltype(this)>::type>::pending();                                 \
@@ -114,4 +183,167 @@ typename template_utils::future_output<F>::type blockOn(F future) {
     typename template_utils::future_output<decltype(future)>::type             \
         outputName = poll.get();
 
+// The wakers that Join and Select give their children. Every child has a bit
+// that its waker sets before waking the parent, so only the woken children
+// are polled again.
+template <size_t Children>
+class ChildWakers {
+    static_assert(Children > 0 && Children <= 64,
+                  "Between 1 and 64 children are supported");
+
+   public:
+    // Returns the bits of the children that were woken since the last call.
+    // Every child counts as woken on the first poll.
+    uint64_t takeWoken(Context *cx) {
+        if (!initialized) {
+            // Now that we won't be moved anymore the wakers can point to us
+            initialized = true;
+            for (size_t i = 0; i < Children; i++) {
+                children[i] = Child{this, (uint64_t)1 << i};
+            }
+            woken = ALL;
+        }
+        parent = cx->getWaker();
+        return __atomic_exchange_n(&woken, 0, __ATOMIC_ACQ_REL);
+    }
+
+    Context contextOf(size_t child) {
+        return Context(Waker(&children[child], wakeChild));
+    }
+
+    static constexpr const uint64_t ALL =
+        Children == 64 ? ~(uint64_t)0 : ((uint64_t)1 << Children) - 1;
+
+   private:
+    struct Child {
+        ChildWakers *wakers;
+        uint64_t bit;
+    };
+
+    static void wakeChild(void *data) {
+        Child *child = (Child *)data;
+        __atomic_fetch_or(&child->wakers->woken, child->bit, __ATOMIC_ACQ_REL);
+        child->wakers->parent.wake();
+    }
+
+    bool initialized = false;
+    uint64_t woken = 0;
+    Waker parent;
+    Child children[Children];
+};
+
+// Polls all futures concurrently and completes with all their outputs once
+// the last one completed.
+template <typename... Fs>
+class Join : public Future<Join<Fs...>,
+                           Tuple<typename template_utils::future_output<
+                               Fs>::type...>> {
+   private:
+    static constexpr const size_t LENGTH = sizeof...(Fs);
+    typedef Tuple<typename template_utils::future_output<Fs>::type...> Output;
+
+   public:
+    explicit Join(Fs... futures)
+        : futures(futures...),
+          outputs(Optional<typename template_utils::future_output<
+                      Fs>::type>::empty()...) {}
+
+    Poll<Output> poll(Context *cx) {
+        uint64_t woken = wakers.takeWoken(cx);
+        pollChildren<0>(woken & ~done);
+        if (done != ChildWakers<LENGTH>::ALL) {
+            return Poll<Output>::pending();
+        }
+        READY(collect(typename template_utils::make_index_pack<LENGTH>::type()))
+    }
+
+   private:
+    template <size_t Index>
+    void pollChildren(uint64_t woken) {
+        if constexpr (Index < LENGTH) {
+            if (woken & ((uint64_t)1 << Index)) {
+                Context cx = wakers.contextOf(Index);
+                auto poll = futures.template atPtr<Index>()->poll(&cx);
+                if (poll.isReady()) {
+                    *outputs.template atPtr<Index>() =
+                        decltype(outputs.template at<Index>())::of(poll.get());
+                    done |= (uint64_t)1 << Index;
+                }
+            }
+            pollChildren<Index + 1>(woken);
+        }
+    }
+
+    template <size_t... Indices>
+    Output collect(template_utils::index_pack<Indices...>) {
+        return Output(outputs.template atPtr<Indices>()->get()...);
+    }
+
+    Tuple<Fs...> futures;
+    Tuple<Optional<typename template_utils::future_output<Fs>::type>...>
+        outputs;
+    uint64_t done = 0;
+    ChildWakers<LENGTH> wakers;
+};
+
+// The output of the future that completed first in a Select
+template <typename... Ts>
+struct Selected {
+    size_t index;
+    Union<Ts...> value;
+
+    template <size_t Index>
+    typename template_utils::pack<Ts...>::template N<Index> get() {
+        return value.template as<
+            typename template_utils::pack<Ts...>::template N<Index>>();
+    }
+};
+
+// Polls all futures concurrently and completes with the output of the first
+// one that completes. The others are never polled again.
+template <typename... Fs>
+class Select
+    : public Future<Select<Fs...>,
+                    Selected<typename template_utils::future_output<
+                        Fs>::type...>> {
+   private:
+    static constexpr const size_t LENGTH = sizeof...(Fs);
+    typedef Selected<typename template_utils::future_output<Fs>::type...>
+        Output;
+
+   public:
+    explicit Select(Fs... futures) : futures(futures...) {}
+
+    Poll<Output> poll(Context *cx) {
+        uint64_t woken = wakers.takeWoken(cx);
+        Output output;
+        if (pollChildren<0>(woken, &output)) {
+            READY(output)
+        }
+        return Poll<Output>::pending();
+    }
+
+   private:
+    // Returns if a child completed
+    template <size_t Index>
+    bool pollChildren(uint64_t woken, Output *output) {
+        if constexpr (Index < LENGTH) {
+            if (woken & ((uint64_t)1 << Index)) {
+                Context cx = wakers.contextOf(Index);
+                auto poll = futures.template atPtr<Index>()->poll(&cx);
+                if (poll.isReady()) {
+                    output->index = Index;
+                    output->value.set(poll.get());
+                    return true;
+                }
+            }
+            return pollChildren<Index + 1>(woken, output);
+        }
+        return false;
+    }
+
+    Tuple<Fs...> futures;
+    ChildWakers<LENGTH> wakers;
+};
+
 #endif
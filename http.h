@@ -1,6 +1,8 @@
 #ifndef CPP_ASYNC_HTTP_HTTP_H
 #define CPP_ASYNC_HTTP_HTTP_H
 
+#include <stdint.h>
+
 #include <new>
 
 #include "future.h"
@@ -51,47 +53,150 @@ struct BufferHttpPathStore {
 struct HttpRequestStatusLine {
     HttpVersion version;
     HttpMethod method;
+    // Set by the caller of ReadHttpRequestStatusLine if the path store is
+    // kept alive for the request
+    BufferRef path = BufferRef();
 };
 
-template <typename PathStore>
-class ReadHttpRequestStatusLine : Future<ReadHttpRequestStatusLine<PathStore>,
-                                         Optional<HttpRequestStatusLine>> {
+namespace http_token {
+
+// Methods and versions are at most 8 chars, so a token fits into one word.
+// The chars are placed like memcpy would place them, so a token that was
+// read from a buffer can be compared with the packed constants directly.
+constexpr uint64_t pack(const char *token) {
+    uint64_t word = 0;
+    for (size_t i = 0; i < 8 && token[i] != '\0'; i++) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word |= (uint64_t)(unsigned char)token[i] << (8 * (7 - i));
+#else
+        word |= (uint64_t)(unsigned char)token[i] << (8 * i);
+#endif
+    }
+    return word;
+}
+
+// 0 if the token can't be one of ours. Trailing '\0's would pack like a
+// shorter token, none of ours ends with one.
+inline uint64_t load(BufferRef token) {
+    uint64_t word = 0;
+    if (token.length > 0 && token.length <= 8 &&
+        token.data[token.length - 1] != '\0') {
+        memcpy(&word, token.data, token.length);
+    }
+    return word;
+}
+
+}  // namespace http_token
+
+Optional<HttpMethod> httpMethodFromBuffer(BufferRef buf) {
+    switch (http_token::load(buf)) {
+        case http_token::pack("GET"):
+            return Optional<HttpMethod>::of(HttpMethod::GET);
+        case http_token::pack("POST"):
+            return Optional<HttpMethod>::of(HttpMethod::POST);
+        case http_token::pack("PUT"):
+            return Optional<HttpMethod>::of(HttpMethod::PUT);
+        case http_token::pack("DELETE"):
+            return Optional<HttpMethod>::of(HttpMethod::DELETE);
+        case http_token::pack("HEAD"):
+            return Optional<HttpMethod>::of(HttpMethod::HEAD);
+        case http_token::pack("OPTIONS"):
+            return Optional<HttpMethod>::of(HttpMethod::OPTIONS);
+        case http_token::pack("TRACE"):
+            return Optional<HttpMethod>::of(HttpMethod::TRACE);
+        case http_token::pack("CONNECT"):
+            return Optional<HttpMethod>::of(HttpMethod::CONNECT);
+        case http_token::pack("PATCH"):
+            return Optional<HttpMethod>::of(HttpMethod::PATCH);
+    }
+    return Optional<HttpMethod>::empty();
+}
+
+Optional<HttpVersion> httpVersionFromBuffer(BufferRef buf) {
+    switch (http_token::load(buf)) {
+        case http_token::pack("HTTP/1.0"):
+            return Optional<HttpVersion>::of(HttpVersion::HTTP_1_0);
+        case http_token::pack("HTTP/1.1"):
+            return Optional<HttpVersion>::of(HttpVersion::HTTP_1_1);
+        case http_token::pack("HTTP/2.0"):
+            return Optional<HttpVersion>::of(HttpVersion::HTTP_2_0);
+    }
+    return Optional<HttpVersion>::empty();
+}
+
+// Content-Length is only decimal digits, so signs, fractions and exponents
+// are invalid. Empty if the value isn't one or doesn't fit into a size_t.
+Optional<size_t> httpContentLengthFromBuffer(BufferRef buf) {
+    if (buf.length == 0) {
+        return Optional<size_t>::empty();
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < buf.length; i++) {
+        char c = buf.data[i];
+        if (c < '0' || c > '9') {
+            return Optional<size_t>::empty();
+        }
+        size_t digit = (size_t)(c - '0');
+        if (length > (~(size_t)0 - digit) / 10) {
+            return Optional<size_t>::empty();
+        }
+        length = length * 10 + digit;
+    }
+    return Optional<size_t>::of(length);
+}
+
+// Returns if the comma separated list of a header value(e.g. of Connection)
+// contains token. The case is ignored.
+bool httpHeaderHasToken(BufferRef value, const char *token) {
+    size_t start = 0;
+    while (start < value.length) {
+        size_t end = start;
+        while (end < value.length && value.data[end] != ',') {
+            end++;
+        }
+        size_t tokenStart = start;
+        size_t tokenEnd = end;
+        while (tokenStart < tokenEnd &&
+               isCharWhitespace(value.data[tokenStart])) {
+            tokenStart++;
+        }
+        while (tokenEnd > tokenStart &&
+               isCharWhitespace(value.data[tokenEnd - 1])) {
+            tokenEnd--;
+        }
+
+        BufferRef current =
+            BufferRef(value.data + tokenStart, tokenEnd - tokenStart);
+        if (current.equalsIgnoreCase(token)) {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+template <typename PathStore, typename R = Reader>
+class ReadHttpRequestStatusLine
+    : Future<ReadHttpRequestStatusLine<PathStore, R>,
+             Optional<HttpRequestStatusLine>> {
    public:
-    ReadHttpRequestStatusLine(Reader *reader, PathStore *pathStore)
+    ReadHttpRequestStatusLine(R *reader, PathStore *pathStore)
         : init{reader}, pathStore(pathStore) {}
 
-    Poll<Optional<HttpRequestStatusLine>> poll() {
+    Poll<Optional<HttpRequestStatusLine>> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
-                INIT_AWAIT(READ_METHOD, readIntoBuffer,
-                           ReadIntoWhile<bool (*)(char)>(init.reader, buffer,
-                                                         BUFFER_LENGTH,
-                                                         isCharNotWhitespace),
-                           len)
-                BufferRef buf = BufferRef(buffer, len);
-                if (buf == HttpConsts::GET) {
-                    statusLine.method = HttpMethod::GET;
-                } else if (buf == HttpConsts::POST) {
-                    statusLine.method = HttpMethod::POST;
-                } else if (buf == HttpConsts::PUT) {
-                    statusLine.method = HttpMethod::PUT;
-                } else if (buf == HttpConsts::DELETE) {
-                    statusLine.method = HttpMethod::DELETE;
-                } else if (buf == HttpConsts::HEAD) {
-                    statusLine.method = HttpMethod::HEAD;
-                } else if (buf == HttpConsts::OPTIONS) {
-                    statusLine.method = HttpMethod::OPTIONS;
-                } else if (buf == HttpConsts::TRACE) {
-                    statusLine.method = HttpMethod::TRACE;
-                } else if (buf == HttpConsts::CONNECT) {
-                    statusLine.method = HttpMethod::CONNECT;
-                } else if (buf == HttpConsts::PATCH) {
-                    statusLine.method = HttpMethod::PATCH;
-                } else {
+                auto future = ReadIntoWhile<bool (*)(char), R>(
+                    init.reader, buffer, BUFFER_LENGTH, isCharNotWhitespace);
+                INIT_AWAIT(READ_METHOD, readIntoBuffer, future, len)
+                Optional<HttpMethod> method =
+                    httpMethodFromBuffer(BufferRef(buffer, len));
+                if (method.isEmpty()) {
                     READY(Optional<HttpRequestStatusLine>::empty())
                 }
+                statusLine.method = method.get();
 
-                Reader *reader = readIntoBuffer.getReader();
+                R *reader = readIntoBuffer.getReader();
 
                 INIT_AWAIT(READ_REQUEST_SPACE, readChar, ReadChar(reader),
                            result)
@@ -102,14 +207,19 @@ class ReadHttpRequestStatusLine : Future<ReadHttpRequestStatusLine<PathStore>,
                     READY(Optional<HttpRequestStatusLine>::empty())
                 }
 
-                Reader *reader = readChar.getReader();
+                R *reader = readChar.getReader();
 
-                auto future = ReadIntoStoreWhile<PathStore, bool (*)(char)>(
-                    reader, pathStore, isCharNotWhitespace);
+                auto future =
+                    ReadIntoStoreWhile<PathStore, bool (*)(char), R>(
+                        reader, pathStore, isCharNotWhitespace);
                 INIT_AWAIT(READ_REQUEST, readIntoPathStoreWhile, future, result)
-                // result is void_
+                // The path doesn't fit into the store
+                if (!result) {
+                    pathTooLong = true;
+                    READY(Optional<HttpRequestStatusLine>::empty())
+                }
 
-                Reader *reader = readIntoPathStoreWhile.getReader();
+                R *reader = readIntoPathStoreWhile.getReader();
 
                 INIT_AWAIT(READ_VERSION_SPACE, readChar, ReadChar(reader),
                            result)
@@ -120,26 +230,19 @@ class ReadHttpRequestStatusLine : Future<ReadHttpRequestStatusLine<PathStore>,
                     READY(Optional<HttpRequestStatusLine>::empty())
                 }
 
-                Reader *reader = readChar.getReader();
-
-                INIT_AWAIT(
-                    READ_VERSION, readIntoBuffer,
-                    ReadIntoWhile<bool (*)(char)>(reader, buffer, BUFFER_LENGTH,
-                                                  isCharNotWhitespace),
-                    len)
-                BufferRef buf = BufferRef(buffer, len);
-
-                if (buf == HttpConsts::HTTP_1_0) {
-                    statusLine.version = HttpVersion::HTTP_1_0;
-                } else if (buf == HttpConsts::HTTP_1_1) {
-                    statusLine.version = HttpVersion::HTTP_1_1;
-                } else if (buf == HttpConsts::HTTP_2_0) {
-                    statusLine.version = HttpVersion::HTTP_2_0;
-                } else {
+                R *reader = readChar.getReader();
+
+                auto future = ReadIntoWhile<bool (*)(char), R>(
+                    reader, buffer, BUFFER_LENGTH, isCharNotWhitespace);
+                INIT_AWAIT(READ_VERSION, readIntoBuffer, future, len)
+                Optional<HttpVersion> version =
+                    httpVersionFromBuffer(BufferRef(buffer, len));
+                if (version.isEmpty()) {
                     READY(Optional<HttpRequestStatusLine>::empty())
                 }
+                statusLine.version = version.get();
 
-                Reader *reader = readIntoBuffer.getReader();
+                R *reader = readIntoBuffer.getReader();
 
                 INIT_AWAIT(READ_CRLF, readCrlf, ReadCrlf(reader), result)
                 if (result.isEmpty()) {
@@ -155,6 +258,10 @@ class ReadHttpRequestStatusLine : Future<ReadHttpRequestStatusLine<PathStore>,
         return Poll<Optional<HttpRequestStatusLine>>::pending();
     }
 
+    // If an empty status line means the path was longer than the store, the
+    // request may have been valid otherwise
+    bool isPathTooLong() { return pathTooLong; }
+
    private:
     static const size_t MAX_METHOD_LENGTH = 7;
     static const size_t MAX_VERSION_LENGTH = 8;
@@ -171,36 +278,37 @@ class ReadHttpRequestStatusLine : Future<ReadHttpRequestStatusLine<PathStore>,
         READ_CRLF
     } state = State::INIT;
     PathStore *pathStore;
+    bool pathTooLong = false;
     // TODO: optimize for memory
     char buffer[BUFFER_LENGTH];
 
     HttpRequestStatusLine statusLine;
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
-        ReadChar readChar;
-        ReadIntoWhile<bool (*)(char)> readIntoBuffer;
-        ReadIntoStoreWhile<PathStore, bool (*)(char)> readIntoPathStoreWhile;
-        ReadCrlf readCrlf;
+        ReadChar<R> readChar;
+        ReadIntoWhile<bool (*)(char), R> readIntoBuffer;
+        ReadIntoStoreWhile<PathStore, bool (*)(char), R> readIntoPathStoreWhile;
+        ReadCrlf<R> readCrlf;
     };
 };
 
 template <typename HeaderNameStore, typename HeaderValueStore,
-          typename HeaderVisitor>
+          typename HeaderVisitor, typename R = Reader>
 class ReadHttpHeaders
-    : ReadFuture<
-          ReadHttpHeaders<HeaderNameStore, HeaderValueStore, HeaderVisitor>,
-          bool> {
+    : ReadFuture<ReadHttpHeaders<HeaderNameStore, HeaderValueStore,
+                                 HeaderVisitor, R>,
+                 bool> {
    public:
-    ReadHttpHeaders(Reader *reader, HeaderNameStore nameStore,
+    ReadHttpHeaders(R *reader, HeaderNameStore nameStore,
                     HeaderValueStore valueStore, HeaderVisitor visitor)
         : init{reader},
           nameStore(nameStore),
           valueStore(valueStore),
           visitor(visitor) {}
 
-    Reader *getReader() {
+    R *getReader() {
         switch (state) {
             case State::INIT:
                 return init.reader;
@@ -226,29 +334,29 @@ class ReadHttpHeaders
         return nullptr;
     }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
             init : {}
                 headerSuccessfullyParsed = true;
 
-                Reader *reader = getReader();
+                R *reader = getReader();
 
                 auto future =
-                    ReadIntoStoreWhile<HeaderNameStore, bool (*)(char)>(
+                    ReadIntoStoreWhile<HeaderNameStore, bool (*)(char), R>(
                         reader, &nameStore, isCharNotWhitespaceOrColon);
                 INIT_AWAIT(HEADER_NAME_STORE, readNameWhile, future, result)
                 if (!result) {
                     headerSuccessfullyParsed = false;
                 }
 
-                Reader *reader = readNameWhile.getReader();
-                INIT_AWAIT(HEADER_TO_COLON, readWhile,
-                           ReadWhile<bool (*)(char)>(reader, isCharNotColon),
-                           result)
+                R *reader = readNameWhile.getReader();
+                auto future =
+                    ReadWhile<bool (*)(char), R>(reader, isCharNotColon);
+                INIT_AWAIT(HEADER_TO_COLON, readWhile, future, result)
                 // result is void_
 
-                Reader *reader = readWhile.getReader();
+                R *reader = readWhile.getReader();
                 INIT_AWAIT(HEADER_COLON, readChar, ReadChar(reader), result)
                 if (result.isEmpty()) {
                     READY(false)
@@ -258,15 +366,17 @@ class ReadHttpHeaders
                     READY(false)
                 }
 
-                Reader *reader = readChar.getReader();
-                INIT_AWAIT(HEADER_VALUE_SPACES, readWhile,
-                           ReadWhile<bool (*)(char)>(reader, isCharWhitespace),
-                           result)
+                R *reader = readChar.getReader();
+                auto future =
+                    ReadWhile<bool (*)(char), R>(reader, isCharWhitespace);
+                INIT_AWAIT(HEADER_VALUE_SPACES, readWhile, future, result)
 
-                Reader *reader = readWhile.getReader();
+                // The whole rest of the line, values can contain spaces. The
+                // visitor gets the trailing whitespace too.
+                R *reader = readWhile.getReader();
                 auto future =
-                    ReadIntoStoreWhile<HeaderValueStore, bool (*)(char)>(
-                        reader, &valueStore, isCharNotWhitespace);
+                    ReadIntoStoreWhile<HeaderValueStore, bool (*)(char), R>(
+                        reader, &valueStore, isCharNotCr);
                 INIT_AWAIT(HEADER_VALUE_STORE, readValueWhile, future, result)
                 if (!result) {
                     headerSuccessfullyParsed = false;
@@ -276,7 +386,7 @@ class ReadHttpHeaders
                     goto initHeaderToCr;
                 }
 
-                Reader *reader = readValueWhile.getReader();
+                R *reader = readValueWhile.getReader();
                 state = State::HEADER_VISITOR;
                 visit = {reader, visitor.visit(&nameStore, &valueStore)};
             }
@@ -287,21 +397,21 @@ class ReadHttpHeaders
                 nameStore.clear();
                 valueStore.clear();
 
-                Reader *reader = getReader();
+                R *reader = getReader();
                 state = State::HEADER_TO_CR;
-                readWhile = ReadWhile<bool (*)(char)>(reader, isCharNotCr);
+                readWhile = ReadWhile<bool (*)(char), R>(reader, isCharNotCr);
             }
             case State::HEADER_TO_CR: {
                 AWAIT(readWhile, result)
                 // result is void_
 
-                Reader *reader = readWhile.getReader();
+                R *reader = readWhile.getReader();
                 INIT_AWAIT(HEADER_CRLF, readCrlf, ReadCrlf(reader), result)
                 if (result.isEmpty() || !result.get()) {
                     READY(false)
                 }
 
-                Reader *reader = readCrlf.getReader();
+                R *reader = readCrlf.getReader();
                 INIT_AWAIT(HEADERS_END_CRLF, readCrlf, ReadCrlf(reader), result)
                 if (result.isEmpty()) {
                     READY(false)
@@ -347,16 +457,16 @@ class ReadHttpHeaders
                                     // called.
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
-        ReadIntoStoreWhile<HeaderNameStore, bool (*)(char)> readNameWhile;
-        ReadIntoStoreWhile<HeaderValueStore, bool (*)(char)> readValueWhile;
-        ReadWhile<bool (*)(char)> readWhile;
-        ReadChar readChar;
-        ReadCrlf readCrlf;
+        ReadIntoStoreWhile<HeaderNameStore, bool (*)(char), R> readNameWhile;
+        ReadIntoStoreWhile<HeaderValueStore, bool (*)(char), R> readValueWhile;
+        ReadWhile<bool (*)(char), R> readWhile;
+        ReadChar<R> readChar;
+        ReadCrlf<R> readCrlf;
 
         struct {
-            Reader *reader;
+            R *reader;
             typename HeaderVisitor::VisitFuture future;
         } visit;
     };
@@ -367,19 +477,21 @@ struct HttpResponseStatusLine {
     unsigned short code;
 };
 
-class WriteHttpResponseStatusLine : Future<WriteHttpResponseStatusLine, bool> {
+template <typename W = Writer>
+class WriteHttpResponseStatusLine
+    : Future<WriteHttpResponseStatusLine<W>, bool> {
    public:
-    WriteHttpResponseStatusLine(Writer *writer,
+    WriteHttpResponseStatusLine(W *writer,
                                 HttpResponseStatusLine statusLine,
                                 BufferRef reason)
         : init({writer}), statusLine(statusLine), reason(reason) {}
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 BufferRef buffer = getVersionBuffer();
 
-                Writer *writer = init.writer;
+                W *writer = init.writer;
                 state = State::WRITE_VERSION;
                 writeFromBuffer =
                     writer->writeFromBuffer(buffer.data, buffer.length);
@@ -390,7 +502,7 @@ class WriteHttpResponseStatusLine : Future<WriteHttpResponseStatusLine, bool> {
                     READY(false)
                 }
 
-                Writer *writer = writeFromBuffer->getWriter();
+                W *writer = writeFromBuffer->getWriter();
                 INIT_AWAIT(WRITE_CODE_SPACE, writeChar, WriteChar(writer, ' '),
                            result)
 
@@ -398,21 +510,21 @@ class WriteHttpResponseStatusLine : Future<WriteHttpResponseStatusLine, bool> {
                     READY(false)
                 }
 
-                Writer *writer = writeChar.getWriter();
-                INIT_AWAIT(WRITE_CODE, writeDouble,
-                           WriteDouble<10>(writer, statusLine.code), result)
+                W *writer = writeChar.getWriter();
+                auto future = WriteDouble<10, W>(writer, statusLine.code);
+                INIT_AWAIT(WRITE_CODE, writeDouble, future, result)
                 if (!result) {
                     READY(false)
                 }
 
-                Writer *writer = writeDouble.getWriter();
+                W *writer = writeDouble.getWriter();
                 INIT_AWAIT(WRITE_REASON_SPACE, writeChar,
                            WriteChar(writer, ' '), result)
                 if (!result) {
                     READY(false)
                 }
 
-                Writer *writer = writeChar.getWriter();
+                W *writer = writeChar.getWriter();
                 state = State::WRITE_REASON;
                 writeFromBuffer =
                     writer->writeFromBuffer(reason.data, reason.length);
@@ -423,7 +535,7 @@ class WriteHttpResponseStatusLine : Future<WriteHttpResponseStatusLine, bool> {
                     READY(false)
                 }
 
-                Writer *writer = writeFromBuffer->getWriter();
+                W *writer = writeFromBuffer->getWriter();
                 INIT_AWAIT(WRITE_CRLF, writeCrlf, WriteCrlf(writer), result)
                 if (!result) {
                     READY(false)
@@ -468,12 +580,12 @@ class WriteHttpResponseStatusLine : Future<WriteHttpResponseStatusLine, bool> {
     BufferRef reason;
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteDouble<10> writeDouble;
-        WriteChar writeChar;
-        WriteFromBuffer *writeFromBuffer;
-        WriteCrlf writeCrlf;
+        WriteDouble<10, W> writeDouble;
+        WriteChar<W> writeChar;
+        typename writer_ops<W>::WriteFromBuffer *writeFromBuffer;
+        WriteCrlf<W> writeCrlf;
     };
 };
 
@@ -1,17 +1,25 @@
 #ifndef CPP_ASYNC_HTTP_HTTP_HANDLER_H
 #define CPP_ASYNC_HTTP_HTTP_HANDLER_H
 
+#include "arena.h"
 #include "buffer.h"
 #include "http.h"
+#include "http_head.h"
+#include "http_header_id.h"
 #include "json.h"
 #include "reader.h"
+#include "remote_waker.h"
 #include "utils.h"
 #include "writer.h"
 
 class HttpRequest {
    public:
-    HttpRequest(Reader* reader, Writer* writer)
-        : bodyReader(reader), responseWriter(writer) {}
+    HttpRequest(Reader* reader, Writer* writer, Arena* arena = nullptr,
+                RemoteWaker* remoteWaker = nullptr)
+        : bodyReader(reader),
+          responseWriter(writer),
+          arena(arena),
+          remoteWaker(remoteWaker) {}
 
     Optional<Reader*> tryTakeBody() {
         if (!bodyTaken) {
@@ -30,11 +38,21 @@ class HttpRequest {
 
     bool isResponseWritten() { return responseWritten; }
 
+    // Memory that lives until the response is written, nullptr if the request
+    // has none
+    Arena* getArena() { return arena; }
+
+    // Wakes the request from other threads, nullptr if the server that
+    // handles it has none
+    RemoteWaker* getRemoteWaker() { return remoteWaker; }
+
    private:
     bool bodyTaken = false;
     Reader* bodyReader;
     bool responseWritten = false;
     Writer* responseWriter;
+    Arena* arena;
+    RemoteWaker* remoteWaker;
 };
 
 // This struct can extract data from the http request
@@ -50,7 +68,11 @@ struct http_extractor {
     static const size_t MAX_HEADER_NAME = 0;
     static const size_t MAX_HEADER_VALUE = 0;
 
-    static void extractHeader(T* extractor, BufferRef headerName,
+    // The headers that are passed to extractHeader, see headerMask. Headers
+    // without an id are passed if it contains HeaderId::OTHER.
+    static constexpr const uint64_t HEADER_IDS = 0;
+
+    static void extractHeader(T* extractor, HeaderId id, BufferRef headerName,
                               BufferRef headerValue) {
         return;
     }
@@ -63,9 +85,12 @@ struct http_extractor {
 
 template <typename T>
 struct http_response {
-    typedef Future<void_, void_> RespondFuture;
+    template <typename W>
+    class RespondFuture : Future<void_, void_> {};
 
-    RespondFuture respond(Writer* writer, T response) = delete;
+    // W is the writer type of the connection(Writer or a final writer)
+    template <typename W>
+    static RespondFuture<W> respond(W* writer, T response) = delete;
 };
 
 template <typename T>
@@ -91,12 +116,129 @@ class HeaderVisitorExample {
     VisitFuture visit(HeaderNameStore* nameStore, HeaderValueStore* valueStore);
 };
 
-template <typename Handler,
+// The requests of a connection that are pipelined(already buffered behind the
+// current one) share one send for their responses. At most maxUnflushed
+// responses wait for it, the last one of the batch flushes.
+struct HttpPipeline {
+    size_t maxUnflushed;
+    size_t unflushed = 0;
+};
+
+// Writes the response of a request to W and inserts a header right after its
+// status line, e.g. a Connection header when the connection isn't handled the
+// way the client assumes by default. The handlers write their responses as
+// they like, so the status line is found in the written bytes.
+template <typename W>
+class ConnectionHeaderWriter final : public Writer {
+   private:
+    class WriteFromBufferImpl final : public WriteFromBuffer {
+       public:
+        WriteFromBufferImpl() {}
+        WriteFromBufferImpl(ConnectionHeaderWriter<W>* writer,
+                            const char* buffer, size_t length)
+            : writer(writer), buffer(buffer), length(length) {}
+
+        ConnectionHeaderWriter<W>* getWriter() override { return writer; }
+
+        const char* getBuffer() override { return buffer; }
+
+        size_t getBufferLength() override { return length; }
+
+        Poll<size_t> poll(Context* cx) override {
+            while (true) {
+                if (inner == nullptr) {
+                    if (writer->phase == Phase::HEADER) {
+                        innerLength = writer->headerLength;
+                        inner = writer->writer->writeFromBuffer(writer->header,
+                                                                innerLength);
+                    } else if (written < length) {
+                        innerLength = length - written;
+                        if (writer->phase == Phase::STATUS_LINE) {
+                            // Up to the end of the status line
+                            const char* end = (const char*)memchr(
+                                buffer + written, '\n', innerLength);
+                            if (end != nullptr) {
+                                innerLength = end + 1 - (buffer + written);
+                            }
+                        }
+                        inner = writer->writer->writeFromBuffer(
+                            buffer + written, innerLength);
+                    } else {
+                        return Poll<size_t>::ready(written);
+                    }
+                }
+
+                Poll<size_t> poll = inner->poll(cx);
+                if (poll.isPending()) {
+                    return Poll<size_t>::pending();
+                }
+                inner = nullptr;
+                if (writer->phase == Phase::HEADER) {
+                    if (poll.get() != innerLength) {
+                        return Poll<size_t>::ready(written);
+                    }
+                    writer->phase = Phase::BODY;
+                    continue;
+                }
+                written += poll.get();
+                if (poll.get() != innerLength) {
+                    return Poll<size_t>::ready(written);
+                }
+                if (writer->phase == Phase::STATUS_LINE &&
+                    buffer[written - 1] == '\n') {
+                    writer->phase = Phase::HEADER;
+                }
+            }
+        }
+
+       private:
+        ConnectionHeaderWriter<W>* writer = nullptr;
+        const char* buffer = nullptr;
+        size_t length = 0;
+        size_t written = 0;
+        typename writer_ops<W>::WriteFromBuffer* inner = nullptr;
+        size_t innerLength = 0;
+    };
+
+   public:
+    explicit ConnectionHeaderWriter(W* writer) : writer(writer) {}
+
+    // The header line including its CRLF, nullptr writes the response as is.
+    // Must be set before the response is written.
+    void setHeader(const char* header) {
+        this->header = header;
+        headerLength = header == nullptr ? 0 : stringLength(header);
+        phase = header == nullptr ? Phase::BODY : Phase::STATUS_LINE;
+    }
+
+    WriteFromBufferImpl* writeFromBuffer(const char* buffer,
+                                         size_t length) override {
+        writeOp = WriteFromBufferImpl(this, buffer, length);
+        return &writeOp;
+    }
+
+    typename writer_ops<W>::Flush* flush() override { return writer->flush(); }
+
+   private:
+    enum class Phase { STATUS_LINE, HEADER, BODY };
+
+    W* writer;
+    const char* header = nullptr;
+    size_t headerLength = 0;
+    Phase phase = Phase::BODY;
+    WriteFromBufferImpl writeOp;
+};
+
+// R and W are the reader/writer types of the connection. The headers and the
+// response are read/written with them directly, extractors get the virtual
+// Reader/Writer through HttpRequest. The arena is handed to the extractors as
+// well, its owner resets it between requests.
+template <typename Handler, typename R = Reader, typename W = Writer,
           typename = typename http_handler<Handler>::Extractors>
 class HandleHttpRequest : Future<void_, void_> {};
 
-template <typename Handler, typename... Extractors>
-class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
+template <typename Handler, typename R, typename W, typename... Extractors>
+class HandleHttpRequest<Handler, R, W, template_utils::pack<Extractors...>> {
    private:
     typedef typename http_handler<Handler>::HandleFuture HandleFuture;
     typedef typename http_handler<Handler>::Response Response;
@@ -104,17 +246,63 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
     static constexpr const size_t extractorsLength =
         template_utils::pack<Extractors...>::length;
 
+    // Needed for the framing headers (Content-Length, Connection,
+    // Transfer-Encoding). Longer values are cut when the headers are read
+    // with the state machines, see visitFramingHeader.
+    static constexpr const size_t FRAMING_HEADER_NAME =
+        template_utils::const_str_length("Transfer-Encoding");
+    static constexpr const size_t FRAMING_HEADER_VALUE = 64;
+
+    static constexpr const char* BAD_REQUEST_RESPONSE =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
     static constexpr const size_t MAX_HEADER_NAME = template_utils::max_value<
-        size_t, 0, http_extractor<Extractors>::MAX_HEADER_NAME...>::value;
+        size_t, FRAMING_HEADER_NAME,
+        http_extractor<Extractors>::MAX_HEADER_NAME...>::value;
     static constexpr const size_t MAX_HEADER_VALUE = template_utils::max_value<
-        size_t, 0, http_extractor<Extractors>::MAX_HEADER_VALUE...>::value;
+        size_t, FRAMING_HEADER_VALUE,
+        http_extractor<Extractors>::MAX_HEADER_VALUE...>::value;
 
-   public:
-    HandleHttpRequest(HttpRequestStatusLine statusLine, Reader* reader,
-                      Writer* writer)
-        : reader(reader), writer(writer), init({statusLine}) {}
+    // The headers any extractor wants
+    static constexpr const uint64_t HEADER_IDS =
+        (http_extractor<Extractors>::HEADER_IDS | ... | (uint64_t)0);
 
-    Poll<void_> poll() {
+   public:
+    HandleHttpRequest(HttpRequestStatusLine statusLine, R* reader, W* writer,
+                      HttpPipeline* pipeline = nullptr, Arena* arena = nullptr,
+                      RemoteWaker* remoteWaker = nullptr)
+        : reader(reader),
+          writer(writer),
+          pipeline(pipeline),
+          arena(arena),
+          remoteWaker(remoteWaker),
+          responseWriter(writer),
+          version(statusLine.version),
+          body(reader, 0),
+          init({statusLine}) {}
+    // The head was already parsed with parseHttpRequestHead and is still in the
+    // buffer of the reader. It's consumed after the headers were extracted.
+    template <size_t MaxHeaders>
+    HandleHttpRequest(HttpRequestHead<MaxHeaders>* head, R* reader, W* writer,
+                      HttpPipeline* pipeline = nullptr, Arena* arena = nullptr,
+                      RemoteWaker* remoteWaker = nullptr)
+        : reader(reader),
+          writer(writer),
+          pipeline(pipeline),
+          arena(arena),
+          remoteWaker(remoteWaker),
+          responseWriter(writer),
+          version(head->statusLine.version),
+          body(reader, 0),
+          init({head->statusLine, head->headers, head->headersLength,
+                head->length}) {}
+
+    // Returns if the connection can be used for the next request. The body of
+    // the request was read completely in that case.
+    Poll<bool> poll(Context* cx) {
         switch (state) {
             case State::INIT: {
                 extractors = Tuple<Extractors...>(
@@ -122,33 +310,55 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
                 if constexpr (Tuple<Extractors...>::length > 0) {
                     extractStatusLine(init.statusLine, &extractors);
                 }
+                if (init.headers != nullptr) {
+                    extractHeaders(init.headers, init.headersLength);
+                    reader->consume(init.headLength);
+                    goto initExtract;
+                }
 
                 auto future = ReadHttpHeaders<SizedBuffer<MAX_HEADER_NAME>,
-                                              SizedBuffer<MAX_HEADER_VALUE>,
-                                              HeaderVisitor>(
-                    reader, SizedBuffer<MAX_HEADER_NAME>(),
-                    SizedBuffer<MAX_HEADER_VALUE>(),
+                                              HeaderValueStore, HeaderVisitor,
+                                              R>(
+                    reader, SizedBuffer<MAX_HEADER_NAME>(), HeaderValueStore(),
                     HeaderVisitor{.handle = this});
                 INIT_AWAIT(HEADERS, readHeaders, future, result)
                 if (!result) {
                     READY(false)
                 }
+            }
+            initExtract: {
+                if (invalidFraming) {
+                    goto initBadRequest;
+                }
+                // The body can't be found without the length, so read it till
+                // the connection is closed
+                body = LimitedReader<R>(
+                    reader, hasTransferEncoding ? ~(size_t)0 : contentLength);
+
+                // HTTP/1.0 clients only keep the connection if told so, and
+                // HTTP/1.1 clients are told when it's closed after all
+                if (!isKeepAlive()) {
+                    responseWriter.setHeader("Connection: close\r\n");
+                } else if (version == HttpVersion::HTTP_1_0) {
+                    responseWriter.setHeader("Connection: keep-alive\r\n");
+                }
 
                 state = State::EXTRACT;
                 extractFutures.extractor = 0;
-                extractFutures.request = HttpRequest(reader, writer);
+                extractFutures.request =
+                    HttpRequest(&body, &responseWriter, arena, remoteWaker);
             }
             case State::EXTRACT: {
-                Poll<bool> poll = extractPoll();
+                Poll<bool> poll = extractPoll(cx);
                 if (poll.isPending()) {
-                    return Poll<void_>::pending();
+                    return Poll<bool>::pending();
                 }
                 bool result = poll.get();
                 if (!result) {
-                    READY(void_())
+                    goto initFlush;
                 }
                 if (extractFutures.request.isResponseWritten()) {
-                    READY(void_())
+                    goto initFlush;
                 }
 
                 struct HandleFutureCaller {
@@ -162,13 +372,49 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
                 INIT_AWAIT(HANDLE, handleFuture, future, response)
 
                 auto future =
-                    http_response<Response>::respond(writer, response);
+                    http_response<Response>::respond(&responseWriter, response);
                 INIT_AWAIT(RESPOND, respondFuture, future, result)
+                goto initFlush;
+            }
+            initBadRequest: {
+                // The framing of the request is unknown, so nothing after it
+                // can be read
+                connectionClose = true;
+                state = State::BAD_REQUEST;
+                write = writer->writeFromBuffer(
+                    BAD_REQUEST_RESPONSE, stringLength(BAD_REQUEST_RESPONSE));
+            }
+            case State::BAD_REQUEST: {
+                AWAIT_PTR(write, result)
+                if (result != stringLength(BAD_REQUEST_RESPONSE)) {
+                    READY(false)
+                }
+                goto initFlush;
+            }
+            initFlush: {
+                if (isFlushDeferred()) {
+                    goto initDrainBody;
+                }
 
-                READY(void_())
+                // The response is complete so send everything that's buffered
+                state = State::FLUSH;
+                flush = writer->flush();
+            }
+            case State::FLUSH: {
+                AWAIT_PTR(flush, result)
+                if (!result || !isKeepAlive()) {
+                    READY(false)
+                }
+            }
+            initDrainBody: {
+                // Skip what the handler didn't read of the body
+                auto future = ReadSlicesWhile<SkipSlice, LimitedReader<R>>(
+                    &body, SkipSlice());
+                INIT_AWAIT(DRAIN_BODY, drainBody, future, drained)
+                READY(body.getRemaining() == 0)
             }
         }
-        return Poll<void_>::pending();
+        return Poll<bool>::pending();
     }
 
    private:
@@ -183,12 +429,100 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
         }
     }
 
+    // Headers that ReadHttpHeaders couldn't store are skipped here too, the
+    // framing headers are whole here though
+    inline void extractHeaders(HttpHeaderRef* headers, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            if (headers[i].name.length > MAX_HEADER_NAME) {
+                continue;
+            }
+            extractHeader(headers[i].name, headers[i].value, false);
+        }
+    }
+
+    // The name is only looked at once, the extractors are dispatched on its
+    // id. A cut value is only the start of the value.
+    inline void extractHeader(BufferRef name, BufferRef value, bool isCut) {
+        HeaderId id = headerIdOf(name);
+        visitFramingHeader(id, value, isCut);
+        if (isCut || value.length > MAX_HEADER_VALUE) {
+            return;
+        }
+        if constexpr (template_utils::pack<Extractors...>::length > 0) {
+            if ((HEADER_IDS & headerMask(id)) != 0) {
+                HeaderVisitor::template extractHeader<Extractors...>(
+                    id, name, value, &extractors);
+            }
+        }
+    }
+
+    inline void visitFramingHeader(HeaderId id, BufferRef value, bool isCut) {
+        switch (id) {
+            case HeaderId::CONTENT_LENGTH: {
+                Optional<size_t> length =
+                    isCut ? Optional<size_t>::empty()
+                          : httpContentLengthFromBuffer(value);
+                // Repeated headers must agree
+                if (length.isEmpty() ||
+                    (hasContentLength && length.get() != contentLength)) {
+                    invalidFraming = true;
+                    break;
+                }
+                hasContentLength = true;
+                contentLength = length.get();
+                break;
+            }
+            case HeaderId::CONNECTION:
+                // The tokens after the cut are unknown, closing is always
+                // allowed
+                connectionClose |=
+                    isCut || httpHeaderHasToken(value, "close");
+                connectionKeepAlive |= httpHeaderHasToken(value, "keep-alive");
+                break;
+            case HeaderId::TRANSFER_ENCODING:
+                hasTransferEncoding = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // HTTP/1.0 closes by default, later versions keep the connection
+    inline bool isKeepAlive() {
+        if (hasTransferEncoding || connectionClose) {
+            return false;
+        }
+        if (version == HttpVersion::HTTP_1_0) {
+            return connectionKeepAlive;
+        }
+        return true;
+    }
+
+    // Another request is buffered after the body of this one, so the response
+    // can wait for its response
+    inline bool isFlushDeferred() {
+        if (pipeline == nullptr || !isKeepAlive()) {
+            return false;
+        }
+        if (pipeline->unflushed + 1 >= pipeline->maxUnflushed ||
+            reader->bufferedLength() <= body.getRemaining()) {
+            pipeline->unflushed = 0;
+            return false;
+        }
+        pipeline->unflushed++;
+        return true;
+    }
+
+    struct SkipSlice {
+        size_t operator()(BufferRef slice) { return slice.length; }
+    };
+
     template <size_t ExtractorIndex, typename T, typename... Ts>
-    inline Poll<bool> extractPoll2() {
+    inline Poll<bool> extractPoll2(Context* cx) {
         // check if the next extractor should be called
         if constexpr (ExtractorIndex < extractorsLength - 1) {
             if (this->extractFutures.extractor > ExtractorIndex) {
-                return extractPoll2<ExtractorIndex + 1, Ts...>();
+                return extractPoll2<ExtractorIndex + 1, Ts...>(cx);
             }
         }
         typedef typename http_extractor<T>::ExtractRequestFuture ExtractFuture;
@@ -204,7 +538,8 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
         }
 
         Poll<void_> poll =
-            this->extractFutures.future.template asPtr<ExtractFuture>()->poll();
+            this->extractFutures.future.template asPtr<ExtractFuture>()->poll(
+                cx);
         if (poll.isPending()) {
             return Poll<bool>::pending();
         }
@@ -215,38 +550,59 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
         if constexpr (ExtractorIndex >= extractorsLength) {
             return Poll<bool>::ready(true);
         } else {
-            return extractPoll2<ExtractorIndex + 1, Ts...>();
+            return extractPoll2<ExtractorIndex + 1, Ts...>(cx);
         }
     }
-    inline Poll<bool> extractPoll() {
+    inline Poll<bool> extractPoll(Context* cx) {
         if constexpr (template_utils::pack<Extractors...>::length >= 1) {
-            return extractPoll2<1, Extractors...>();
+            return extractPoll2<1, Extractors...>(cx);
         } else {
             return Poll<bool>::ready(true);
         }
     }
 
+    // Keeps the start of values that are too long instead of skipping them,
+    // so the framing headers are never missed
+    struct HeaderValueStore {
+        SizedBuffer<MAX_HEADER_VALUE> buffer;
+        bool isCut = false;
+
+        bool push(char c) {
+            isCut |= !buffer.push(c);
+            return true;
+        }
+
+        void clear() {
+            buffer.clear();
+            isCut = false;
+        }
+    };
+
     struct HeaderVisitor {
         typedef Instant<void_> VisitFuture;
         HandleHttpRequest* handle;
 
         template <typename T, typename... Ts>
-        inline static void extractHeader(BufferRef name, BufferRef value,
+        inline static void extractHeader(HeaderId id, BufferRef name,
+                                         BufferRef value,
                                          Tuple<T, Ts...>* tuple) {
-            auto extractor = tuple->template atPtr<0>();
-
-            http_extractor<T>::extractHeader(extractor, name, value);
+            if ((http_extractor<T>::HEADER_IDS & headerMask(id)) != 0) {
+                auto extractor = tuple->template atPtr<0>();
+                http_extractor<T>::extractHeader(extractor, id, name, value);
+            }
 
             if constexpr (tuple->length > 1) {
-                extractHeader<Ts...>(name, value, tuple->asNext());
+                extractHeader<Ts...>(id, name, value, tuple->asNext());
             }
         }
         VisitFuture visit(SizedBuffer<MAX_HEADER_NAME>* name,
-                          SizedBuffer<MAX_HEADER_VALUE>* value) {
-            if constexpr (template_utils::pack<Extractors...>::length > 0) {
-                extractHeader<Extractors...>(name->asRef(), value->asRef(),
-                                             &handle->extractors);
-            }
+                          HeaderValueStore* value) {
+            BufferRef valueRef = value->buffer.asRef();
+            handle->extractHeader(
+                name->asRef(),
+                http_head::trimWhitespace(valueRef.data,
+                                          valueRef.data + valueRef.length),
+                value->isCut);
             return Instant<void_>(void_());
         }
     };
@@ -256,17 +612,40 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
         HEADERS,
         EXTRACT,
         HANDLE,
-        RESPOND
+        RESPOND,
+        BAD_REQUEST,
+        FLUSH,
+        DRAIN_BODY
     } state = State::INIT;
-    Writer* writer;
-    Reader* reader;
+    W* writer;
+    R* reader;
+    HttpPipeline* pipeline;
+    Arena* arena;
+    RemoteWaker* remoteWaker;
+    // The responses of the handler and the extractors go through it
+    ConnectionHeaderWriter<W> responseWriter;
+
+    HttpVersion version;
+    size_t contentLength = 0;
+    bool hasContentLength = false;
+    bool invalidFraming = false;
+    bool hasTransferEncoding = false;
+    bool connectionClose = false;
+    bool connectionKeepAlive = false;
+    // Handed to the extractors so they can't read into the next request
+    LimitedReader<R> body;
     union {
         struct {
             HttpRequestStatusLine statusLine;
+            // Set if the head was parsed in one pass, otherwise the headers
+            // are read with ReadHttpHeaders
+            HttpHeaderRef* headers;
+            size_t headersLength;
+            size_t headLength;
         } init;
 
-        ReadHttpHeaders<SizedBuffer<MAX_HEADER_NAME>,
-                        SizedBuffer<MAX_HEADER_VALUE>, HeaderVisitor>
+        ReadHttpHeaders<SizedBuffer<MAX_HEADER_NAME>, HeaderValueStore,
+                        HeaderVisitor, R>
             readHeaders;
 
         struct {
@@ -277,7 +656,12 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
         } extractFutures;
 
         HandleFuture handleFuture;
-        typename http_response<Response>::RespondFuture respondFuture;
+        typename http_response<Response>::template RespondFuture<
+            ConnectionHeaderWriter<W>>
+            respondFuture;
+        typename writer_ops<W>::WriteFromBuffer* write;
+        typename writer_ops<W>::Flush* flush;
+        ReadSlicesWhile<SkipSlice, LimitedReader<R>> drainBody;
     };
 
     char currentExtractor = 0;
@@ -288,14 +672,17 @@ class HandleHttpRequest<Handler, template_utils::pack<Extractors...>> {
 
 // http_extractor/response implementations
 
+// The response is written as is, so it needs its own Content-Length for the
+// connection to be kept alive
 template <>
 struct http_response<const char*> {
-    class RespondFuture : Future<RespondFuture, void_> {
+    template <typename W>
+    class RespondFuture : Future<RespondFuture<W>, void_> {
        public:
-        RespondFuture(Writer* writer, const char* response)
+        RespondFuture(W* writer, const char* response)
             : init{writer, response} {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     state = State::WRITE;
@@ -317,15 +704,16 @@ struct http_response<const char*> {
         enum class State { INIT, WRITE } state = State::INIT;
         union {
             struct {
-                Writer* writer;
+                W* writer;
                 const char* response;
             } init;
-            WriteFromBuffer* writeFromBuffer;
+            typename writer_ops<W>::WriteFromBuffer* writeFromBuffer;
         };
     };
 
-    static RespondFuture respond(Writer* writer, const char* response) {
-        return RespondFuture(writer, response);
+    template <typename W>
+    static RespondFuture<W> respond(W* writer, const char* response) {
+        return RespondFuture<W>(writer, response);
     }
 };
 
@@ -350,15 +738,17 @@ struct http_extractor<HttpBodyReader> {
     static constexpr const size_t MAX_HEADER_NAME = 0;
     static constexpr const size_t MAX_HEADER_VALUE = 0;
 
-    static void extractHeader(HttpBodyReader* extractor, BufferRef name,
-                              BufferRef value) {}
+    static constexpr const uint64_t HEADER_IDS = 0;
+
+    static void extractHeader(HttpBodyReader* extractor, HeaderId id,
+                              BufferRef name, BufferRef value) {}
 
     class ExtractRequestFuture : Future<ExtractRequestFuture, void_> {
        public:
         ExtractRequestFuture(HttpBodyReader* extractor, HttpRequest* request)
             : extractor(extractor), request(request) {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     auto bodyOpt = request->tryTakeBody();
@@ -398,6 +788,192 @@ struct http_extractor<HttpBodyReader> {
     }
 };
 
+// All headers of the request. The names and values are copied into the flat
+// buffer of the extractor with one memcpy each, the index only holds offsets
+// into it. So it stays valid when the read buffer is reused for the body and
+// when the extractor is copied into the handler. Values are complete,
+// including the whitespace inside them.
+//
+// Headers that don't fit into Capacity bytes or MaxHeaders entries are
+// dropped, see isTruncated.
+template <size_t Capacity = 1024, size_t MaxHeaders = 32>
+class HttpHeaders {
+    static_assert(Capacity <= UINT16_MAX, "The offsets are 16 bit");
+    static_assert(MaxHeaders < UINT8_MAX, "The index is 8 bit");
+
+   public:
+    // The first header with the id, O(1)
+    Optional<BufferRef> get(HeaderId id) {
+        uint8_t entry = firstEntries[(size_t)id];
+        if (id == HeaderId::OTHER || entry == 0) {
+            return Optional<BufferRef>::empty();
+        }
+        return Optional<BufferRef>::of(valueAt(entry - 1));
+    }
+
+    // The first header with the name, headers without an id are searched
+    Optional<BufferRef> get(BufferRef name) {
+        HeaderId id = headerIdOf(name);
+        if (id != HeaderId::OTHER) {
+            return get(id);
+        }
+        for (size_t i = 0; i < length; i++) {
+            if (entries[i].id == HeaderId::OTHER &&
+                nameAt(i).equalsIgnoreCase(name)) {
+                return Optional<BufferRef>::of(valueAt(i));
+            }
+        }
+        return Optional<BufferRef>::empty();
+    }
+
+    Optional<BufferRef> get(const char* name) { return get(BufferRef(name)); }
+
+    // The headers in the order of the request
+    size_t getLength() { return length; }
+    BufferRef nameAt(size_t i) {
+        return BufferRef(buffer + entries[i].nameOffset, entries[i].nameLength);
+    }
+    BufferRef valueAt(size_t i) {
+        return BufferRef(buffer + entries[i].valueOffset,
+                         entries[i].valueLength);
+    }
+
+    // If headers were dropped
+    bool isTruncated() { return truncated; }
+
+    void add(HeaderId id, BufferRef name, BufferRef value) {
+        if (length == MaxHeaders ||
+            name.length + value.length > Capacity - used) {
+            truncated = true;
+            return;
+        }
+        Entry* entry = &entries[length];
+        entry->id = id;
+        entry->nameOffset = (uint16_t)used;
+        entry->nameLength = (uint16_t)name.length;
+        memcpy(buffer + used, name.data, name.length);
+        used += name.length;
+        entry->valueOffset = (uint16_t)used;
+        entry->valueLength = (uint16_t)value.length;
+        memcpy(buffer + used, value.data, value.length);
+        used += value.length;
+
+        length++;
+        if (firstEntries[(size_t)id] == 0) {
+            firstEntries[(size_t)id] = (uint8_t)length;
+        }
+    }
+
+   private:
+    struct Entry {
+        HeaderId id;
+        uint16_t nameOffset;
+        uint16_t nameLength;
+        uint16_t valueOffset;
+        uint16_t valueLength;
+    };
+
+    size_t length = 0;
+    size_t used = 0;
+    bool truncated = false;
+    // 1 + the entry of the first header with the id, 0 if there is none
+    uint8_t firstEntries[(size_t)HeaderId::LENGTH] = {};
+    Entry entries[MaxHeaders];
+    char buffer[Capacity];
+};
+
+template <size_t Capacity, size_t MaxHeaders>
+struct http_extractor<HttpHeaders<Capacity, MaxHeaders>> {
+    static HttpHeaders<Capacity, MaxHeaders> createExtractor() {
+        return HttpHeaders<Capacity, MaxHeaders>();
+    }
+
+    static void extractStatusLine(HttpHeaders<Capacity, MaxHeaders>* extractor,
+                                  HttpRequestStatusLine statusLine) {}
+
+    // Headers that are read in pieces are stored this long first
+    static constexpr const size_t MAX_HEADER_NAME = 64;
+    static constexpr const size_t MAX_HEADER_VALUE = Capacity;
+
+    static constexpr const uint64_t HEADER_IDS = ~(uint64_t)0;
+
+    static void extractHeader(HttpHeaders<Capacity, MaxHeaders>* extractor,
+                              HeaderId id, BufferRef name, BufferRef value) {
+        extractor->add(id, name, value);
+    }
+
+    typedef Instant<void_> ExtractRequestFuture;
+
+    static ExtractRequestFuture extractRequest(
+        HttpHeaders<Capacity, MaxHeaders>* extractor, HttpRequest* request) {
+        return Instant<void_>(void_());
+    }
+};
+
+// The arena of the request, e.g. for the frames of Co or buffers whose size
+// is only known while handling. It's nullptr if the request has none.
+// Everything allocated is freed at once when the request is done.
+struct RequestArena {
+    Arena* arena;
+};
+
+template <>
+struct http_extractor<RequestArena> {
+    static RequestArena createExtractor() {
+        return RequestArena{.arena = nullptr};
+    }
+
+    static void extractStatusLine(RequestArena* extractor,
+                                  HttpRequestStatusLine statusLine) {}
+
+    static constexpr const size_t MAX_HEADER_NAME = 0;
+    static constexpr const size_t MAX_HEADER_VALUE = 0;
+
+    static constexpr const uint64_t HEADER_IDS = 0;
+
+    static void extractHeader(RequestArena* extractor, HeaderId id,
+                              BufferRef name, BufferRef value) {}
+
+    typedef Instant<void_> ExtractRequestFuture;
+
+    static ExtractRequestFuture extractRequest(RequestArena* extractor,
+                                               HttpRequest* request) {
+        extractor->arena = request->getArena();
+        return Instant<void_>(void_());
+    }
+};
+
+// Lets the handler await work that runs on another thread, e.g. a JoinHandle
+// of the Executor(see Offloaded). waker is nullptr if the server can't be woken
+// from other threads, the handler has to do the work itself then.
+struct Offload {
+    RemoteWaker* waker;
+};
+
+template <>
+struct http_extractor<Offload> {
+    static Offload createExtractor() { return Offload{.waker = nullptr}; }
+
+    static void extractStatusLine(Offload* extractor,
+                                  HttpRequestStatusLine statusLine) {}
+
+    static constexpr const size_t MAX_HEADER_NAME = 0;
+    static constexpr const size_t MAX_HEADER_VALUE = 0;
+
+    static constexpr const uint64_t HEADER_IDS = 0;
+
+    static void extractHeader(Offload* extractor, HeaderId id, BufferRef name,
+                              BufferRef value) {}
+
+    typedef Instant<void_> ExtractRequestFuture;
+
+    static ExtractRequestFuture extractRequest(Offload* extractor,
+                                               HttpRequest* request) {
+        extractor->waker = request->getRemoteWaker();
+        return Instant<void_>(void_());
+    }
+};
+
 struct StatusCodeResponse {
     HttpVersion httpVersion;
     unsigned short code;
@@ -406,17 +982,18 @@ struct StatusCodeResponse {
 
 template <>
 struct http_response<StatusCodeResponse> {
-    class RespondFuture : Future<RespondFuture, void_> {
+    template <typename W>
+    class RespondFuture : Future<RespondFuture<W>, void_> {
+       private:
+        static constexpr const char* HEADERS = "Content-Length: 0\r\n\r\n";
+
        public:
-        RespondFuture(Writer* writer, StatusCodeResponse response)
-            : init{writer, response} {}
+        RespondFuture(W* writer, StatusCodeResponse response)
+            : writer(writer), response(response) {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
-                    Writer* writer = init.writer;
-                    StatusCodeResponse response = init.response;
-
                     INIT_AWAIT(WRITE_RESPONSE_STATUS_LINE,
                                writeHttpResponseStatusLine,
                                WriteHttpResponseStatusLine(
@@ -428,6 +1005,14 @@ struct http_response<StatusCodeResponse> {
                     if (!result) {
                         READY(void_())
                     }
+
+                    state = State::WRITE_HEADERS;
+                    BufferRef headers = BufferRef(HEADERS);
+                    writeFromBuffer =
+                        writer->writeFromBuffer(headers.data, headers.length);
+                }
+                case State::WRITE_HEADERS: {
+                    AWAIT_PTR(writeFromBuffer, result)
                     READY(void_())
                 }
             }
@@ -437,19 +1022,20 @@ struct http_response<StatusCodeResponse> {
        private:
         enum class State {
             INIT,
-            WRITE_RESPONSE_STATUS_LINE
+            WRITE_RESPONSE_STATUS_LINE,
+            WRITE_HEADERS
         } state = State::INIT;
+        W* writer;
+        StatusCodeResponse response;
         union {
-            struct {
-                Writer* writer;
-                StatusCodeResponse response;
-            } init;
-            WriteHttpResponseStatusLine writeHttpResponseStatusLine;
+            typename writer_ops<W>::WriteFromBuffer* writeFromBuffer;
+            WriteHttpResponseStatusLine<W> writeHttpResponseStatusLine;
         };
     };
 
-    static RespondFuture respond(Writer* writer, StatusCodeResponse response) {
-        return RespondFuture(writer, response);
+    template <typename W>
+    static RespondFuture<W> respond(W* writer, StatusCodeResponse response) {
+        return RespondFuture<W>(writer, response);
     }
 };
 
@@ -458,7 +1044,7 @@ struct HttpJsonBody {
     HttpJsonBody() {}
     HttpJsonBody(T value) : value(value) {}
 
-    Optional<int> contentLength = Optional<int>::empty();
+    Optional<size_t> contentLength = Optional<size_t>::empty();
     union {
         T value;
     };
@@ -477,20 +1063,13 @@ struct http_extractor<HttpJsonBody<T>> {
 
     // TODO: Check for application/json header value
 
-    static void extractHeader(HttpJsonBody<T>* extractor, BufferRef headerName,
-                              BufferRef headerValue) {
-        if (!headerName.equalsIgnoreCase("Content-Length")) {
-            return;
-        }
-        Optional<double> contentLengthOpt = readDoubleFromBuffer(headerValue);
-        if (contentLengthOpt.isEmpty()) {
-            return;
-        }
-        double contentLength = contentLengthOpt.get();
-
-        extractor->contentLength = Optional<int>::of((int)contentLength);
+    static constexpr const uint64_t HEADER_IDS =
+        headerMask(HeaderId::CONTENT_LENGTH);
 
-        return;
+    static void extractHeader(HttpJsonBody<T>* extractor, HeaderId id,
+                              BufferRef headerName, BufferRef headerValue) {
+        // Invalid lengths are answered with a 400 before the body is read
+        extractor->contentLength = httpContentLengthFromBuffer(headerValue);
     }
 
     class ExtractRequestFuture : Future<ExtractRequestFuture, void_> {
@@ -498,7 +1077,7 @@ struct http_extractor<HttpJsonBody<T>> {
         ExtractRequestFuture(HttpRequest* request, HttpJsonBody<T>* extractor)
             : request(request), extractor(extractor) {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     if (extractor->contentLength.isEmpty()) {
@@ -544,7 +1123,7 @@ struct http_extractor<HttpJsonBody<T>> {
                     Poll<typename template_utils ::future_output<
                         decltype(writeFromBuffer)>::type>
                         poll;
-                    poll = writeFromBuffer->poll();
+                    poll = writeFromBuffer->poll(cx);
                     if (poll.isPending()) {
                         return Poll<typename template_utils ::future_output<
                             decltype(this)>::type>::pending();
@@ -586,21 +1165,27 @@ struct http_extractor<HttpJsonBody<T>> {
 
 template <typename T>
 struct http_response<HttpJsonBody<T>> {
-    class RespondFuture : Future<RespondFuture, void_> {
+    template <typename W>
+    class RespondFuture : Future<RespondFuture<W>, void_> {
        private:
         static constexpr const char* HEADER_JSON =
-            "Content-Type: application/json\r\n\r\n";
-
-        BufferRef getHeaderJson() { return BufferRef(HEADER_JSON); }
+            "Content-Type: application/json\r\nContent-Length: ";
+        static constexpr const char* HEADER_END = "\r\n\r\n";
 
        public:
-        RespondFuture(Writer* writer, T value) : writer(writer), value(value) {}
+        RespondFuture(W* writer, T value) : writer(writer), value(value) {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
-                    // TODO:  Use transfer encoding so
-                    // we don't need to know the size of the response now
+                    // Serialize once without writing to get the Content-Length
+                    CountWriter counter = writeToCount();
+                    if (!blockOn(SerializeJson<T, CountWriter>(&counter,
+                                                               &value))) {
+                        READY(void_())
+                    }
+                    contentLength = counter.getImpl()->getCount();
+
                     auto future = WriteHttpResponseStatusLine(
                         writer,
                         HttpResponseStatusLine{
@@ -614,18 +1199,38 @@ struct http_response<HttpJsonBody<T>> {
                         READY(void_())
                     }
 
-                    BufferRef jsonHeader = getHeaderJson();
+                    state = State::WRITE_JSON_HEADER;
+                    BufferRef jsonHeader = BufferRef(HEADER_JSON);
                     writeFromBuffer = writer->writeFromBuffer(
                         jsonHeader.data, jsonHeader.length);
                 }
                 case State::WRITE_JSON_HEADER: {
                     AWAIT_PTR(writeFromBuffer, result)
-                    if (result != getHeaderJson().length) {
+                    if (result != BufferRef(HEADER_JSON).length) {
                         READY(void_())
                     }
 
-                    INIT_AWAIT(WRITE_JSON, serializeJson,
-                               SerializeJson<T>(writer, &value), result)
+                    auto future =
+                        WriteDouble<10, W>(writer, (double)contentLength);
+                    INIT_AWAIT(WRITE_CONTENT_LENGTH, writeDouble, future,
+                               result)
+                    if (!result) {
+                        READY(void_())
+                    }
+
+                    state = State::WRITE_HEADER_END;
+                    BufferRef headerEnd = BufferRef(HEADER_END);
+                    writeFromBuffer = writer->writeFromBuffer(headerEnd.data,
+                                                              headerEnd.length);
+                }
+                case State::WRITE_HEADER_END: {
+                    AWAIT_PTR(writeFromBuffer, result)
+                    if (result != BufferRef(HEADER_END).length) {
+                        READY(void_())
+                    }
+
+                    auto future = SerializeJson<T, W>(writer, &value);
+                    INIT_AWAIT(WRITE_JSON, serializeJson, future, result)
                     if (!result) {
                         READY(void_())
                     }
@@ -640,20 +1245,25 @@ struct http_response<HttpJsonBody<T>> {
             INIT,
             WRITE_RESPONSE_LINE,
             WRITE_JSON_HEADER,
+            WRITE_CONTENT_LENGTH,
+            WRITE_HEADER_END,
             WRITE_JSON
         } state = State::INIT;
         // TODO: use writer in union
-        Writer* writer;
+        W* writer;
         T value;
+        size_t contentLength;
         union {
-            WriteFromBuffer* writeFromBuffer;
-            WriteHttpResponseStatusLine writeResponseLine;
-            SerializeJson<T> serializeJson;
+            typename writer_ops<W>::WriteFromBuffer* writeFromBuffer;
+            WriteHttpResponseStatusLine<W> writeResponseLine;
+            WriteDouble<10, W> writeDouble;
+            SerializeJson<T, W> serializeJson;
         };
     };
 
-    static RespondFuture respond(Writer* writer, HttpJsonBody<T> response) {
-        return RespondFuture(writer, response.value);
+    template <typename W>
+    static RespondFuture<W> respond(W* writer, HttpJsonBody<T> response) {
+        return RespondFuture<W>(writer, response.value);
     }
 };
 
@@ -663,17 +1273,18 @@ struct HttpBodyResponse {
 
 template <>
 struct http_response<HttpBodyResponse> {
-    class RespondFuture : Future<RespondFuture, void_> {
+    template <typename W>
+    class RespondFuture : Future<RespondFuture<W>, void_> {
        private:
         static constexpr const char* HEADER_1 =
             "HTTP/1.1 200 Ok\r\nContent-Length:";
         static constexpr const char* HEADER_2 = "\r\n\r\n";
 
        public:
-        RespondFuture(Writer* writer, HttpBodyResponse response)
+        RespondFuture(W* writer, HttpBodyResponse response)
             : writer(writer), response(response) {}
 
-        Poll<void_> poll() {
+        Poll<void_> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     state = State::WRITE_HEADERS_1;
@@ -688,8 +1299,8 @@ struct http_response<HttpBodyResponse> {
                     }
 
                     state = State::WRITE_CONTENT_LENTH;
-                    writeDouble =
-                        WriteDouble<10>(writer, (double)(response.body.length));
+                    writeDouble = WriteDouble<10, W>(
+                        writer, (double)(response.body.length));
                 }
                 case State::WRITE_CONTENT_LENTH: {
                     AWAIT(writeDouble, result)
@@ -732,16 +1343,17 @@ struct http_response<HttpBodyResponse> {
             WRITE_HEADERS_2,
             WRITE_CONTENT
         } state = State::INIT;  // TODO: optimize
-        Writer* writer;
+        W* writer;
         HttpBodyResponse response;
         union {
-            WriteFromBuffer* writeFromBuffer;
-            WriteDouble<10> writeDouble;
+            typename writer_ops<W>::WriteFromBuffer* writeFromBuffer;
+            WriteDouble<10, W> writeDouble;
         };
     };
 
-    static RespondFuture respond(Writer* writer, HttpBodyResponse response) {
-        return RespondFuture(writer, response);
+    template <typename W>
+    static RespondFuture<W> respond(W* writer, HttpBodyResponse response) {
+        return RespondFuture<W>(writer, response);
     }
 };
 
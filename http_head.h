@@ -0,0 +1,283 @@
+#ifndef CPP_ASYNC_HTTP_HTTP_HEAD_H
+#define CPP_ASYNC_HTTP_HTTP_HEAD_H
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "http.h"
+#include "utils.h"
+
+// Parses a whole request head(status line + headers) that is already in a
+// buffer. The state machines in http.h are used if the head isn't completely
+// buffered.
+
+struct HttpHeaderRef {
+    BufferRef name;
+    // Without the whitespace around the value
+    BufferRef value;
+};
+
+// Everything points into the parsed buffer
+template <size_t MaxHeaders>
+struct HttpRequestHead {
+    HttpRequestStatusLine statusLine;
+    BufferRef path;
+
+    size_t headersLength = 0;
+    HttpHeaderRef headers[MaxHeaders];
+
+    // Bytes of the head including the empty line
+    size_t length = 0;
+};
+
+enum class HttpHeadParse {
+    COMPLETE,
+    // The buffer ends before the head or there are more than MaxHeaders
+    // headers
+    INCOMPLETE,
+    INVALID
+};
+
+namespace http_head {
+
+static constexpr const size_t BLOCK_LENGTH = 64;
+
+static inline bool isStructural(char c) {
+    return c == '\r' || c == '\n' || c == ':' || c == ' ';
+}
+
+// Returns a bit for every '\r', '\n', ':' or ' ' in the 64 bytes of block
+static inline uint64_t structuralBits(const char *block) {
+    uint64_t bits = 0;
+#if defined(__AVX2__)
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i space = _mm256_set1_epi8(' ');
+    for (size_t i = 0; i < BLOCK_LENGTH; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i eq = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                            _mm256_cmpeq_epi8(v, space)));
+        bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(eq) << i;
+    }
+#elif defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i space = _mm_set1_epi8(' ');
+    for (size_t i = 0; i < BLOCK_LENGTH; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, space)));
+        bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << i;
+    }
+#else
+    for (size_t i = 0; i < BLOCK_LENGTH; i++) {
+        bits |= (uint64_t)isStructural(block[i]) << i;
+    }
+#endif
+    return bits;
+}
+
+static inline uint64_t structuralBitsScalar(const char *block, size_t length) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits |= (uint64_t)isStructural(block[i]) << i;
+    }
+    return bits;
+}
+
+static inline BufferRef trimWhitespace(char *start, char *end) {
+    while (start < end && isCharWhitespace(*start)) {
+        start++;
+    }
+    while (end > start && isCharWhitespace(*(end - 1))) {
+        end--;
+    }
+    return BufferRef(start, end - start);
+}
+
+enum class Part {
+    METHOD,
+    PATH,
+    VERSION,
+    VERSION_LF,
+    NAME,
+    VALUE,
+    VALUE_LF,
+    END_LF
+};
+
+// Visits the structural chars one after another. Only these can end a part of
+// the head so everything in between is skipped.
+template <size_t MaxHeaders>
+class HeadParser {
+   public:
+    HeadParser(BufferRef buffer, HttpRequestHead<MaxHeaders> *head)
+        : buffer(buffer), head(head) {}
+
+    HttpHeadParse parse() {
+        head->headersLength = 0;
+
+        size_t offset = 0;
+        while (offset + BLOCK_LENGTH <= buffer.length) {
+            uint64_t bits = structuralBits(buffer.data + offset);
+            if (visitBits(offset, bits)) {
+                return result;
+            }
+            offset += BLOCK_LENGTH;
+        }
+        uint64_t bits = structuralBitsScalar(buffer.data + offset,
+                                             buffer.length - offset);
+        if (visitBits(offset, bits)) {
+            return result;
+        }
+        return HttpHeadParse::INCOMPLETE;
+    }
+
+   private:
+    // Returns if the parsing is done
+    inline bool visitBits(size_t offset, uint64_t bits) {
+        while (bits != 0) {
+            size_t index = offset + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (visit(index)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline bool done(HttpHeadParse result) {
+        this->result = result;
+        return true;
+    }
+
+    inline bool visit(size_t index) {
+        char c = buffer.data[index];
+        char *at = buffer.data + index;
+        switch (part) {
+            case Part::METHOD: {
+                if (c != ' ') {
+                    return done(HttpHeadParse::INVALID);
+                }
+                Optional<HttpMethod> method =
+                    httpMethodFromBuffer(BufferRef(start, at - start));
+                if (method.isEmpty()) {
+                    return done(HttpHeadParse::INVALID);
+                }
+                head->statusLine.method = method.get();
+
+                part = Part::PATH;
+                start = at + 1;
+                return false;
+            }
+            case Part::PATH: {
+                if (c == ':') {
+                    return false;
+                }
+                if (c != ' ') {
+                    return done(HttpHeadParse::INVALID);
+                }
+                head->path = BufferRef(start, at - start);
+
+                part = Part::VERSION;
+                start = at + 1;
+                return false;
+            }
+            case Part::VERSION: {
+                if (c != '\r') {
+                    return done(HttpHeadParse::INVALID);
+                }
+                Optional<HttpVersion> version =
+                    httpVersionFromBuffer(BufferRef(start, at - start));
+                if (version.isEmpty()) {
+                    return done(HttpHeadParse::INVALID);
+                }
+                head->statusLine.version = version.get();
+
+                part = Part::VERSION_LF;
+                start = at + 1;
+                return false;
+            }
+            case Part::VALUE_LF:
+            case Part::VERSION_LF: {
+                // The \n must follow the \r directly
+                if (c != '\n' || at != start) {
+                    return done(HttpHeadParse::INVALID);
+                }
+
+                part = Part::NAME;
+                start = at + 1;
+                return false;
+            }
+            case Part::NAME: {
+                if (c == '\r' && at == start) {
+                    part = Part::END_LF;
+                    start = at + 1;
+                    return false;
+                }
+                if (c != ':' || at == start) {
+                    return done(HttpHeadParse::INVALID);
+                }
+                if (head->headersLength >= MaxHeaders) {
+                    return done(HttpHeadParse::INCOMPLETE);
+                }
+                head->headers[head->headersLength].name =
+                    BufferRef(start, at - start);
+
+                part = Part::VALUE;
+                start = at + 1;
+                return false;
+            }
+            case Part::VALUE: {
+                if (c == '\n') {
+                    return done(HttpHeadParse::INVALID);
+                }
+                if (c != '\r') {
+                    return false;
+                }
+                head->headers[head->headersLength].value =
+                    trimWhitespace(start, at);
+                head->headersLength++;
+
+                part = Part::VALUE_LF;
+                start = at + 1;
+                return false;
+            }
+            case Part::END_LF: {
+                if (c != '\n' || at != start) {
+                    return done(HttpHeadParse::INVALID);
+                }
+                head->length = index + 1;
+                return done(HttpHeadParse::COMPLETE);
+            }
+        }
+        return done(HttpHeadParse::INVALID);
+    }
+
+    BufferRef buffer;
+    HttpRequestHead<MaxHeaders> *head;
+    Part part = Part::METHOD;
+    // Start of the current part
+    char *start = buffer.data;
+    HttpHeadParse result = HttpHeadParse::INCOMPLETE;
+};
+
+}  // namespace http_head
+
+// Finds the boundaries of the request head in one pass over buffer. The
+// separators are found 64 bytes at a time with SSE2/AVX2 if available.
+template <size_t MaxHeaders>
+HttpHeadParse parseHttpRequestHead(BufferRef buffer,
+                                   HttpRequestHead<MaxHeaders> *head) {
+    return http_head::HeadParser<MaxHeaders>(buffer, head).parse();
+}
+
+#endif
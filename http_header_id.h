@@ -0,0 +1,178 @@
+#ifndef CPP_ASYNC_HTTP_HTTP_HEADER_ID_H
+#define CPP_ASYNC_HTTP_HTTP_HEADER_ID_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+// The request headers that are recognized, every other header is OTHER. The
+// id of a header name is found once, extractors are only given the headers
+// whose ids they asked for.
+enum class HeaderId : uint8_t {
+    OTHER,
+    ACCEPT,
+    ACCEPT_CHARSET,
+    ACCEPT_ENCODING,
+    ACCEPT_LANGUAGE,
+    AUTHORIZATION,
+    CACHE_CONTROL,
+    CONNECTION,
+    CONTENT_ENCODING,
+    CONTENT_LENGTH,
+    CONTENT_TYPE,
+    COOKIE,
+    DATE,
+    EXPECT,
+    FORWARDED,
+    HOST,
+    IF_MATCH,
+    IF_MODIFIED_SINCE,
+    IF_NONE_MATCH,
+    IF_RANGE,
+    IF_UNMODIFIED_SINCE,
+    KEEP_ALIVE,
+    ORIGIN,
+    PRAGMA,
+    RANGE,
+    REFERER,
+    TE,
+    TRAILER,
+    TRANSFER_ENCODING,
+    UPGRADE,
+    USER_AGENT,
+    VIA,
+    X_FORWARDED_FOR,
+    X_REQUESTED_WITH,
+    // Not a header, the number of ids
+    LENGTH
+};
+
+// The set of ids an extractor wants, e.g.
+// headerMask(HeaderId::HOST) | headerMask(HeaderId::COOKIE)
+constexpr uint64_t headerMask(HeaderId id) { return (uint64_t)1 << (size_t)id; }
+
+namespace http_header_id {
+
+static_assert((size_t)HeaderId::LENGTH <= 64, "The ids must fit into a mask");
+
+// Indexed by the id
+static constexpr const char *const NAMES[] = {
+    "",
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Encoding",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "Expect",
+    "Forwarded",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Origin",
+    "Pragma",
+    "Range",
+    "Referer",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Via",
+    "X-Forwarded-For",
+    "X-Requested-With",
+};
+static_assert(sizeof(NAMES) / sizeof(NAMES[0]) == (size_t)HeaderId::LENGTH,
+              "Every id needs a name");
+
+constexpr char lower(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+constexpr size_t nameLength(const char *name) {
+    size_t length = 0;
+    while (name[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+static constexpr const size_t SLOT_BITS = 7;
+static constexpr const size_t SLOTS = (size_t)1 << SLOT_BITS;
+
+// FNV-1a of the lower case name. The low bits only depend on the low bits of
+// the seed, so the slot is taken from the high ones.
+constexpr size_t slotOf(const char *name, size_t length, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)lower(name[i]);
+        hash *= 16777619u;
+    }
+    return hash >> (32 - SLOT_BITS);
+}
+
+// Perfect hash table: the slot of every name holds its id and no two names
+// share one. Empty slots are OTHER.
+struct Table {
+    uint32_t seed;
+    uint8_t lengths[(size_t)HeaderId::LENGTH];
+    HeaderId slots[SLOTS];
+};
+
+// Tries seeds until the names don't collide
+constexpr Table buildTable() {
+    Table table = {};
+    for (size_t id = 0; id < (size_t)HeaderId::LENGTH; id++) {
+        table.lengths[id] = (uint8_t)nameLength(NAMES[id]);
+    }
+    for (uint32_t seed = 0; seed < 10000; seed++) {
+        for (size_t slot = 0; slot < SLOTS; slot++) {
+            table.slots[slot] = HeaderId::OTHER;
+        }
+        bool collision = false;
+        for (size_t id = 1; id < (size_t)HeaderId::LENGTH && !collision;
+             id++) {
+            size_t slot = slotOf(NAMES[id], table.lengths[id], seed);
+            collision = table.slots[slot] != HeaderId::OTHER;
+            table.slots[slot] = (HeaderId)id;
+        }
+        if (!collision) {
+            table.seed = seed;
+            return table;
+        }
+    }
+    table.seed = UINT32_MAX;
+    return table;
+}
+
+static constexpr const Table TABLE = buildTable();
+static_assert(TABLE.seed != UINT32_MAX, "No perfect hash found");
+
+}  // namespace http_header_id
+
+// Hashes the name once and compares it with the one name in its slot
+inline HeaderId headerIdOf(BufferRef name) {
+    using namespace http_header_id;
+
+    HeaderId id = TABLE.slots[slotOf(name.data, name.length, TABLE.seed)];
+    if (id == HeaderId::OTHER || TABLE.lengths[(size_t)id] != name.length) {
+        return HeaderId::OTHER;
+    }
+    const char *known = NAMES[(size_t)id];
+    for (size_t i = 0; i < name.length; i++) {
+        if (lower(name.data[i]) != lower(known[i])) {
+            return HeaderId::OTHER;
+        }
+    }
+    return id;
+}
+
+#endif
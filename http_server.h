@@ -1,17 +1,503 @@
 #ifndef CPP_ASYNC_HTTP_HTTP_SERVER_H
 #define CPP_ASYNC_HTTP_HTTP_SERVER_H
 
+#include <new>
+
+#include "arena.h"
+#include "codel.h"
+#include "future.h"
+#include "http.h"
+#include "http_handler.h"
+#include "http_head.h"
+#include "remote_waker.h"
+#include "slab.h"
+#include "timer.h"
+#include "utils.h"
+
 namespace http_server {
 
-template <typename Server>
-class HttpServer {
+// A connection is closed once one of these runs out, 0 disables it
+struct HttpTimeouts {
+    // From the first byte of a request until its head is read
+    uint64_t headerMillis = 10000;
+    // Reading the body, handling the request and sending the response
+    uint64_t requestMillis = 30000;
+    // Waiting for the next request on a connection that is kept alive
+    uint64_t idleMillis = 60000;
+};
+
+// How the server sheds load instead of letting every request wait longer
+struct HttpOverload {
+    // Clients that connect while every connection is in use get a 503 right
+    // away instead of waiting in the listen backlog
+    bool rejectWhenFull = true;
+    // CoDel on how long woken connections wait until they're polled. Requests
+    // that start while the wait stays above target get a 503. 0 disables it.
+    uint64_t targetMillis = 5;
+    uint64_t intervalMillis = 100;
+};
+
+// Precomputed, so shedding a request costs nothing but the send
+static constexpr const char OVERLOADED_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static constexpr const size_t OVERLOADED_RESPONSE_LENGTH =
+    template_utils::const_str_length(OVERLOADED_RESPONSE);
+
+// For paths longer than the PathLength of the server, whether the head was
+// parsed at once or read with the state machines
+static constexpr const char URI_TOO_LONG_RESPONSE[] =
+    "HTTP/1.1 414 URI Too Long\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static constexpr const size_t URI_TOO_LONG_RESPONSE_LENGTH =
+    template_utils::const_str_length(URI_TOO_LONG_RESPONSE);
+
+// Serves Handler on every connection of Server at once. Every connection has a
+// slot holding its request state machine. Each slot is polled with its own
+// waker so only the connections that can make progress are polled again.
+// Connections are kept alive for the next request unless the request or the
+// client says otherwise, but not longer than the HttpTimeouts allow. Under
+// overload requests are answered with a 503 as HttpOverload says. Server must
+// provide the TimerWheel of its park with getTimers().
+// Every connection has an arena of ArenaCapacity bytes for its requests(see
+// RequestArena), it's reset when the next request starts. Handlers can await
+// work of other threads, like a task of the Executor, through the RemoteWaker
+// of their connection(see Offload), which unparks the park of Server.
+// This future only completes once the Server is closed. It's big, so run it
+// with blockOn(&httpServer, server->getPark()).
+template <typename Server, typename Handler, size_t PathLength = 64,
+          size_t ArenaCapacity = 4096>
+class HttpServer
+    : public Future<HttpServer<Server, Handler, PathLength, ArenaCapacity>,
+                    void_> {
+   private:
+    static constexpr const size_t MAX_CONNECTIONS = Server::MAX_CLIENTS;
+    typedef SizedBuffer<PathLength> PathStore;
+    // Requests with more headers are read with the state machines
+    static constexpr const size_t MAX_HEAD_HEADERS = 32;
+    // Responses of pipelined requests that can wait for one send
+    static constexpr const size_t MAX_PIPELINED = 16;
+    // The request futures are templated on these so nothing on the way from
+    // the socket to the handler is a virtual call
+    typedef typename Server::Client::Reader ClientReader;
+    typedef typename Server::Client::Writer ClientWriter;
+
    public:
-    HttpServer(Server *server) : server(server) {}
+    explicit HttpServer(Server *server,
+                        HttpTimeouts timeouts = HttpTimeouts(),
+                        HttpOverload overload = HttpOverload())
+        : server(server),
+          timeouts(timeouts),
+          overload(overload),
+          codel(overload.targetMillis, overload.intervalMillis),
+          acceptFuture(server->accept()) {}
+
+    Poll<void_> poll(Context *cx) {
+        if (!initialized) {
+            // Now that we won't be moved anymore the wakers can point to us
+            initialized = true;
+            remoteWakes.setUnpark(Waker(server->getPark(), unparkServer));
+            for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+                connections[i].server = this;
+                connections[i].index = i;
+                connections[i].remote.setQueue(&remoteWakes);
+            }
+        }
+        taskWaker = cx->getWaker();
+        // The park doesn't run while connections keep waking us, and spinning
+        // parks never advance the wheel by themselves
+        server->getTimers()->advance(monotonicMillis());
+        remoteWakes.wakeQueued();
+
+        if (acceptWoken) {
+            bool closed = pollAccept();
+            if (closed) {
+                // The wakes of work that's still running elsewhere would
+                // point into us
+                for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+                    connections[i].remote.abandon();
+                }
+                READY(void_())
+            }
+        }
+
+        // Only poll the connections that were woken before this poll. A
+        // connection that wakes itself while being polled is polled in the
+        // next poll.
+        size_t woken = readyLength;
+        for (size_t i = 0; i < woken; i++) {
+            size_t index = readyQueue[readyStart];
+            readyStart = (readyStart + 1) % MAX_CONNECTIONS;
+            readyLength--;
+
+            Connection *connection = &connections[index];
+            connection->woken = false;
+            pollConnection(connection);
+        }
+
+        if (readyLength > 0 || acceptWoken) {
+            cx->getWaker().wake();
+        }
+        return Poll<void_>::pending();
+    }
 
    private:
+    struct Connection {
+        Connection() : none() {}
+
+        enum class State {
+            FREE,
+            HEAD,
+            FLUSH,
+            STATUS_LINE,
+            HANDLE,
+            // Sends the rejection and closes
+            REJECT,
+            REJECT_FLUSH
+        } state = State::FREE;
+        bool woken = false;
+        // When it was last put into the ready queue, for CoDel
+        uint64_t wokenAt = 0;
+        size_t index;
+        HttpServer *server;
+
+        SlabHandle clientId;
+        // The response of REJECT
+        const char *rejection;
+        size_t rejectionLength;
+        ClientReader *reader;
+        ClientWriter *writer;
+        PathStore pathStore;
+        HttpRequestHead<MAX_HEAD_HEADERS> head;
+        HttpPipeline pipeline = HttpPipeline{.maxUnflushed = MAX_PIPELINED};
+        SizedArena<ArenaCapacity> arena;
+        // The deadline of the current state
+        Timer timer;
+        // Wakes this from other threads, see Offload
+        RemoteWaker remote;
+        union {
+            void_ none;
+            typename reader_ops<ClientReader>::FillBuf *fillBuf;
+            typename writer_ops<ClientWriter>::Flush *flush;
+            typename writer_ops<ClientWriter>::WriteFromBuffer *write;
+            ReadHttpRequestStatusLine<PathStore, ClientReader> readStatusLine;
+            HandleHttpRequest<Handler, ClientReader, ClientWriter> handle;
+        };
+    };
+
+    static void wakeConnection(void *data) {
+        Connection *connection = (Connection *)data;
+        if (connection->woken ||
+            connection->state == Connection::State::FREE) {
+            return;
+        }
+        connection->woken = true;
+
+        HttpServer *server = connection->server;
+        if (server->overload.targetMillis != 0) {
+            connection->wokenAt = monotonicMillis();
+        }
+        size_t end =
+            (server->readyStart + server->readyLength) % MAX_CONNECTIONS;
+        server->readyQueue[end] = connection->index;
+        server->readyLength++;
+
+        server->taskWaker.wake();
+    }
+
+    static void unparkServer(void *data) {
+        ((typename Server::Park *)data)->unpark();
+    }
+
+    static void wakeAccept(void *data) {
+        HttpServer *server = (HttpServer *)data;
+        server->acceptWoken = true;
+        server->taskWaker.wake();
+    }
+
+    // Accepts all waiting clients. Returns if the server is closed.
+    bool pollAccept() {
+        acceptWoken = false;
+        Context acceptCx = Context(Waker(this, wakeAccept));
+
+        while (true) {
+            auto poll = acceptFuture.poll(&acceptCx);
+            if (poll.isPending()) {
+                return false;
+            }
+            auto result = poll.get();
+            acceptFuture = server->accept();
+
+            if (result.isEmpty()) {
+                // Either closed or full. If full, a freed connection will wake
+                // the accept again. Until then the waiting clients are told
+                // to come back later.
+                if (server->isClosed()) {
+                    return true;
+                }
+                if (overload.rejectWhenFull) {
+                    while (server->rejectClient(&acceptCx, OVERLOADED_RESPONSE,
+                                                OVERLOADED_RESPONSE_LENGTH)) {
+                    }
+                }
+                return false;
+            }
+
+            SlabHandle clientId = result.get().template at<0>();
+            auto *client = result.get().template at<1>();
+
+            Connection *connection = &connections[clientId.index];
+            connection->clientId = clientId;
+            connection->reader = client->getReader().get();
+            connection->writer = client->getWriter().get();
+            connection->pipeline.unflushed = 0;
+            startRequest(connection);
+            armTimer(connection, timeouts.headerMillis);
+            wakeConnection(connection);
+        }
+    }
+
+    // Tries to parse the whole head from the buffered bytes first
+    void startRequest(Connection *connection) {
+        connection->state = Connection::State::HEAD;
+        connection->pathStore.clear();
+        connection->arena.reset();
+        connection->fillBuf = connection->reader->fillBuf();
+    }
+
+    void armTimer(Connection *connection, uint64_t millis) {
+        if (millis == 0) {
+            connection->timer.cancel();
+            return;
+        }
+        TimerWheel *timers = server->getTimers();
+        timers->arm(&connection->timer, timers->now() + millis,
+                    Waker(connection, wakeConnection));
+    }
+
+    // Asked when a woken connection starts a request, so the requests that
+    // waited too long in the ready queue are shed
+    bool isOverloaded(Connection *connection) {
+        if (connection->wokenAt == 0) {
+            return false;
+        }
+        uint64_t now = monotonicMillis();
+        uint64_t sojourn = now - min(now, connection->wokenAt);
+        connection->wokenAt = 0;
+        return codel.shouldDrop(sojourn, now);
+    }
+
+    void freeConnection(Connection *connection) {
+        releaseConnection(connection);
+        server->freeClient(connection->clientId);
+    }
+
+    // After a rejection the client may still be sending the request, closing
+    // its socket right away could reset the connection before it read the
+    // response
+    void lingerConnection(Connection *connection) {
+        releaseConnection(connection);
+        server->lingerClient(connection->clientId);
+    }
+
+    void releaseConnection(Connection *connection) {
+        connection->state = Connection::State::FREE;
+        connection->timer.cancel();
+        // The request may have been dropped while it waited for another
+        // thread
+        connection->remote.abandon();
+
+        // There's a free slot again
+        acceptWoken = true;
+    }
+
+    void pollConnection(Connection *connection) {
+        Context connectionCx = Context(Waker(connection, wakeConnection));
+        Context *cx = &connectionCx;
+
+        if (connection->state != Connection::State::FREE &&
+            connection->timer.isExpired()) {
+            freeConnection(connection);
+            return;
+        }
+
+        switch (connection->state) {
+            case Connection::State::FREE:
+                return;
+            case Connection::State::HEAD:
+            head: {
+                auto poll = connection->fillBuf->poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                if (isOverloaded(connection)) {
+                    goto shed;
+                }
+                BufferRef buffered = poll.get();
+                HttpHeadParse parse =
+                    parseHttpRequestHead(buffered, &connection->head);
+                if (parse == HttpHeadParse::COMPLETE) {
+                    BufferRef path = connection->head.path;
+                    if (path.length > PathLength) {
+                        goto pathTooLong;
+                    }
+                    for (size_t i = 0; i < path.length; i++) {
+                        connection->pathStore.push(path.data[i]);
+                    }
+                    connection->head.statusLine.path =
+                        connection->pathStore.asRef();
+
+                    connection->state = Connection::State::HANDLE;
+                    new (&connection->handle)
+                        HandleHttpRequest<Handler, ClientReader, ClientWriter>(
+                            &connection->head, connection->reader,
+                            connection->writer, &connection->pipeline,
+                            &connection->arena, &connection->remote);
+                    armTimer(connection, timeouts.requestMillis);
+                    goto handle;
+                }
+                if (connection->pipeline.unflushed == 0) {
+                    goto initStatusLine;
+                }
+
+                // The waiting responses can't wait for the rest of this
+                // request
+                connection->pipeline.unflushed = 0;
+                connection->state = Connection::State::FLUSH;
+                connection->flush = connection->writer->flush();
+                armTimer(connection, timeouts.requestMillis);
+            }
+                // Fallthrough
+            case Connection::State::FLUSH: {
+                auto poll = connection->flush->poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                if (!poll.get()) {
+                    freeConnection(connection);
+                    return;
+                }
+            }
+            initStatusLine: {
+                // Nothing was consumed so the state machines start from the
+                // beginning and wait for the rest of the head
+                connection->state = Connection::State::STATUS_LINE;
+                new (&connection->readStatusLine)
+                    ReadHttpRequestStatusLine<PathStore, ClientReader>(
+                        connection->reader, &connection->pathStore);
+                armTimer(connection, timeouts.headerMillis);
+            }
+                // Fallthrough
+            case Connection::State::STATUS_LINE: {
+                auto poll = connection->readStatusLine.poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                auto statusLineOpt = poll.get();
+                if (statusLineOpt.isEmpty()) {
+                    if (connection->readStatusLine.isPathTooLong()) {
+                        goto pathTooLong;
+                    }
+                    freeConnection(connection);
+                    return;
+                }
+
+                HttpRequestStatusLine statusLine = statusLineOpt.get();
+                statusLine.path = connection->pathStore.asRef();
+
+                connection->state = Connection::State::HANDLE;
+                new (&connection->handle)
+                    HandleHttpRequest<Handler, ClientReader, ClientWriter>(
+                        statusLine, connection->reader, connection->writer,
+                        &connection->pipeline, &connection->arena,
+                        &connection->remote);
+                armTimer(connection, timeouts.requestMillis);
+            }
+                // Fallthrough
+            case Connection::State::HANDLE:
+            handle: {
+                auto poll = connection->handle.poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                if (!poll.get()) {
+                    freeConnection(connection);
+                    return;
+                }
+
+                // Keep alive
+                startRequest(connection);
+                armTimer(connection, timeouts.idleMillis);
+                // Not woken, so it didn't wait in the ready queue
+                connection->wokenAt = 0;
+                goto head;
+            }
+            shed: {
+                connection->rejection = OVERLOADED_RESPONSE;
+                connection->rejectionLength = OVERLOADED_RESPONSE_LENGTH;
+                goto reject;
+            }
+            pathTooLong: {
+                connection->rejection = URI_TOO_LONG_RESPONSE;
+                connection->rejectionLength = URI_TOO_LONG_RESPONSE_LENGTH;
+            }
+            reject: {
+                connection->state = Connection::State::REJECT;
+                connection->write = connection->writer->writeFromBuffer(
+                    connection->rejection, connection->rejectionLength);
+                armTimer(connection, timeouts.requestMillis);
+            }
+                // Fallthrough
+            case Connection::State::REJECT: {
+                auto poll = connection->write->poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                if (poll.get() != connection->rejectionLength) {
+                    freeConnection(connection);
+                    return;
+                }
+                connection->state = Connection::State::REJECT_FLUSH;
+                connection->flush = connection->writer->flush();
+            }
+                // Fallthrough
+            case Connection::State::REJECT_FLUSH: {
+                auto poll = connection->flush->poll(cx);
+                if (poll.isPending()) {
+                    return;
+                }
+                if (!poll.get()) {
+                    freeConnection(connection);
+                    return;
+                }
+                lingerConnection(connection);
+                return;
+            }
+        }
+    }
+
     Server *server;
+    HttpTimeouts timeouts;
+    HttpOverload overload;
+    CoDel codel;
+    bool initialized = false;
+    Waker taskWaker;
+    RemoteWakeQueue remoteWakes;
+
+    bool acceptWoken = true;
+    typename Server::AcceptFuture acceptFuture;
+
+    size_t readyStart = 0;
+    size_t readyLength = 0;
+    size_t readyQueue[MAX_CONNECTIONS];
+    Connection connections[MAX_CONNECTIONS];
 };
 
 }  // namespace http_server
 
-#endif
\ No newline at end of file
+#endif
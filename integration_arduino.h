@@ -6,6 +6,7 @@
 
 // Lib
 #include "future.h"
+#include "slab.h"
 
 // NOT FINISHED!!!!!!
 
@@ -33,11 +34,18 @@ class ArduinoWiFiServer {
     typedef ArduinoWiFiClient Client;
 
     class AcceptFuture
-        : Future<AcceptFuture, Optional<Tuple<size_t, ArduinoWiFiClient*>>> {};
+        : Future<AcceptFuture,
+                 Optional<Tuple<SlabHandle, ArduinoWiFiClient*>>> {};
 
     AcceptFuture accept() {}
 
-    void freeClient(size_t clientId) {}
+    bool rejectClient(Context* cx, const char* response, size_t length) {
+        return false;
+    }
+
+    void freeClient(SlabHandle clientId) {}
+
+    void lingerClient(SlabHandle clientId) {}
 
     void close() {}
     bool isClosed() {}
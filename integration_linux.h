@@ -0,0 +1,653 @@
+#ifndef CPP_ASYNC_HTTP_LINUX_INTEGRATION_H
+#define CPP_ASYNC_HTTP_LINUX_INTEGRATION_H
+
+// Linux
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Lib
+#include "buffer_pool.h"
+#include "future.h"
+#include "linger.h"
+#include "reader.h"
+#include "slab.h"
+#include "timer.h"
+#include "utils.h"
+#include "writer.h"
+
+namespace integration_linux {
+
+// A socket registered edge triggered in an EpollReactor. The readiness flags
+// are set by epoll events and only cleared when a syscall returns EAGAIN. The
+// wakers are woken and cleared once the socket becomes readable/writable.
+struct LinuxSocket {
+    int fd = -1;
+    bool readable = false;
+    bool writable = false;
+    Waker readWaker;
+    Waker writeWaker;
+};
+
+class EpollReactor {
+   public:
+    explicit EpollReactor() : epollFd(-1) {}
+    // Registers an eventfd for unpark, it's the only event without a socket
+    explicit EpollReactor(int epollFd) : epollFd(epollFd) {
+        if (epollFd == -1) {
+            return;
+        }
+        notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notifyFd == -1) {
+            return;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = nullptr;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, notifyFd, &event);
+    }
+
+    // The socket must not be moved while it's registered.
+    bool add(LinuxSocket *socket) {
+        if (epollFd == -1) {
+            return false;
+        }
+        socket->readable = false;
+        socket->writable = false;
+        socket->readWaker = Waker();
+        socket->writeWaker = Waker();
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = socket;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, socket->fd, &event) == 0;
+    }
+
+    // Before the socket is handed over without being closed
+    void remove(LinuxSocket *socket) {
+        if (epollFd != -1 && socket->fd != -1) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, socket->fd, NULL);
+        }
+    }
+
+    // Waits at most timeoutMs(-1 = forever) for events, updates the readiness
+    // of the registered sockets and wakes the futures waiting on them.
+    void poll(int timeoutMs) {
+        if (epollFd == -1) {
+            return;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+        for (int i = 0; i < count; i++) {
+            LinuxSocket *socket = (LinuxSocket *)events[i].data.ptr;
+            uint32_t flags = events[i].events;
+            if (socket == nullptr) {
+                // Unparked, the next poll finds what was queued
+                uint64_t value;
+                while (read(notifyFd, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                socket->readable = true;
+                wake(&socket->readWaker);
+            }
+            if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                socket->writable = true;
+                wake(&socket->writeWaker);
+            }
+        }
+    }
+
+    // Used as the park of blockOn: sleeps until a socket gets ready or the
+    // next timer expires.
+    void park() {
+        poll(timers.timeoutMillis(monotonicMillis()));
+        timers.advance(monotonicMillis());
+    }
+
+    // Any thread: makes the current or next park return
+    void unpark() {
+        if (notifyFd != -1) {
+            uint64_t one = 1;
+            ssize_t written = write(notifyFd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    TimerWheel *getTimers() { return &timers; }
+
+    void close() {
+        if (notifyFd != -1) {
+            ::close(notifyFd);
+            notifyFd = -1;
+        }
+        if (epollFd == -1) {
+            return;
+        }
+        ::close(epollFd);
+        epollFd = -1;
+    }
+
+   private:
+    static constexpr const int MAX_EVENTS = 64;
+
+    static void wake(Waker *waker) {
+        Waker woken = *waker;
+        *waker = Waker();
+        woken.wake();
+    }
+
+    int epollFd;
+    int notifyFd = -1;
+    TimerWheel timers;
+};
+
+// Reader
+class LinuxReaderImpl {
+   public:
+    explicit LinuxReaderImpl(LinuxSocket *socket) : socket(socket) {}
+
+    Optional<size_t> readIntoBuffer(Context *cx, char *buffer,
+                                    size_t bufferLength) {
+        if (shutdown) {
+            return Optional<size_t>::empty();
+        }
+        if (bufferLength <= 0) {
+            return Optional<size_t>::of(0);
+        }
+        if (!socket->readable) {
+            socket->readWaker = cx->getWaker();
+            return Optional<size_t>::of(0);
+        }
+
+        ssize_t read = recv(socket->fd, buffer, bufferLength, 0);
+
+        if (read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                socket->readable = false;
+                socket->readWaker = cx->getWaker();
+                return Optional<size_t>::of(0);
+            } else if (errno == EINTR) {
+                cx->getWaker().wake();
+                return Optional<size_t>::of(0);
+            } else {
+                shutdown = true;
+                return Optional<size_t>::empty();
+            }
+        }
+        if (read == 0) {
+            // Connection closed
+            shutdown = true;
+            return Optional<size_t>::empty();
+        }
+
+        return Optional<size_t>::of((size_t)read);
+    }
+
+    bool isShutdown() { return shutdown; }
+
+   private:
+    bool shutdown = false;
+    LinuxSocket *socket;
+};
+
+// Requests are read in chunks of this size
+static constexpr const size_t READ_BUFFER_LENGTH = 4096;
+
+// The buffers are lent by the BufferPool of the server
+typedef BufferedReader<LinuxReaderImpl, READ_BUFFER_LENGTH,
+                       PooledBuffer<READ_BUFFER_LENGTH>>
+    LinuxReader;
+
+LinuxReader readFromLinuxSocket(LinuxSocket *socket, BufferPool *pool) {
+    return LinuxReader(LinuxReaderImpl(socket),
+                       PooledBuffer<READ_BUFFER_LENGTH>(pool));
+}
+
+class LinuxWriterImpl {
+   public:
+    explicit LinuxWriterImpl(LinuxSocket *socket) : socket(socket) {}
+
+    Optional<size_t> writeFromBuffer(Context *cx, const char *buffer,
+                                     size_t bufferLength) {
+        if (shutdown) {
+            return Optional<size_t>::empty();
+        }
+        if (bufferLength <= 0) {
+            return Optional<size_t>::of(0);
+        }
+        if (!socket->writable) {
+            socket->writeWaker = cx->getWaker();
+            return Optional<size_t>::of(0);
+        }
+
+        ssize_t written = send(socket->fd, buffer, bufferLength, MSG_NOSIGNAL);
+
+        if (written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                socket->writable = false;
+                socket->writeWaker = cx->getWaker();
+                return Optional<size_t>::of(0);
+            } else if (errno == EINTR) {
+                cx->getWaker().wake();
+                return Optional<size_t>::of(0);
+            } else {
+                shutdown = true;
+                return Optional<size_t>::empty();
+            }
+        }
+
+        return Optional<size_t>::of((size_t)written);
+    }
+
+   private:
+    bool shutdown = false;
+    LinuxSocket *socket;
+};
+
+// Responses are collected in a buffer of up to this size before being sent
+static constexpr const size_t WRITE_BUFFER_LENGTH = 4096;
+
+typedef BufferedWriter<LinuxWriterImpl, WRITE_BUFFER_LENGTH,
+                       PooledBuffer<WRITE_BUFFER_LENGTH>>
+    LinuxWriter;
+
+LinuxWriter writeToLinuxSocket(LinuxSocket *socket, BufferPool *pool) {
+    return LinuxWriter(LinuxWriterImpl(socket),
+                       PooledBuffer<WRITE_BUFFER_LENGTH>(pool));
+}
+
+// Most responses fit into a small buffer, the reads take the large ones
+static constexpr const size_t SMALL_BUFFER_LENGTH = 1024;
+
+// Client/Server
+class LinuxClient {
+   public:
+    typedef LinuxReader Reader;
+    typedef LinuxWriter Writer;
+
+    explicit LinuxClient() : LinuxClient(nullptr, nullptr) {}
+    // The socket must be non blocking and registered in a reactor. The
+    // buffers are only lent by the pool while they hold bytes.
+    LinuxClient(LinuxSocket *socket, BufferPool *pool)
+        : socket(socket),
+          writer(writeToLinuxSocket(socket, pool)),
+          reader(readFromLinuxSocket(socket, pool)) {}
+
+    Optional<LinuxWriter *> getWriter() {
+        if (isClosed()) {
+            return Optional<LinuxWriter *>::empty();
+        }
+        return Optional<LinuxWriter *>::of(&writer);
+    }
+    Optional<LinuxReader *> getReader() {
+        if (isClosed()) {
+            return Optional<LinuxReader *>::empty();
+        }
+        return Optional<LinuxReader *>::of(&reader);
+    }
+
+    void close() {
+        int fd = takeSocket();
+        if (fd == -1) {
+            return;
+        }
+
+        // Closing the fd also removes it from the epoll set
+        shutdown(fd, SHUT_WR);
+        ::close(fd);
+    }
+
+    // Closes the client but hands its socket over instead of closing it.
+    // Returns -1 if it has none.
+    int takeSocket() {
+        if (closed) {
+            return -1;
+        }
+
+        closed = true;
+        writer.dropBuffered();
+        reader.dropBuffered();
+
+        if (socket == nullptr || socket->fd == -1) {
+            return -1;
+        }
+
+        int fd = socket->fd;
+        socket->fd = -1;
+        socket->readWaker = Waker();
+        socket->writeWaker = Waker();
+        return fd;
+    }
+    bool isClosed() { return closed || socket == nullptr || socket->fd == -1; }
+
+   private:
+    bool closed = false;
+    LinuxSocket *socket;
+    LinuxWriter writer;
+    LinuxReader reader;
+};
+
+// The server can't be copied or moved because the reactor and the clients
+// point into it. It's big, so construct it where it stays.
+//
+// Only MAX_BUSY clients at a time get I/O buffers, idle keep-alive clients
+// hold none. A client that finds no read buffer waits until another client
+// gives one back, one without a write buffer writes to its socket directly.
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
+class LinuxServer {
+   public:
+    typedef LinuxClient Client;
+
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    // The listen socket must be non blocking and listening.
+    explicit LinuxServer(int listenFd)
+        : reactor(listenFd == -1 ? EpollReactor()
+                                 : EpollReactor(epoll_create1(EPOLL_CLOEXEC))) {
+        listenSocket.fd = listenFd;
+    }
+
+    LinuxServer(const LinuxServer &other) = delete;
+    LinuxServer &operator=(const LinuxServer &other) = delete;
+
+    class AcceptFuture
+        : Future<AcceptFuture, Optional<Tuple<SlabHandle, LinuxClient *>>> {
+       private:
+        typedef Optional<Tuple<SlabHandle, LinuxClient *>> Return;
+
+       public:
+        AcceptFuture(LinuxServer *server) : server(server) {}
+
+        Poll<Return> poll(Context *cx) {
+            if (server->isClosed()) {
+                READY(Return::empty())
+            }
+
+            if (server->clients.isFull()) {
+                READY(Return::empty())
+            }
+
+            if (!server->listenRegistered) {
+                if (!server->reactor.add(&server->listenSocket)) {
+                    server->close();
+                    READY(Return::empty())
+                }
+                server->listenRegistered = true;
+            }
+
+            if (server->isBackingOff(cx)) {
+                return Poll<Return>::pending();
+            }
+
+            // Only call accept if epoll reported a new connection. It stays
+            // readable until accept4 runs dry, so one readiness event accepts
+            // the whole backlog or until the slab is full.
+            if (!server->listenSocket.readable) {
+                server->listenSocket.readWaker = cx->getWaker();
+                return Poll<Return>::pending();
+            }
+
+            int clientFd = accept4(server->listenSocket.fd, NULL, NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientFd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    server->listenSocket.readable = false;
+                    server->listenSocket.readWaker = cx->getWaker();
+                } else if (isTransientAcceptError(errno)) {
+                    cx->getWaker().wake();
+                } else {
+                    server->backOff(cx);
+                }
+                return Poll<Return>::pending();
+            }
+
+            SlabHandle clientId = server->clients.allocate().get();
+            LinuxSocket *socket = &server->sockets[clientId.index];
+            socket->fd = clientFd;
+            if (!server->reactor.add(socket)) {
+                ::close(clientFd);
+                socket->fd = -1;
+                server->clients.free(clientId);
+                server->backOff(cx);
+                return Poll<Return>::pending();
+            }
+
+            LinuxClient *linuxClient = &server->clientSlots[clientId.index];
+            *linuxClient = LinuxClient(socket, &server->bufferPool);
+
+            READY(Return::of(
+                Tuple<SlabHandle, LinuxClient *>(clientId, linuxClient)))
+        }
+
+       private:
+        LinuxServer *server;
+    };
+
+    AcceptFuture accept() { return AcceptFuture(this); }
+
+    // Accepts a waiting client only to send it response and close it, for
+    // when the slab is full. Returns false once no client is waiting, cx is
+    // woken when the next one arrives.
+    bool rejectClient(Context *cx, const char *response, size_t length) {
+        if (isClosed() || !listenRegistered || isBackingOff(cx)) {
+            return false;
+        }
+        if (!listenSocket.readable) {
+            listenSocket.readWaker = cx->getWaker();
+            return false;
+        }
+        int clientFd = accept4(listenSocket.fd, NULL, NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                listenSocket.readable = false;
+                listenSocket.readWaker = cx->getWaker();
+                return false;
+            }
+            if (isTransientAcceptError(errno)) {
+                cx->getWaker().wake();
+            } else {
+                backOff(cx);
+            }
+            return false;
+        }
+
+        // Best effort, the socket buffer of a new connection takes it. The
+        // request usually arrives later, so the socket lingers to read it.
+        rejected.add(reactor.getTimers(), clientFd, response, length);
+        return true;
+    }
+
+    // Stale ids of clients that were already freed are ignored
+    void freeClient(SlabHandle clientId) {
+        if (!clients.free(clientId)) {
+            return;
+        }
+        clientSlots[clientId.index].close();
+    }
+
+    void lingerClient(SlabHandle clientId) {
+        if (!clients.free(clientId)) {
+            return;
+        }
+        reactor.remove(&sockets[clientId.index]);
+        int fd = clientSlots[clientId.index].takeSocket();
+        if (fd != -1) {
+            rejected.add(reactor.getTimers(), fd, nullptr, 0);
+        }
+    }
+
+    void close() {
+        if (closed) {
+            return;
+        }
+        closed = true;
+
+        // Close clients
+        for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+            if (clients.isInUse(i)) {
+                clientSlots[i].close();
+            }
+        }
+
+        rejected.closeAll();
+        // The cache of this thread would keep buffers of a closed server
+        bufferPool.flushThreadCache();
+
+        // Close server
+        if (listenSocket.fd != -1) {
+            ::close(listenSocket.fd);
+            listenSocket.fd = -1;
+        }
+        reactor.close();
+    }
+    bool isClosed() { return closed || listenSocket.fd == -1; }
+
+    EpollReactor *getReactor() { return &reactor; }
+
+    // Futures of this server must be run with the reactor as park
+    typedef EpollReactor Park;
+    Park *getPark() { return &reactor; }
+
+    TimerWheel *getTimers() { return reactor.getTimers(); }
+
+   private:
+    // How long accepting pauses once it ran out of fds or memory
+    static constexpr const uint64_t ACCEPT_BACKOFF_MILLIS = 10;
+
+    // Errors of a single connection, the next one can be accepted right away
+    static bool isTransientAcceptError(int error) {
+        return error == EINTR || error == ECONNABORTED || error == EPROTO;
+    }
+
+    // Without fds or memory accepting keeps failing until clients are
+    // closed, so it pauses instead of spinning. The reactor and the timers are
+    // still served meanwhile.
+    void backOff(Context *cx) {
+        TimerWheel *timers = reactor.getTimers();
+        timers->arm(&acceptBackoff, timers->now() + ACCEPT_BACKOFF_MILLIS,
+                    cx->getWaker());
+    }
+
+    // Returns if accepting is paused, cx is woken once the pause is over
+    bool isBackingOff(Context *cx) {
+        if (!acceptBackoff.isArmed()) {
+            return false;
+        }
+        acceptBackoff.setWaker(cx->getWaker());
+        return true;
+    }
+
+    bool closed = false;
+    bool listenRegistered = false;
+    LinuxSocket listenSocket;
+    EpollReactor reactor;
+    Timer acceptBackoff;
+    LingeringSockets<> rejected;
+    Slab<MAX_CONNECTIONS> clients;
+    LinuxSocket sockets[MAX_CONNECTIONS];
+    // Outlives the clients that give their buffers back
+    SizedBufferPool<SMALL_BUFFER_LENGTH, MAX_BUSY, READ_BUFFER_LENGTH, MAX_BUSY>
+        bufferPool;
+    LinuxClient clientSlots[MAX_CONNECTIONS];
+};
+
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
+class SimpleLinuxServer {
+   public:
+    // With reusePort several servers can listen on the same port, the kernel
+    // spreads the connections over them
+    SimpleLinuxServer(int port, bool reusePort = false)
+        : server(listenOn(port, reusePort)) {}
+
+    // Neither copied nor moved, it's big and the clients point into it
+    SimpleLinuxServer(const SimpleLinuxServer &other) = delete;
+    SimpleLinuxServer &operator=(const SimpleLinuxServer &other) = delete;
+
+    ~SimpleLinuxServer() { server.close(); }
+
+    typedef typename LinuxServer<MAX_CONNECTIONS, MAX_BUSY>::Client Client;
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    typedef typename LinuxServer<MAX_CONNECTIONS, MAX_BUSY>::AcceptFuture
+        AcceptFuture;
+
+    inline AcceptFuture accept() { return server.accept(); }
+
+    inline bool rejectClient(Context *cx, const char *response,
+                             size_t length) {
+        return server.rejectClient(cx, response, length);
+    }
+
+    inline void freeClient(SlabHandle clientId) {
+        server.freeClient(clientId);
+    }
+
+    inline void lingerClient(SlabHandle clientId) {
+        server.lingerClient(clientId);
+    }
+
+    inline void close() { server.close(); }
+    inline bool isClosed() { return server.isClosed(); }
+
+    inline EpollReactor *getReactor() { return server.getReactor(); }
+
+    typedef typename LinuxServer<MAX_CONNECTIONS, MAX_BUSY>::Park Park;
+    inline Park *getPark() { return server.getPark(); }
+
+    inline TimerWheel *getTimers() { return server.getTimers(); }
+
+   private:
+    // Returns the listening socket, -1 if it couldn't be set up
+    static int listenOn(int port, bool reusePort) {
+        // Create the socket
+        int listenFd =
+            socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd == -1) {
+            return -1;
+        }
+
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (reusePort) {
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                       sizeof(reuse));
+        }
+
+        // Bind that socket
+        struct sockaddr_in address = {};
+        // IPV4
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+
+        int iResult =
+            bind(listenFd, (struct sockaddr *)&address, sizeof(address));
+        if (iResult != 0) {
+            ::close(listenFd);
+            return -1;
+        }
+
+        // Listen once, epoll reports new connections afterwards
+        iResult = listen(listenFd, SOMAXCONN);
+        if (iResult != 0) {
+            ::close(listenFd);
+            return -1;
+        }
+
+        return listenFd;
+    }
+
+    LinuxServer<MAX_CONNECTIONS, MAX_BUSY> server;
+};
+
+}  // namespace integration_linux
+
+#endif
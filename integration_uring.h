@@ -0,0 +1,961 @@
+#ifndef CPP_ASYNC_HTTP_URING_INTEGRATION_H
+#define CPP_ASYNC_HTTP_URING_INTEGRATION_H
+
+// Linux io_uring(kernel 5.19+ for provided buffer rings). liburing isn't
+// needed, the rings are set up with the raw syscalls.
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Lib
+#include "buffer_pool.h"
+#include "future.h"
+#include "linger.h"
+#include "reader.h"
+#include "slab.h"
+#include "timer.h"
+#include "utils.h"
+#include "writer.h"
+
+namespace integration_uring {
+
+static inline int ioUringSetup(unsigned entries,
+                               struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int ioUringEnter(int ringFd, unsigned toSubmit,
+                               unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                        flags, NULL, 0);
+}
+
+static inline int ioUringRegister(int ringFd, unsigned opcode, void *arg,
+                                  unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, nrArgs);
+}
+
+// One submitted operation. The reactor stores its result once it completed
+// and wakes the waker.
+struct UringOp {
+    bool inFlight = false;
+    bool done = false;
+    // The socket was closed while this was in flight, nobody waits for it
+    bool orphaned = false;
+    int32_t result = 0;
+    uint32_t flags = 0;
+    Waker waker;
+};
+
+// Operations that can fail like this are submitted again
+static inline bool isRetryable(int32_t result) {
+    return result == -EAGAIN || result == -EINTR || result == -ENOBUFS;
+}
+
+struct UringSocket {
+    int fd = -1;
+    UringOp recvOp;
+    UringOp sendOp;
+
+    // The provided buffer of the last receive until it's read completely
+    bool hasBuffer = false;
+    uint16_t bufferId = 0;
+    size_t bufferOffset = 0;
+    size_t bufferLength = 0;
+
+    // The slot can only be reused once the kernel is done with it
+    bool isIdle() { return !recvOp.inFlight && !sendOp.inFlight; }
+};
+
+// Operations are only queued when they're submitted. park() submits all of
+// them with one io_uring_enter which also waits for the completions, so a
+// loop over all connections costs one syscall.
+// Receives don't take a buffer, the kernel picks one of the provided buffers
+// once data arrived. Waiting connections therefore don't hold a buffer.
+class UringReactor {
+   public:
+    // Must be powers of two
+    static constexpr const unsigned ENTRIES = 256;
+    static constexpr const unsigned BUFFER_COUNT = 64;
+
+    static constexpr const unsigned BUFFER_LENGTH = 4096;
+    static constexpr const uint16_t BUFFER_GROUP = 0;
+
+    explicit UringReactor() {}
+
+    // Returns false if io_uring or provided buffer rings aren't supported
+    bool setup() {
+        struct io_uring_params params = {};
+        ringFd = ioUringSetup(ENTRIES, &params);
+        if (ringFd < 0) {
+            ringFd = -1;
+            return false;
+        }
+
+        sqRingSize =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqRingSize = max(sqRingSize, cqRingSize);
+            cqRingSize = sqRingSize;
+        }
+
+        sqRing = mmapRing(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = singleMmap ? sqRing : mmapRing(cqRingSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)mmapRing(sqesSize, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED ||
+            sqes == MAP_FAILED) {
+            close();
+            return false;
+        }
+
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        sqLocalTail = *sqTail;
+
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return setupBuffers();
+    }
+
+    bool submitAccept(int listenFd, UringOp *op) {
+        struct io_uring_sqe *sqe = nextSqe(op);
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        return true;
+    }
+
+    bool submitRecv(int fd, UringOp *op) {
+        struct io_uring_sqe *sqe = nextSqe(op);
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->len = BUFFER_LENGTH;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        return true;
+    }
+
+    // The buffer must stay valid until the op completed
+    bool submitSend(int fd, const char *buffer, size_t length, UringOp *op) {
+        struct io_uring_sqe *sqe = nextSqe(op);
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)buffer;
+        sqe->len = (uint32_t)min(length, (size_t)UINT32_MAX);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return true;
+    }
+
+    // The buffer must stay valid until the op completed
+    bool submitRead(int fd, char *buffer, size_t length, UringOp *op) {
+        struct io_uring_sqe *sqe = nextSqe(op);
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)buffer;
+        sqe->len = (uint32_t)length;
+        // The current position, eventfds can't seek
+        sqe->off = (uint64_t)-1;
+        return true;
+    }
+
+    char *getBuffer(uint16_t bufferId) {
+        return buffers + (size_t)bufferId * BUFFER_LENGTH;
+    }
+
+    // Gives the buffer back to the kernel
+    void recycleBuffer(uint16_t bufferId) {
+        // Not bufRing->bufs, the header adds a padding member before it in
+        // C++
+        struct io_uring_buf *buf = (struct io_uring_buf *)bufRing +
+                                   (bufRingTail & (BUFFER_COUNT - 1));
+        buf->addr = (uint64_t)getBuffer(bufferId);
+        buf->len = BUFFER_LENGTH;
+        buf->bid = bufferId;
+        bufRingTail++;
+        __atomic_store_n(&bufRing->tail, bufRingTail, __ATOMIC_RELEASE);
+    }
+
+    // Woken when an orphaned op completed and its slot can be reused
+    void setIdleWaker(Waker waker) { idleWaker = waker; }
+
+    // Used as the park of blockOn: submits the queued ops and sleeps until at
+    // least one op completed or the next timer expires.
+    void park() {
+        if (ringFd == -1) {
+            return;
+        }
+        // A read of the eventfd completes once unpark was called
+        if (notifyFd != -1 && !notifyOp.inFlight) {
+            submitRead(notifyFd, (char *)&notifyCount, sizeof(notifyCount),
+                       &notifyOp);
+        }
+
+        bool completed = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead;
+        int timeoutMs = timers.timeoutMillis(monotonicMillis());
+        if (completed || timeoutMs == 0) {
+            if (toSubmit > 0) {
+                submit(ioUringEnter(ringFd, toSubmit, 0, 0));
+            }
+        } else if (timeoutMs < 0) {
+            submit(
+                ioUringEnter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS));
+        } else {
+            struct __kernel_timespec timeout = {};
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+            struct io_uring_getevents_arg arg = {};
+            arg.ts = (uint64_t)&timeout;
+            submit((int)syscall(__NR_io_uring_enter, ringFd, toSubmit, 1,
+                                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                &arg, sizeof(arg)));
+        }
+        reap();
+        timers.advance(monotonicMillis());
+    }
+
+    // Any thread: makes the current or next park return
+    void unpark() {
+        if (notifyFd != -1) {
+            uint64_t one = 1;
+            ssize_t written = write(notifyFd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    TimerWheel *getTimers() { return &timers; }
+
+    void close() {
+        if (notifyFd != -1) {
+            ::close(notifyFd);
+            notifyFd = -1;
+        }
+        if (ringFd == -1) {
+            return;
+        }
+        // Closing the ring cancels everything that's in flight
+        ::close(ringFd);
+        ringFd = -1;
+
+        unmap(sqes, sqesSize);
+        if (cqRing != sqRing) {
+            unmap(cqRing, cqRingSize);
+        }
+        unmap(sqRing, sqRingSize);
+        unmap(bufRing, BUFFER_COUNT * sizeof(struct io_uring_buf));
+        unmap(buffers, (size_t)BUFFER_COUNT * BUFFER_LENGTH);
+        sqes = nullptr;
+        cqRing = nullptr;
+        sqRing = nullptr;
+        bufRing = nullptr;
+        buffers = nullptr;
+    }
+
+   private:
+    void *mmapRing(size_t size, off_t offset) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringFd, offset);
+    }
+
+    static void unmap(void *ptr, size_t size) {
+        if (ptr != nullptr && ptr != MAP_FAILED) {
+            munmap(ptr, size);
+        }
+    }
+
+    bool setupBuffers() {
+        void *ring = mmap(NULL, BUFFER_COUNT * sizeof(struct io_uring_buf),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+        void *memory =
+            mmap(NULL, (size_t)BUFFER_COUNT * BUFFER_LENGTH,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bufRing =
+            ring == MAP_FAILED ? nullptr : (struct io_uring_buf_ring *)ring;
+        buffers = memory == MAP_FAILED ? nullptr : (char *)memory;
+        if (bufRing == nullptr || buffers == nullptr) {
+            close();
+            return false;
+        }
+
+        struct io_uring_buf_reg reg = {};
+        reg.ring_addr = (uint64_t)bufRing;
+        reg.ring_entries = BUFFER_COUNT;
+        reg.bgid = BUFFER_GROUP;
+        if (ioUringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            close();
+            return false;
+        }
+
+        bufRingTail = 0;
+        for (unsigned i = 0; i < BUFFER_COUNT; i++) {
+            recycleBuffer((uint16_t)i);
+        }
+        return true;
+    }
+
+    // Takes the result of io_uring_enter
+    void submit(int submitted) {
+        if (submitted > 0) {
+            toSubmit -= min((unsigned)submitted, toSubmit);
+        }
+    }
+
+    // Submits the queued ops early if the submission queue is full
+    struct io_uring_sqe *nextSqe(UringOp *op) {
+        if (ringFd == -1) {
+            return nullptr;
+        }
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head >= sqEntries) {
+            int submitted = ioUringEnter(ringFd, toSubmit, 0, 0);
+            if (submitted <= 0) {
+                return nullptr;
+            }
+            submit(submitted);
+        }
+
+        unsigned index = sqLocalTail & sqMask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->user_data = (uint64_t)op;
+        sqArray[index] = index;
+
+        sqLocalTail++;
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        toSubmit++;
+
+        op->inFlight = true;
+        op->done = false;
+        op->orphaned = false;
+        return sqe;
+    }
+
+    void reap() {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &cqes[head & cqMask];
+            complete((UringOp *)cqe->user_data, cqe->res, cqe->flags);
+            head++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    void complete(UringOp *op, int32_t result, uint32_t flags) {
+        op->inFlight = false;
+        if (op->orphaned) {
+            if (flags & IORING_CQE_F_BUFFER) {
+                recycleBuffer((uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            op->orphaned = false;
+            wake(&idleWaker);
+            return;
+        }
+
+        op->done = true;
+        op->result = result;
+        op->flags = flags;
+        wake(&op->waker);
+    }
+
+    static void wake(Waker *waker) {
+        Waker woken = *waker;
+        *waker = Waker();
+        woken.wake();
+    }
+
+    int ringFd = -1;
+    unsigned toSubmit = 0;
+
+    void *sqRing = nullptr;
+    size_t sqRingSize = 0;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqLocalTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqesSize = 0;
+
+    void *cqRing = nullptr;
+    size_t cqRingSize = 0;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *bufRing = nullptr;
+    uint16_t bufRingTail = 0;
+    char *buffers = nullptr;
+
+    Waker idleWaker;
+    TimerWheel timers;
+
+    int notifyFd = -1;
+    UringOp notifyOp;
+    uint64_t notifyCount = 0;
+};
+
+// Reader
+class UringReaderImpl {
+   public:
+    explicit UringReaderImpl(UringReactor *reactor, UringSocket *socket)
+        : reactor(reactor), socket(socket) {}
+
+    Optional<size_t> readIntoBuffer(Context *cx, char *buffer,
+                                    size_t bufferLength) {
+        if (shutdown) {
+            return Optional<size_t>::empty();
+        }
+        if (bufferLength <= 0) {
+            return Optional<size_t>::of(0);
+        }
+
+        UringOp *op = &socket->recvOp;
+        if (!socket->hasBuffer) {
+            if (op->inFlight) {
+                op->waker = cx->getWaker();
+                return Optional<size_t>::of(0);
+            }
+            if (op->done) {
+                op->done = false;
+                if (op->result > 0) {
+                    socket->hasBuffer = true;
+                    socket->bufferId =
+                        (uint16_t)(op->flags >> IORING_CQE_BUFFER_SHIFT);
+                    socket->bufferOffset = 0;
+                    socket->bufferLength = (size_t)op->result;
+                } else if (!isRetryable(op->result)) {
+                    // Closed(0) or an error
+                    shutdown = true;
+                    return Optional<size_t>::empty();
+                }
+            }
+            if (!socket->hasBuffer) {
+                if (!reactor->submitRecv(socket->fd, op)) {
+                    shutdown = true;
+                    return Optional<size_t>::empty();
+                }
+                op->waker = cx->getWaker();
+                return Optional<size_t>::of(0);
+            }
+        }
+
+        size_t read =
+            min(bufferLength, socket->bufferLength - socket->bufferOffset);
+        char *data = reactor->getBuffer(socket->bufferId);
+        memcpy(buffer, data + socket->bufferOffset, read);
+        socket->bufferOffset += read;
+        if (socket->bufferOffset == socket->bufferLength) {
+            socket->hasBuffer = false;
+            reactor->recycleBuffer(socket->bufferId);
+        }
+        return Optional<size_t>::of(read);
+    }
+
+    bool isShutdown() { return shutdown; }
+
+   private:
+    bool shutdown = false;
+    UringReactor *reactor;
+    UringSocket *socket;
+};
+
+// Requests are read in chunks of this size
+static constexpr const size_t READ_BUFFER_LENGTH = 4096;
+
+// The buffers are lent by the BufferPool of the server
+typedef BufferedReader<UringReaderImpl, READ_BUFFER_LENGTH,
+                       PooledBuffer<READ_BUFFER_LENGTH>>
+    UringReader;
+
+UringReader readFromUringSocket(UringReactor *reactor, UringSocket *socket,
+                                BufferPool *pool) {
+    return UringReader(UringReaderImpl(reactor, socket),
+                       PooledBuffer<READ_BUFFER_LENGTH>(pool));
+}
+
+class UringWriterImpl {
+   public:
+    explicit UringWriterImpl(UringReactor *reactor, UringSocket *socket)
+        : reactor(reactor), socket(socket) {}
+
+    // The send points into buffer while it's in flight. The callers call
+    // again with the same buffer until it returned a length.
+    Optional<size_t> writeFromBuffer(Context *cx, const char *buffer,
+                                     size_t bufferLength) {
+        if (shutdown) {
+            return Optional<size_t>::empty();
+        }
+        if (bufferLength <= 0) {
+            return Optional<size_t>::of(0);
+        }
+
+        UringOp *op = &socket->sendOp;
+        if (op->inFlight) {
+            op->waker = cx->getWaker();
+            return Optional<size_t>::of(0);
+        }
+        if (op->done) {
+            op->done = false;
+            if (op->result > 0) {
+                return Optional<size_t>::of(
+                    min((size_t)op->result, bufferLength));
+            }
+            if (!isRetryable(op->result)) {
+                shutdown = true;
+                return Optional<size_t>::empty();
+            }
+        }
+
+        if (!reactor->submitSend(socket->fd, buffer, bufferLength, op)) {
+            shutdown = true;
+            return Optional<size_t>::empty();
+        }
+        op->waker = cx->getWaker();
+        return Optional<size_t>::of(0);
+    }
+
+   private:
+    bool shutdown = false;
+    UringReactor *reactor;
+    UringSocket *socket;
+};
+
+// Responses are collected in a buffer of up to this size before being sent
+static constexpr const size_t WRITE_BUFFER_LENGTH = 4096;
+
+typedef BufferedWriter<UringWriterImpl, WRITE_BUFFER_LENGTH,
+                       PooledBuffer<WRITE_BUFFER_LENGTH>>
+    UringWriter;
+
+UringWriter writeToUringSocket(UringReactor *reactor, UringSocket *socket,
+                               BufferPool *pool) {
+    return UringWriter(UringWriterImpl(reactor, socket),
+                       PooledBuffer<WRITE_BUFFER_LENGTH>(pool));
+}
+
+// Most responses fit into a small buffer, the reads take the large ones
+static constexpr const size_t SMALL_BUFFER_LENGTH = 1024;
+
+// Client/Server
+class UringClient {
+   public:
+    typedef UringReader Reader;
+    typedef UringWriter Writer;
+
+    explicit UringClient() : UringClient(nullptr, nullptr, nullptr) {}
+    // The buffers are only lent by the pool while they hold bytes
+    UringClient(UringReactor *reactor, UringSocket *socket, BufferPool *pool)
+        : reactor(reactor),
+          socket(socket),
+          writer(writeToUringSocket(reactor, socket, pool)),
+          reader(readFromUringSocket(reactor, socket, pool)) {}
+
+    Optional<UringWriter *> getWriter() {
+        if (isClosed()) {
+            return Optional<UringWriter *>::empty();
+        }
+        return Optional<UringWriter *>::of(&writer);
+    }
+    Optional<UringReader *> getReader() {
+        if (isClosed()) {
+            return Optional<UringReader *>::empty();
+        }
+        return Optional<UringReader *>::of(&reader);
+    }
+
+    void close() {
+        int fd = takeSocket();
+        if (fd == -1) {
+            return;
+        }
+
+        // The shutdown completes the receive that's still in flight
+        shutdown(fd, SHUT_RDWR);
+        ::close(fd);
+    }
+
+    // Closes the client but hands its socket over instead of closing it. A
+    // receive that's still in flight completes once the socket is shut down.
+    // Returns -1 if it has none.
+    int takeSocket() {
+        if (closed) {
+            return -1;
+        }
+
+        closed = true;
+        // The write buffer is kept until the send that may still point into
+        // it completed, see releaseWriteBuffer
+        reader.dropBuffered();
+
+        if (socket == nullptr || socket->fd == -1) {
+            return -1;
+        }
+
+        int fd = socket->fd;
+        socket->fd = -1;
+
+        if (socket->hasBuffer) {
+            socket->hasBuffer = false;
+            reactor->recycleBuffer(socket->bufferId);
+        }
+        orphan(&socket->recvOp);
+        orphan(&socket->sendOp);
+        return fd;
+    }
+    bool isClosed() { return closed || socket == nullptr || socket->fd == -1; }
+
+    // Once the client is closed and its ops completed
+    void releaseWriteBuffer() { writer.dropBuffered(); }
+
+   private:
+    static void orphan(UringOp *op) {
+        op->orphaned = op->inFlight;
+        op->done = false;
+        op->waker = Waker();
+    }
+
+    bool closed = false;
+    UringReactor *reactor;
+    UringSocket *socket;
+    UringWriter writer;
+    UringReader reader;
+};
+
+// The server can't be copied or moved because the clients and the submitted
+// ops point into it. It's big, so construct it where it stays.
+//
+// Only MAX_BUSY clients at a time get I/O buffers, idle keep-alive clients
+// hold none. A client that finds no read buffer waits until another client
+// gives one back, one without a write buffer sends from the bytes it was given
+// directly.
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
+class UringServer {
+   public:
+    typedef UringClient Client;
+
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    // The listen socket must be listening.
+    explicit UringServer(int listenFd) : listenFd(listenFd) {
+        if (listenFd != -1 && !reactor.setup()) {
+            close();
+        }
+    }
+
+    UringServer(const UringServer &other) = delete;
+    UringServer &operator=(const UringServer &other) = delete;
+
+    class AcceptFuture
+        : Future<AcceptFuture, Optional<Tuple<SlabHandle, UringClient *>>> {
+       private:
+        typedef Optional<Tuple<SlabHandle, UringClient *>> Return;
+
+       public:
+        AcceptFuture(UringServer *server) : server(server) {}
+
+        Poll<Return> poll(Context *cx) {
+            if (server->isClosed()) {
+                READY(Return::empty())
+            }
+
+            if (server->clients.isFull()) {
+                server->releaseDrained();
+            }
+            if (server->clients.isFull()) {
+                if (server->drainingLength > 0) {
+                    // A slot is free once the kernel is done with it
+                    server->reactor.setIdleWaker(cx->getWaker());
+                    return Poll<Return>::pending();
+                }
+                READY(Return::empty())
+            }
+
+            UringOp *op = &server->acceptOp;
+            if (op->inFlight) {
+                op->waker = cx->getWaker();
+                return Poll<Return>::pending();
+            }
+            if (op->done && op->result >= 0) {
+                op->done = false;
+
+                SlabHandle clientId = server->clients.allocate().get();
+                UringSocket *socket = &server->sockets[clientId.index];
+                *socket = UringSocket();
+                socket->fd = op->result;
+
+                UringClient *uringClient = &server->clientSlots[clientId.index];
+                *uringClient = UringClient(&server->reactor, socket,
+                                           &server->bufferPool);
+
+                READY(Return::of(
+                    Tuple<SlabHandle, UringClient *>(clientId, uringClient)))
+            }
+
+            // Either nothing was accepted yet or accepting failed, e.g. because
+            // of too many open files
+            if (!server->reactor.submitAccept(server->listenFd, op)) {
+                server->close();
+                READY(Return::empty())
+            }
+            op->waker = cx->getWaker();
+            return Poll<Return>::pending();
+        }
+
+       private:
+        UringServer *server;
+    };
+
+    AcceptFuture accept() { return AcceptFuture(this); }
+
+    // Accepts a waiting client only to send it response and close it, for
+    // when the slab is full. Returns false once no client is waiting, cx is
+    // woken when the next one arrives. Shares the accept op with
+    // AcceptFuture, a client accepted after a slot was freed is kept.
+    bool rejectClient(Context *cx, const char *response, size_t length) {
+        if (isClosed()) {
+            return false;
+        }
+        UringOp *op = &acceptOp;
+        if (op->inFlight) {
+            op->waker = cx->getWaker();
+            return false;
+        }
+        if (op->done) {
+            op->done = false;
+            if (op->result >= 0) {
+                // Rare enough to not go through the ring. Best effort, the
+                // socket buffer of a new connection takes it. The request
+                // usually arrives later, so the socket lingers to read it.
+                rejected.add(reactor.getTimers(), op->result, response,
+                             length);
+            }
+            return true;
+        }
+
+        if (!reactor.submitAccept(listenFd, op)) {
+            return false;
+        }
+        op->waker = cx->getWaker();
+        return false;
+    }
+
+    // Stale ids of clients that were already freed are ignored
+    void freeClient(SlabHandle clientId) {
+        if (!clients.retire(clientId)) {
+            return;
+        }
+        clientSlots[clientId.index].close();
+        releaseSlot(clientId.index);
+    }
+
+    void lingerClient(SlabHandle clientId) {
+        if (!clients.retire(clientId)) {
+            return;
+        }
+        int fd = clientSlots[clientId.index].takeSocket();
+        if (fd != -1) {
+            rejected.add(reactor.getTimers(), fd, nullptr, 0);
+        }
+        releaseSlot(clientId.index);
+    }
+
+    void close() {
+        if (closed) {
+            return;
+        }
+        closed = true;
+
+        // Close clients
+        for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+            if (clients.isInUse(i)) {
+                clientSlots[i].close();
+            }
+        }
+
+        rejected.closeAll();
+        // The cache of this thread would keep buffers of a closed server
+        bufferPool.flushThreadCache();
+
+        // Close server
+        if (listenFd != -1) {
+            ::close(listenFd);
+            listenFd = -1;
+        }
+        reactor.close();
+    }
+    bool isClosed() { return closed || listenFd == -1; }
+
+    UringReactor *getReactor() { return &reactor; }
+
+    // Futures of this server must be run with the reactor as park
+    typedef UringReactor Park;
+    Park *getPark() { return &reactor; }
+
+    TimerWheel *getTimers() { return reactor.getTimers(); }
+
+   private:
+    // The slot can only be reused once the kernel is done with it
+    void releaseSlot(uint32_t index) {
+        if (sockets[index].isIdle()) {
+            clientSlots[index].releaseWriteBuffer();
+            clients.release(index);
+        } else {
+            draining[drainingLength++] = index;
+        }
+    }
+
+    // Releases the slots of the freed clients whose ops completed
+    void releaseDrained() {
+        size_t kept = 0;
+        for (size_t i = 0; i < drainingLength; i++) {
+            uint32_t index = draining[i];
+            if (sockets[index].isIdle()) {
+                clientSlots[index].releaseWriteBuffer();
+                clients.release(index);
+            } else {
+                draining[kept++] = index;
+            }
+        }
+        drainingLength = kept;
+    }
+
+    bool closed = false;
+    int listenFd;
+    UringOp acceptOp;
+    UringReactor reactor;
+    LingeringSockets<> rejected;
+    Slab<MAX_CONNECTIONS> clients;
+    UringSocket sockets[MAX_CONNECTIONS];
+    // Outlives the clients that give their buffers back
+    SizedBufferPool<SMALL_BUFFER_LENGTH, MAX_BUSY, READ_BUFFER_LENGTH, MAX_BUSY>
+        bufferPool;
+    UringClient clientSlots[MAX_CONNECTIONS];
+    // Freed clients with ops still in flight
+    uint32_t draining[MAX_CONNECTIONS];
+    size_t drainingLength = 0;
+};
+
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
+class SimpleUringServer {
+   public:
+    // With reusePort several servers can listen on the same port, the kernel
+    // spreads the connections over them
+    SimpleUringServer(int port, bool reusePort = false)
+        : server(listenOn(port, reusePort)) {}
+
+    // Neither copied nor moved, it's big and the clients point into it
+    SimpleUringServer(const SimpleUringServer &other) = delete;
+    SimpleUringServer &operator=(const SimpleUringServer &other) = delete;
+
+    ~SimpleUringServer() { server.close(); }
+
+    typedef typename UringServer<MAX_CONNECTIONS, MAX_BUSY>::Client Client;
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    typedef typename UringServer<MAX_CONNECTIONS, MAX_BUSY>::AcceptFuture
+        AcceptFuture;
+
+    inline AcceptFuture accept() { return server.accept(); }
+
+    inline bool rejectClient(Context *cx, const char *response,
+                             size_t length) {
+        return server.rejectClient(cx, response, length);
+    }
+
+    inline void freeClient(SlabHandle clientId) {
+        server.freeClient(clientId);
+    }
+
+    inline void lingerClient(SlabHandle clientId) {
+        server.lingerClient(clientId);
+    }
+
+    inline void close() { server.close(); }
+    inline bool isClosed() { return server.isClosed(); }
+
+    inline UringReactor *getReactor() { return server.getReactor(); }
+
+    typedef typename UringServer<MAX_CONNECTIONS, MAX_BUSY>::Park Park;
+    inline Park *getPark() { return server.getPark(); }
+
+    inline TimerWheel *getTimers() { return server.getTimers(); }
+
+   private:
+    // Returns the listening socket, -1 if it couldn't be set up
+    static int listenOn(int port, bool reusePort) {
+        // Create the socket
+        int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd == -1) {
+            return -1;
+        }
+
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (reusePort) {
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                       sizeof(reuse));
+        }
+
+        // Bind that socket
+        struct sockaddr_in address = {};
+        // IPV4
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+
+        int iResult =
+            bind(listenFd, (struct sockaddr *)&address, sizeof(address));
+        if (iResult != 0) {
+            ::close(listenFd);
+            return -1;
+        }
+
+        iResult = listen(listenFd, SOMAXCONN);
+        if (iResult != 0) {
+            ::close(listenFd);
+            return -1;
+        }
+
+        return listenFd;
+    }
+
+    UringServer<MAX_CONNECTIONS, MAX_BUSY> server;
+};
+
+}  // namespace integration_uring
+
+#endif
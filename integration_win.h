@@ -18,10 +18,14 @@
 
 // Lib
 #include "buffer.h"
+#include "buffer_pool.h"
 #include "future.h"
 #include "http.h"
 #include "http_handler.h"
+#include "linger.h"
 #include "reader.h"
+#include "slab.h"
+#include "timer.h"
 #include "utils.h"
 #include "writer.h"
 
@@ -32,7 +36,8 @@ class WinReaderImpl {
    public:
     WinReaderImpl(SOCKET clientSocket) : clientSocket(clientSocket) {}
 
-    Optional<size_t> readIntoBuffer(char *buffer, size_t bufferLength) {
+    Optional<size_t> readIntoBuffer(Context *cx, char *buffer,
+                                    size_t bufferLength) {
         if (shutdown) {
             return Optional<size_t>::empty();
         }
@@ -45,6 +50,8 @@ class WinReaderImpl {
         if (read == SOCKET_ERROR) {
             int err = WSAGetLastError();
             if (err == WSAEWOULDBLOCK) {
+                // There's no reactor for winsock yet, poll again
+                cx->getWaker().wake();
                 return Optional<size_t>::of(0);
             } else {
                 shutdown = true;
@@ -67,17 +74,25 @@ class WinReaderImpl {
     SOCKET clientSocket;
 };
 
-typedef SimpleReader<WinReaderImpl> WinReader;
+// Requests are read in chunks of this size
+static constexpr const size_t READ_BUFFER_LENGTH = 4096;
 
-WinReader readFromWinSocket(SOCKET clientSocket) {
-    return WinReader(WinReaderImpl(clientSocket));
+// The buffers are lent by the BufferPool of the server
+typedef BufferedReader<WinReaderImpl, READ_BUFFER_LENGTH,
+                       PooledBuffer<READ_BUFFER_LENGTH>>
+    WinReader;
+
+WinReader readFromWinSocket(SOCKET clientSocket, BufferPool *pool) {
+    return WinReader(WinReaderImpl(clientSocket),
+                     PooledBuffer<READ_BUFFER_LENGTH>(pool));
 }
 
 class WinWriterImpl {
    public:
     WinWriterImpl(SOCKET clientSocket) : clientSocket(clientSocket) {}
 
-    Optional<size_t> writeFromBuffer(const char *buffer, size_t bufferLength) {
+    Optional<size_t> writeFromBuffer(Context *cx, const char *buffer,
+                                     size_t bufferLength) {
         if (shutdown) {
             return Optional<size_t>::empty();
         }
@@ -87,6 +102,7 @@ class WinWriterImpl {
         if (written == SOCKET_ERROR) {
             int err = WSAGetLastError();
             if (err == WSAEWOULDBLOCK) {
+                cx->getWaker().wake();
                 return Optional<size_t>::of(0);
             } else {
                 shutdown = true;
@@ -107,53 +123,74 @@ class WinWriterImpl {
     SOCKET clientSocket;
 };
 
-typedef SimpleWriter<WinWriterImpl> WinWriter;
+// Responses are collected in a buffer of up to this size before being sent
+static constexpr const size_t WRITE_BUFFER_LENGTH = 4096;
+
+typedef BufferedWriter<WinWriterImpl, WRITE_BUFFER_LENGTH,
+                       PooledBuffer<WRITE_BUFFER_LENGTH>>
+    WinWriter;
 
-WinWriter writeToWinSocket(SOCKET clientSocket) {
-    return WinWriter(WinWriterImpl(clientSocket));
+WinWriter writeToWinSocket(SOCKET clientSocket, BufferPool *pool) {
+    return WinWriter(WinWriterImpl(clientSocket),
+                     PooledBuffer<WRITE_BUFFER_LENGTH>(pool));
 }
 
+// Most responses fit into a small buffer, the reads take the large ones
+static constexpr const size_t SMALL_BUFFER_LENGTH = 1024;
+
 // Client/Server
 class WinClient {
    public:
-    explicit WinClient() : WinClient(INVALID_SOCKET) {}
-    // The socket must be configurated to be non blocking
-    WinClient(SOCKET clientSocket)
+    typedef WinReader Reader;
+    typedef WinWriter Writer;
+
+    explicit WinClient() : WinClient(INVALID_SOCKET, nullptr) {}
+    // The socket must be configurated to be non blocking. The buffers are
+    // only lent by the pool while they hold bytes.
+    WinClient(SOCKET clientSocket, BufferPool *pool)
         : clientSocket(clientSocket),
-          writer(writeToWinSocket(clientSocket)),
-          reader(readFromWinSocket(clientSocket)) {}
+          writer(writeToWinSocket(clientSocket, pool)),
+          reader(readFromWinSocket(clientSocket, pool)) {}
 
-    Optional<Writer *> getWriter() {
+    Optional<WinWriter *> getWriter() {
         if (isClosed()) {
-            return Optional<Writer *>::empty();
+            return Optional<WinWriter *>::empty();
         }
-        return Optional<Writer *>::of(&writer);
+        return Optional<WinWriter *>::of(&writer);
     }
-    Optional<Reader *> getReader() {
+    Optional<WinReader *> getReader() {
         if (isClosed()) {
-            return Optional<Reader *>::of(&reader);
+            return Optional<WinReader *>::of(&reader);
         }
-        return Optional<Reader *>::of(&reader);
+        return Optional<WinReader *>::of(&reader);
     }
 
     void close() {
-        if (closed) {
+        SOCKET socket = takeSocket();
+        if (socket == INVALID_SOCKET) {
             return;
         }
 
-        closed = true;
-
-        if (clientSocket == INVALID_SOCKET) {
+        int iResult = shutdown(socket, SD_SEND);
+        if (iResult == SOCKET_ERROR) {
+            closesocket(socket);
             return;
         }
 
-        int iResult = shutdown(clientSocket, SD_SEND);
-        if (iResult == SOCKET_ERROR) {
-            closesocket(clientSocket);
-            return;
+        closesocket(socket);
+    }
+
+    // Closes the client but hands its socket over instead of closing it.
+    // Returns INVALID_SOCKET if it has none.
+    SOCKET takeSocket() {
+        if (closed) {
+            return INVALID_SOCKET;
         }
 
-        closesocket(clientSocket);
+        closed = true;
+        writer.dropBuffered();
+        reader.dropBuffered();
+        return clientSocket;
     }
     bool isClosed() { return closed || clientSocket == INVALID_SOCKET; }
 
@@ -171,59 +208,53 @@ class SimpleWinClient {
 SOCKET
 acceptSock(SOCKET listenSocket) { return accept(listenSocket, NULL, NULL); };
 
-template <size_t MAX_CONNECTIONS>
+// The server can't be copied or moved because the clients point into it. It's
+// big, so construct it where it stays.
+//
+// Only MAX_BUSY clients at a time get I/O buffers, idle keep-alive clients
+// hold none. A client that finds no read buffer waits until another client
+// gives one back, one without a write buffer writes to its socket directly.
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
 class WinServer {
    private:
    public:
     typedef WinClient Client;
 
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    // The listen socket must be non blocking and listening.
     explicit WinServer(SOCKET listenSocket) : listenSocket(listenSocket) {}
 
-    class AcceptFuture : Future<AcceptFuture, Optional<WinClient>> {
+    WinServer(const WinServer &other) = delete;
+    WinServer &operator=(const WinServer &other) = delete;
+
+    class AcceptFuture
+        : Future<AcceptFuture, Optional<Tuple<SlabHandle, WinClient *>>> {
        private:
-        typedef Optional<Tuple<size_t, WinClient *>> Return;
+        typedef Optional<Tuple<SlabHandle, WinClient *>> Return;
 
        public:
         AcceptFuture(WinServer *server) : server(server) {}
 
-        Poll<Return> poll() {
-            size_t clientId = MAX_CONNECTIONS;
-            for (int i = 0; i < MAX_CONNECTIONS; i++) {
-                if (!server->clientsInUse.get(i)) {
-                    clientId = i;
-                    break;
-                }
-            }
-            if (clientId == MAX_CONNECTIONS) {
+        Poll<Return> poll(Context *cx) {
+            if (server->clients.isFull()) {
                 READY(Return::empty())
             }
 
-            // Look if there's a new connection
-            int iResult = listen(server->listenSocket, SOMAXCONN);
-            if (iResult == SOCKET_ERROR) {
-                server->close();
-                READY(Return::empty())
-            }
-
-            // Accept new connection
+            // Accepted sockets inherit non blocking mode from the listen
+            // socket, so accepting a client is a single call
             SOCKET clientSocket = acceptSock(server->listenSocket);
             if (clientSocket == INVALID_SOCKET) {
+                cx->getWaker().wake();
                 return Poll<Return>::pending();
             }
 
-            // Set socket to non blocking
-            u_long iMode = 1;
-            iResult = ioctlsocket(clientSocket, FIONBIO, &iMode);
-            if (iResult == SOCKET_ERROR) {
-                closesocket(clientSocket);
-                return Poll<Return>::pending();
-            }
+            SlabHandle clientId = server->clients.allocate().get();
+            WinClient *winClient = &server->clientSlots[clientId.index];
+            *winClient = WinClient(clientSocket, &server->bufferPool);
 
-            server->clientsInUse.set(clientId, true);
-            WinClient *winClient = &server->clients[clientId];
-            *winClient = WinClient(clientSocket);
-
-            READY(Return::of(Tuple<size_t, WinClient *>(clientId, winClient)))
+            READY(Return::of(
+                Tuple<SlabHandle, WinClient *>(clientId, winClient)))
         }
 
        private:
@@ -232,13 +263,41 @@ class WinServer {
 
     AcceptFuture accept() { return AcceptFuture(this); }
 
-    void freeClient(size_t clientId) {
-        if (!clientsInUse.get(clientId)) {
+    // Accepts a waiting client only to send it response and close it, for
+    // when the slab is full. Returns false once no client is waiting.
+    bool rejectClient(Context *cx, const char *response, size_t length) {
+        if (closed) {
+            return false;
+        }
+        SOCKET clientSocket = acceptSock(listenSocket);
+        if (clientSocket == INVALID_SOCKET) {
+            // There's no reactor, look again with the next poll
+            cx->getWaker().wake();
+            return false;
+        }
+
+        // Best effort, the socket buffer of a new connection takes it. The
+        // request usually arrives later, so the socket lingers to read it.
+        rejected.add(&park.timers, clientSocket, response, length);
+        return true;
+    }
+
+    // Stale ids of clients that were already freed are ignored
+    void freeClient(SlabHandle clientId) {
+        if (!clients.free(clientId)) {
+            return;
+        }
+        clientSlots[clientId.index].close();
+    }
+
+    void lingerClient(SlabHandle clientId) {
+        if (!clients.free(clientId)) {
             return;
         }
-        clientsInUse.set(clientId, false);
-        WinClient *client = &clients[clientId];
-        client->close();
+        SOCKET clientSocket = clientSlots[clientId.index].takeSocket();
+        if (clientSocket != INVALID_SOCKET) {
+            rejected.add(&park.timers, clientSocket, nullptr, 0);
+        }
     }
 
     void close() {
@@ -248,31 +307,87 @@ class WinServer {
         closed = true;
 
         // Close clients
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            clients[i].close();
+        for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+            clientSlots[i].close();
         }
+        rejected.closeAll();
+        // The cache of this thread would keep buffers of a closed server
+        bufferPool.flushThreadCache();
 
         // Close server
         closesocket(listenSocket);
     }
     bool isClosed() { return closed; }
 
+    // There's no reactor for winsock yet so waiting futures poll again
+    typedef SpinTimerPark Park;
+    Park *getPark() { return &park; }
+
+    TimerWheel *getTimers() { return &park.timers; }
+
    private:
     bool closed = false;
+    SpinTimerPark park;
+    LingeringSockets<> rejected;
     SOCKET listenSocket;
-    BitSet<MAX_CONNECTIONS> clientsInUse = BitSet<MAX_CONNECTIONS>();
-    WinClient clients[MAX_CONNECTIONS];
+    Slab<MAX_CONNECTIONS> clients;
+    // Outlives the clients that give their buffers back
+    SizedBufferPool<SMALL_BUFFER_LENGTH, MAX_BUSY, READ_BUFFER_LENGTH, MAX_BUSY>
+        bufferPool;
+    WinClient clientSlots[MAX_CONNECTIONS];
 };
 
-template <size_t MAX_CONNECTIONS>
+template <size_t MAX_CONNECTIONS, size_t MAX_BUSY = MAX_CONNECTIONS>
 class SimpleWinServer {
    public:
     SimpleWinServer(int port)
-        : server(WinServer<MAX_CONNECTIONS>(INVALID_SOCKET)) {
+        : server(listenOn(port)) {}
+
+    // Neither copied nor moved, it's big and the clients point into it
+    SimpleWinServer(const SimpleWinServer &other) = delete;
+    SimpleWinServer &operator=(const SimpleWinServer &other) = delete;
+
+    ~SimpleWinServer() {
+        server.close();
+        WSACleanup();
+    }
+
+    typedef typename WinServer<MAX_CONNECTIONS, MAX_BUSY>::Client Client;
+    static constexpr const size_t MAX_CLIENTS = MAX_CONNECTIONS;
+
+    typedef typename WinServer<MAX_CONNECTIONS, MAX_BUSY>::AcceptFuture
+        AcceptFuture;
+
+    inline AcceptFuture accept() { return server.accept(); }
+
+    inline bool rejectClient(Context *cx, const char *response,
+                             size_t length) {
+        return server.rejectClient(cx, response, length);
+    }
+
+    inline void freeClient(SlabHandle clientId) {
+        server.freeClient(clientId);
+    }
+
+    inline void lingerClient(SlabHandle clientId) {
+        server.lingerClient(clientId);
+    }
+
+    inline void close() { server.close(); }
+    inline bool isClosed() { return server.isClosed(); }
+
+    typedef typename WinServer<MAX_CONNECTIONS, MAX_BUSY>::Park Park;
+    inline Park *getPark() { return server.getPark(); }
+
+    inline TimerWheel *getTimers() { return server.getTimers(); }
+
+   private:
+    // Returns the listening socket, INVALID_SOCKET if it couldn't be set up
+    static SOCKET listenOn(int port) {
         WSAData wsaData;
         int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
         if (iResult != 0) {
-            return;
+            return INVALID_SOCKET;
         }
 
         // convert port to string
@@ -280,7 +395,7 @@ class SimpleWinServer {
         Optional<SizedBuffer<PORT_BUF_LEN>> portBufOpt =
             writeDoubleToBuffer<10, PORT_BUF_LEN>(port);
         if (portBufOpt.isEmpty()) {
-            return;
+            return INVALID_SOCKET;
         }
         SizedBuffer<PORT_BUF_LEN> *portBuf = portBufOpt.getPtr();
         portBuf->data[PORT_BUF_LEN - 1] = '\0';
@@ -301,7 +416,7 @@ class SimpleWinServer {
         // Get address
         iResult = getaddrinfo(NULL, portStr, &hints, &result);
         if (iResult != 0) {
-            return;
+            return INVALID_SOCKET;
         }
 
         // Create the socket
@@ -310,7 +425,7 @@ class SimpleWinServer {
             socket(result->ai_family, result->ai_socktype, result->ai_protocol);
         if (listenSocket == INVALID_SOCKET) {
             freeaddrinfo(result);
-            return;
+            return INVALID_SOCKET;
         }
 
         // Bind that socket
@@ -318,52 +433,31 @@ class SimpleWinServer {
         if (iResult != 0) {
             freeaddrinfo(result);
             closesocket(listenSocket);
-            return;
+            return INVALID_SOCKET;
         }
 
         // Free address
         freeaddrinfo(result);
 
-        // Set listenSocket to non blocking
+        // Set listenSocket to non blocking, the accepted sockets inherit it
         u_long iMode = 1;
         iResult = ioctlsocket(listenSocket, FIONBIO, &iMode);
         if (iResult == SOCKET_ERROR) {
             closesocket(listenSocket);
-            return;
+            return INVALID_SOCKET;
         }
 
-        // create winserver with listenSocket
-        server = WinServer<MAX_CONNECTIONS>(listenSocket);
-    }
-
-    SimpleWinServer(const SimpleWinServer &other) = delete;
-    SimpleWinServer &operator=(const SimpleWinServer &other) = delete;
-
-    SimpleWinServer(SimpleWinServer &&other) : server(other.server) {
-        other.server = WinServer<MAX_CONNECTIONS>(INVALID_SOCKET);
-    };
-    SimpleWinServer &operator=(SimpleWinServer &&other) {
-        this->server = other.server;
-        other.server = WinServer<MAX_CONNECTIONS>(INVALID_SOCKET);
-        return *this;
-    }
+        // Listen once, accept picks up every connection afterwards
+        iResult = listen(listenSocket, SOMAXCONN);
+        if (iResult == SOCKET_ERROR) {
+            closesocket(listenSocket);
+            return INVALID_SOCKET;
+        }
 
-    ~SimpleWinServer() {
-        server.close();
-        WSACleanup();
+        return listenSocket;
     }
 
-    typedef typename WinServer<MAX_CONNECTIONS>::AcceptFuture AcceptFuture;
-
-    inline AcceptFuture accept() { return server.accept(); }
-
-    inline void freeClient(size_t clientId) { server.freeClient(clientId); }
-
-    inline void close() { server.close(); }
-    inline bool isClosed() { return server.isClosed(); }
-
-   private:
-    WinServer<MAX_CONNECTIONS> server;
+    WinServer<MAX_CONNECTIONS, MAX_BUSY> server;
 };
 
 }  // namespace integration_win
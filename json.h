@@ -17,25 +17,26 @@ const char *FALSE = "false";
 
 #include "deser.h"
 
-class ReadJsonNull : public ReadFuture<ReadJsonNull, bool> {
+template <typename R = Reader>
+class ReadJsonNull : public ReadFuture<ReadJsonNull<R>, bool> {
    public:
     // The buffer needs to be at LEAST 4 BYTES long!
-    explicit ReadJsonNull(Reader *reader, char *buffer)
+    explicit ReadJsonNull(R *reader, char *buffer)
         : init({reader, buffer}) {}
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 state = State::READ;
 
-                Reader *reader = init.reader;
+                R *reader = init.reader;
                 char *buffer = init.buffer;
-                readIntoWhile = ReadIntoWhile<bool (*)(char)>(reader, buffer, 4,
-                                                              isCharJsonNull);
+                readIntoWhile = ReadIntoWhile<bool (*)(char), R>(
+                    reader, buffer, 4, isCharJsonNull);
             }
                 // Fallthrough
             case State::READ: {
-                Poll<size_t> poll = readIntoWhile.poll();
+                Poll<size_t> poll = readIntoWhile.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -61,10 +62,10 @@ class ReadJsonNull : public ReadFuture<ReadJsonNull, bool> {
 
     union {
         struct {
-            Reader *reader;
+            R *reader;
             char *buffer;
         } init;
-        ReadIntoWhile<bool (*)(char)> readIntoWhile;
+        ReadIntoWhile<bool (*)(char), R> readIntoWhile;
     };
 
     static bool isCharJsonNull(char c) {
@@ -72,25 +73,26 @@ class ReadJsonNull : public ReadFuture<ReadJsonNull, bool> {
     }
 };
 
-class ReadJsonBoolean : public ReadFuture<ReadJsonBoolean, Optional<bool>> {
+template <typename R = Reader>
+class ReadJsonBoolean : public ReadFuture<ReadJsonBoolean<R>, Optional<bool>> {
    public:
     // The buffer needs to be at LEAST 5 BYTES long!
-    explicit ReadJsonBoolean(Reader *reader, char *buffer)
+    explicit ReadJsonBoolean(R *reader, char *buffer)
         : init({reader, buffer}) {}
 
-    Poll<Optional<bool>> poll() {
+    Poll<Optional<bool>> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 state = State::READ;
 
-                Reader *reader = init.reader;
+                R *reader = init.reader;
                 char *buffer = init.buffer;
-                readIntoWhile = ReadIntoWhile<bool (*)(char)>(
+                readIntoWhile = ReadIntoWhile<bool (*)(char), R>(
                     reader, buffer, 5, isCharJsonBoolean);
             }
                 // Fallthrough
             case State::READ: {
-                Poll<size_t> poll = readIntoWhile.poll();
+                Poll<size_t> poll = readIntoWhile.poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<bool>>::pending();
                 }
@@ -120,10 +122,10 @@ class ReadJsonBoolean : public ReadFuture<ReadJsonBoolean, Optional<bool>> {
 
     union {
         struct {
-            Reader *reader;
+            R *reader;
             char *buffer;
         } init;
-        ReadIntoWhile<bool (*)(char)> readIntoWhile;
+        ReadIntoWhile<bool (*)(char), R> readIntoWhile;
     };
 
     static bool isCharJsonBoolean(char c) {
@@ -133,14 +135,14 @@ class ReadJsonBoolean : public ReadFuture<ReadJsonBoolean, Optional<bool>> {
 };
 
 // F must overload: bool operator()(char);
-template <typename F>
-class ReadJsonString : public ReadFuture<ReadJsonString<F>, bool> {
+template <typename F, typename R = Reader>
+class ReadJsonString : public ReadFuture<ReadJsonString<F, R>, bool> {
    public:
-    ReadJsonString(Reader *reader, F f) : init({reader}), func(f) {}
+    ReadJsonString(R *reader, F f) : init({reader}), func(f) {}
 
     F *getFunc() { return &func; }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT:
                 state = State::START_QUOTE;
@@ -148,7 +150,7 @@ class ReadJsonString : public ReadFuture<ReadJsonString<F>, bool> {
                 readChar = ReadChar(init.reader);
                 // Fallthrough
             case State::START_QUOTE: {
-                Poll<Optional<char>> poll = readChar.poll();
+                Poll<Optional<char>> poll = readChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -165,26 +167,26 @@ class ReadJsonString : public ReadFuture<ReadJsonString<F>, bool> {
 
                 state = State::READ_STRING;
 
-                Reader *reader = readChar.getReader();
+                R *reader = readChar.getReader();
 
-                readWhileString = ReadWhile<ReadWhileString>(
+                readWhileString = ReadWhile<ReadWhileString, R>(
                     reader, ReadWhileString{false, &this->func});
             }
                 // Fallthrough
             case State::READ_STRING: {
-                Poll<void_> poll = readWhileString.poll();
+                Poll<void_> poll = readWhileString.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
 
                 state = State::END_QUOTE;
 
-                Reader *reader = readWhileString.getReader();
+                R *reader = readWhileString.getReader();
                 readChar = ReadChar(reader);
             }
                 // Fallthrough
             case State::END_QUOTE: {
-                Poll<Optional<char>> poll = readChar.poll();
+                Poll<Optional<char>> poll = readChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -238,18 +240,19 @@ class ReadJsonString : public ReadFuture<ReadJsonString<F>, bool> {
     F func;
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
-        ReadWhile<ReadWhileString> readWhileString;
-        ReadChar readChar;
+        ReadWhile<ReadWhileString, R> readWhileString;
+        ReadChar<R> readChar;
     };
 };
 
+template <typename R = Reader>
 class JsonDeserializer {
    public:
-    explicit JsonDeserializer(Reader *reader) : reader(reader) {}
+    explicit JsonDeserializer(R *reader) : reader(reader) {}
 
-    Reader *getReader() { return reader; }
+    R *getReader() { return reader; }
 
     template <typename NameStore, typename StructVisitor>
     class DeserializeStructFuture
@@ -267,10 +270,10 @@ class JsonDeserializer {
               nameStore(nameStore),
               visitor(visitor) {}
 
-        Poll<bool> poll() {
+        Poll<bool> poll(Context *cx) {
             switch (state) {
                 case State::INIT: {
-                    auto future = ReadWhile<bool (*)(char)>(
+                    auto future = ReadWhile<bool (*)(char), R>(
                         deserializer->reader, isCharWhitespace);
                     INIT_AWAIT(READ_WHITESPACES, readWhile, future, result)
                     // Result is of value void_
@@ -288,7 +291,7 @@ class JsonDeserializer {
                 }
                 initPeekWhitespaces : {
                     state = State::READ_BEFORE_PEEK_WHITESPACES;
-                    this->readWhile = ReadWhile<bool (*)(char)>(
+                    this->readWhile = ReadWhile<bool (*)(char), R>(
                         deserializer->reader, isCharWhitespace);
                 }
                 case State::READ_BEFORE_PEEK_WHITESPACES: {
@@ -319,25 +322,24 @@ class JsonDeserializer {
                 }
                 initNameWhitespaces : {
                     state = State::READ_NAME_WHITESPACES;
-                    this->readWhile = ReadWhile<bool (*)(char)>(
+                    this->readWhile = ReadWhile<bool (*)(char), R>(
                         deserializer->reader, isCharWhitespace);
                 }
                 case State::READ_NAME_WHITESPACES: {
                     AWAIT(readWhile, result)
                     // Result is void_
 
-                    INIT_AWAIT(READ_NAME, readName,
-                               ReadJsonString<ReadIntoNameStore>(
-                                   deserializer->reader,
-                                   ReadIntoNameStore{.nameStore = &nameStore}),
-                               result)
+                    auto future = ReadJsonString<ReadIntoNameStore, R>(
+                        deserializer->reader,
+                        ReadIntoNameStore{.nameStore = &nameStore});
+                    INIT_AWAIT(READ_NAME, readName, future, result)
                     if (!result) {
                         READY(false)
                     }
 
-                    INIT_AWAIT(READ_COLON_WHITESPACES, readWhile,
-                               ReadWhile<bool (*)(char)>(deserializer->reader,
-                                                         isCharWhitespace),
+                    auto future = ReadWhile<bool (*)(char), R>(
+                        deserializer->reader, isCharWhitespace);
+                    INIT_AWAIT(READ_COLON_WHITESPACES, readWhile, future,
                                result)
                     // Result is void_
 
@@ -351,7 +353,7 @@ class JsonDeserializer {
                         READY(false)
                     }
 
-                    auto future = ReadWhile<bool (*)(char)>(
+                    auto future = ReadWhile<bool (*)(char), R>(
                         deserializer->reader, isCharWhitespace);
                     INIT_AWAIT(READ_VISITOR_WHITESPACES, readWhile, future,
                                outputName)
@@ -406,10 +408,10 @@ class JsonDeserializer {
         NameStore nameStore;
         StructVisitor visitor;
         union {
-            Peek *peek;
-            ReadChar readChar;
-            ReadWhile<bool (*)(char)> readWhile;
-            ReadJsonString<ReadIntoNameStore> readName;
+            typename reader_ops<R>::Peek *peek;
+            ReadChar<R> readChar;
+            ReadWhile<bool (*)(char), R> readWhile;
+            ReadJsonString<ReadIntoNameStore, R> readName;
             typename StructVisitor::VisitFuture visitFuture;
         };
     };
@@ -422,20 +424,20 @@ class JsonDeserializer {
     }
 
    private:
-    Reader *reader;
+    R *reader;
 };
 
-template <typename T>
-class DeserializeJson : Future<DeserializeJson<T>, Optional<T>> {
+template <typename T, typename R = Reader>
+class DeserializeJson : Future<DeserializeJson<T, R>, Optional<T>> {
    public:
-    explicit DeserializeJson(Reader *reader)
-        : deserializer(JsonDeserializer(reader)) {}
+    explicit DeserializeJson(R *reader)
+        : deserializer(JsonDeserializer<R>(reader)) {}
 
-    Poll<Optional<T>> poll() {
+    Poll<Optional<T>> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 auto futureValue =
-                    deser::Deserialize<T, JsonDeserializer>::deserialize(
+                    deser::Deserialize<T, JsonDeserializer<R>>::deserialize(
                         &deserializer);
                 INIT_AWAIT(POLL, future, futureValue, result)
                 READY(result)
@@ -446,25 +448,25 @@ class DeserializeJson : Future<DeserializeJson<T>, Optional<T>> {
 
    private:
     enum class State { INIT, POLL } state = State::INIT;
-    JsonDeserializer deserializer;
+    JsonDeserializer<R> deserializer;
     union {
         void_ none;
-        typename deser::Deserialize<T, JsonDeserializer>::DeserializeFuture
+        typename deser::Deserialize<T, JsonDeserializer<R>>::DeserializeFuture
             future;
     };
 };
 
 #define IMPL_JSON_DESERIALIZE_NUMBER(number_)                                  \
-    template <>                                                                \
-    struct deser::Deserialize<number_, JsonDeserializer> {                     \
+    template <typename R>                                                      \
+    struct deser::Deserialize<number_, JsonDeserializer<R>> {                  \
         class DeserializeFuture                                                \
             : Future<DeserializeFuture, Optional<number_>> {                   \
            public:                                                             \
-            explicit DeserializeFuture(Reader *reader)                         \
-                : future(ReadNumber(reader)) {}                                \
+            explicit DeserializeFuture(R *reader)                              \
+                : future(ReadNumber<R>(reader)) {}                             \
                                                                                \
-            Poll<Optional<number_>> poll() {                                   \
-                auto poll = future.poll();                                     \
+            Poll<Optional<number_>> poll(Context *cx) {                        \
+                auto poll = future.poll(cx);                                   \
                 if (poll.isReady()) {                                          \
                     auto opt = poll.get();                                     \
                     if (opt.isEmpty()) {                                       \
@@ -478,10 +480,11 @@ class DeserializeJson : Future<DeserializeJson<T>, Optional<T>> {
             }                                                                  \
                                                                                \
            private:                                                            \
-            ReadNumber future;                                                 \
+            ReadNumber<R> future;                                              \
         };                                                                     \
                                                                                \
-        static DeserializeFuture deserialize(JsonDeserializer *deserializer) { \
+        static DeserializeFuture deserialize(                                  \
+            JsonDeserializer<R> *deserializer) {                               \
             return DeserializeFuture(deserializer->getReader());               \
         }                                                                      \
     };
@@ -492,14 +495,14 @@ IMPL_JSON_DESERIALIZE_NUMBER(long)
 IMPL_JSON_DESERIALIZE_NUMBER(float)
 IMPL_JSON_DESERIALIZE_NUMBER(double)
 
-template <>
-struct deser::Deserialize<bool, JsonDeserializer> {
+template <typename R>
+struct deser::Deserialize<bool, JsonDeserializer<R>> {
     class DeserializeFuture : Future<DeserializeFuture, Optional<bool>> {
        public:
-        DeserializeFuture(JsonDeserializer *deserializer)
+        DeserializeFuture(JsonDeserializer<R> *deserializer)
             : init({deserializer}) {}
 
-        Poll<Optional<bool>> poll() {
+        Poll<Optional<bool>> poll(Context *cx) {
             switch (state) {
                 case State::INIT: {
                     INIT_AWAIT(
@@ -517,31 +520,31 @@ struct deser::Deserialize<bool, JsonDeserializer> {
         char buffer[5];
         union {
             struct {
-                JsonDeserializer *deserializer;
+                JsonDeserializer<R> *deserializer;
             } init;
-            ReadJsonBoolean readBool;
+            ReadJsonBoolean<R> readBool;
         };
     };
 
-    static DeserializeFuture deserialize(JsonDeserializer *deserializer) {
+    static DeserializeFuture deserialize(JsonDeserializer<R> *deserializer) {
         return DeserializeFuture(deserializer);
     }
 };
 
-template <size_t Capacity>
-struct deser::Deserialize<SizedBuffer<Capacity>, JsonDeserializer> {
+template <size_t Capacity, typename R>
+struct deser::Deserialize<SizedBuffer<Capacity>, JsonDeserializer<R>> {
     class DeserializeFuture
         : Future<DeserializeFuture, Optional<SizedBuffer<Capacity>>> {
        public:
-        DeserializeFuture(JsonDeserializer *deserializer)
+        DeserializeFuture(JsonDeserializer<R> *deserializer)
             : init({deserializer}) {}
 
-        Poll<Optional<SizedBuffer<Capacity>>> poll() {
+        Poll<Optional<SizedBuffer<Capacity>>> poll(Context *cx) {
             switch (state) {
                 case State::INIT: {
-                    Reader *reader = init.deserializer->getReader();
+                    R *reader = init.deserializer->getReader();
 
-                    auto future = ReadJsonString<ReadIntoBuffer>(
+                    auto future = ReadJsonString<ReadIntoBuffer, R>(
                         reader, ReadIntoBuffer{});
                     INIT_AWAIT(POLL, readString, future, result)
 
@@ -563,13 +566,13 @@ struct deser::Deserialize<SizedBuffer<Capacity>, JsonDeserializer> {
         };
         union {
             struct {
-                JsonDeserializer *deserializer;
+                JsonDeserializer<R> *deserializer;
             } init;
-            ReadJsonString<ReadIntoBuffer> readString;
+            ReadJsonString<ReadIntoBuffer, R> readString;
         };
     };
 
-    static DeserializeFuture deserialize(JsonDeserializer *deserializer) {
+    static DeserializeFuture deserialize(JsonDeserializer<R> *deserializer) {
         return DeserializeFuture(deserializer);
     }
 };
@@ -577,15 +580,16 @@ struct deser::Deserialize<SizedBuffer<Capacity>, JsonDeserializer> {
 #include "ser.h"
 #include "writer.h"
 
-class WriteJsonBoolean : WriteFuture<WriteJsonBoolean, bool> {
+template <typename W = Writer>
+class WriteJsonBoolean : WriteFuture<WriteJsonBoolean<W>, bool> {
    public:
-    WriteJsonBoolean(Writer *writer, bool value)
+    WriteJsonBoolean(W *writer, bool value)
         : init({writer}), value(value) {}
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
-                Writer *writer = init.writer;
+                W *writer = init.writer;
 
                 state = State::WRITE;
                 BufferRef valueStr = getValueStr();
@@ -616,19 +620,20 @@ class WriteJsonBoolean : WriteFuture<WriteJsonBoolean, bool> {
     bool value;
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteFromBuffer *write;
+        typename writer_ops<W>::WriteFromBuffer *write;
     };
 };
 
-class WriteJsonString : WriteFuture<WriteJsonString, bool> {
+template <typename W = Writer>
+class WriteJsonString : WriteFuture<WriteJsonString<W>, bool> {
     // TODO: String escaping
    public:
-    WriteJsonString(Writer *writer, BufferRef string)
+    WriteJsonString(W *writer, BufferRef string)
         : init({writer}), string(string) {}
 
-    Writer *getWriter() {
+    W *getWriter() {
         switch (state) {
             case State::INIT:
                 return init.writer;
@@ -642,10 +647,10 @@ class WriteJsonString : WriteFuture<WriteJsonString, bool> {
         return nullptr;
     }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
-                Writer *writer = init.writer;
+                W *writer = init.writer;
 
                 state = State::WRITE_BEGIN;
                 writeChar = WriteChar(writer, '"');
@@ -656,7 +661,7 @@ class WriteJsonString : WriteFuture<WriteJsonString, bool> {
                     return Poll<bool>::ready(false);
                 }
 
-                Writer *writer = writeChar.getWriter();
+                W *writer = writeChar.getWriter();
 
                 state = State::WRITE_STRING;
                 write = writer->writeFromBuffer(string.data, string.length);
@@ -667,7 +672,7 @@ class WriteJsonString : WriteFuture<WriteJsonString, bool> {
                     return Poll<bool>::ready(false);
                 }
 
-                Writer *writer = write->getWriter();
+                W *writer = write->getWriter();
 
                 state = State::WRITE_END;
                 writeChar = WriteChar(writer, '"');
@@ -695,18 +700,19 @@ class WriteJsonString : WriteFuture<WriteJsonString, bool> {
     BufferRef string;
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteChar writeChar;
-        WriteFromBuffer *write;
+        WriteChar<W> writeChar;
+        typename writer_ops<W>::WriteFromBuffer *write;
     };
 };
 
+template <typename W = Writer>
 class JsonSerializer {
    public:
-    JsonSerializer(Writer *writer) : writer(writer) {}
+    JsonSerializer(W *writer) : writer(writer) {}
 
-    Writer *getWriter() { return writer; }
+    W *getWriter() { return writer; }
 
     class SerializeStruct {
        public:
@@ -719,7 +725,7 @@ class JsonSerializer {
                                  BufferRef name, T *value)
                 : serializeStruct(serializeStruct), name(name), value(value) {}
 
-            Poll<bool> poll() {
+            Poll<bool> poll(Context *cx) {
                 switch (state) {
                     case State::INIT: {
                         if (serializeStruct->isFirstElement) {
@@ -781,8 +787,8 @@ class JsonSerializer {
             BufferRef name;
             T *value;
             union {
-                WriteJsonString writeJsonString;
-                WriteChar writeChar;
+                WriteJsonString<W> writeJsonString;
+                WriteChar<W> writeChar;
                 typename Serialize<T, JsonSerializer>::SerializeFuture
                     writeValue;
             };
@@ -792,7 +798,7 @@ class JsonSerializer {
             return SerializeFieldFuture<T>(this, name, value);
         }
 
-        typedef WriteChar EndFuture;
+        typedef WriteChar<W> EndFuture;
         EndFuture end() { return WriteChar(this->serializer->writer, '}'); }
 
        private:
@@ -806,8 +812,8 @@ class JsonSerializer {
         SerializeStructFuture(JsonSerializer *serializer)
             : serializer(serializer), writeChar(serializer->writer, '{') {}
 
-        Poll<Optional<SerializeStruct>> poll() {
-            Poll<bool> poll = writeChar.poll();
+        Poll<Optional<SerializeStruct>> poll(Context *cx) {
+            Poll<bool> poll = writeChar.poll(cx);
             if (poll.isPending()) {
                 return Poll<Optional<SerializeStruct>>::pending();
             }
@@ -824,7 +830,7 @@ class JsonSerializer {
 
        private:
         JsonSerializer *serializer;
-        WriteChar writeChar;
+        WriteChar<W> writeChar;
     };
 
     SerializeStructFuture serializeStruct() {
@@ -832,33 +838,33 @@ class JsonSerializer {
     }
 
    private:
-    Writer *writer;
+    W *writer;
 };
 
-template <typename T>
-class SerializeJson : Future<SerializeJson<T>, bool> {
+template <typename T, typename W = Writer>
+class SerializeJson : Future<SerializeJson<T, W>, bool> {
    public:
-    SerializeJson(Writer *writer, T *ptr)
-        : serializer(JsonSerializer(writer)),
-          future(Serialize<T, JsonSerializer>::serialize(&this->serializer,
-                                                         ptr)) {}
+    SerializeJson(W *writer, T *ptr)
+        : serializer(JsonSerializer<W>(writer)),
+          future(Serialize<T, JsonSerializer<W>>::serialize(&this->serializer,
+                                                            ptr)) {}
 
-    Poll<bool> poll() { return future.poll(); }
+    Poll<bool> poll(Context *cx) { return future.poll(cx); }
 
    private:
-    JsonSerializer serializer;
-    typename Serialize<T, JsonSerializer>::SerializeFuture future;
+    JsonSerializer<W> serializer;
+    typename Serialize<T, JsonSerializer<W>>::SerializeFuture future;
 };
 
-#define IMPL_JSON_SERIALIZE_NUMBER(number_)                           \
-    template <>                                                       \
-    struct Serialize<number_, JsonSerializer> {                       \
-        typedef WriteDouble<10> SerializeFuture;                      \
-                                                                      \
-        static SerializeFuture serialize(JsonSerializer *serializer,  \
-                                         number_ *number) {           \
-            return WriteDouble<10>(serializer->getWriter(), *number); \
-        }                                                             \
+#define IMPL_JSON_SERIALIZE_NUMBER(number_)                                    \
+    template <typename W>                                                      \
+    struct Serialize<number_, JsonSerializer<W>> {                             \
+        typedef WriteDouble<10, W> SerializeFuture;                            \
+                                                                               \
+        static SerializeFuture serialize(JsonSerializer<W> *serializer,        \
+                                         number_ *number) {                    \
+            return WriteDouble<10, W>(serializer->getWriter(), *number);       \
+        }                                                                      \
     };
 
 IMPL_JSON_SERIALIZE_NUMBER(short)
@@ -867,22 +873,23 @@ IMPL_JSON_SERIALIZE_NUMBER(long)
 IMPL_JSON_SERIALIZE_NUMBER(float)
 IMPL_JSON_SERIALIZE_NUMBER(double)
 
-template <>
-struct Serialize<bool, JsonSerializer> {
-    typedef WriteJsonBoolean SerializeFuture;
+template <typename W>
+struct Serialize<bool, JsonSerializer<W>> {
+    typedef WriteJsonBoolean<W> SerializeFuture;
 
-    static WriteJsonBoolean serialize(JsonSerializer *serializer, bool *value) {
-        return WriteJsonBoolean(serializer->getWriter(), *value);
+    static SerializeFuture serialize(JsonSerializer<W> *serializer,
+                                     bool *value) {
+        return WriteJsonBoolean<W>(serializer->getWriter(), *value);
     }
 };
 
-template <>
-struct Serialize<BufferRef, JsonSerializer> {
-    typedef WriteJsonString SerializeFuture;
+template <typename W>
+struct Serialize<BufferRef, JsonSerializer<W>> {
+    typedef WriteJsonString<W> SerializeFuture;
 
-    static SerializeFuture serialize(JsonSerializer *serializer,
+    static SerializeFuture serialize(JsonSerializer<W> *serializer,
                                      BufferRef *value) {
-        return WriteJsonString(serializer->getWriter(), *value);
+        return WriteJsonString<W>(serializer->getWriter(), *value);
     }
 };
 
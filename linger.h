@@ -0,0 +1,146 @@
+#ifndef CPP_ASYNC_HTTP_LINGER_H
+#define CPP_ASYNC_HTTP_LINGER_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET LingerSocket;
+#else
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int LingerSocket;
+#endif
+
+#include "future.h"
+#include "timer.h"
+#include "utils.h"
+
+// Sockets that got their last response and were shut down for writing, but
+// aren't closed yet. Closing a socket with unread bytes, or one that still
+// gets the request afterwards, resets the connection and the client may
+// never see the response. So their bytes are drained until the client hangs
+// up or LINGER_MILLIS passed. Nothing waits for them, so they're drained every
+// DRAIN_MILLIS on the timer wheel. The sockets must be non blocking.
+template <size_t Capacity = 16>
+class LingeringSockets {
+   public:
+    static constexpr const uint64_t LINGER_MILLIS = 1000;
+    static constexpr const uint64_t DRAIN_MILLIS = 50;
+
+    // Sends response, shuts down writing and takes over the socket. Once all
+    // are taken the oldest is closed. The response is empty if it was sent
+    // already.
+    void add(TimerWheel *timers, LingerSocket socket, const char *response,
+             size_t responseLength) {
+#ifdef _WIN32
+        if (responseLength > 0) {
+            send(socket, response, (int)responseLength, 0);
+        }
+        shutdown(socket, SD_SEND);
+#else
+        if (responseLength > 0) {
+            send(socket, response, responseLength,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        shutdown(socket, SHUT_WR);
+#endif
+        if (length == Capacity) {
+            closeSocket(sockets[start].socket);
+            start = (start + 1) % Capacity;
+            length--;
+        }
+        sockets[(start + length) % Capacity] =
+            Lingering{socket, timers->now() + LINGER_MILLIS};
+        length++;
+
+        this->timers = timers;
+        if (!timer.isArmed()) {
+            timers->arm(&timer, timers->now() + DRAIN_MILLIS,
+                        Waker(this, wakeDrain));
+        }
+    }
+
+    void closeAll() {
+        timer.cancel();
+        for (size_t i = 0; i < length; i++) {
+            closeSocket(sockets[(start + i) % Capacity].socket);
+        }
+        start = 0;
+        length = 0;
+    }
+
+   private:
+    // Reads per drain, so a client that keeps sending can't stall the thread
+    static constexpr const size_t DRAIN_READS = 4;
+
+    struct Lingering {
+        LingerSocket socket;
+        uint64_t deadline;
+    };
+
+    // Returns if the client hung up or the socket failed
+    static bool drainSocket(LingerSocket socket) {
+        char buffer[1024];
+        for (size_t i = 0; i < DRAIN_READS; i++) {
+#ifdef _WIN32
+            int read = recv(socket, buffer, sizeof(buffer), 0);
+            if (read == SOCKET_ERROR) {
+                return WSAGetLastError() != WSAEWOULDBLOCK;
+            }
+#else
+            ssize_t read = recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (read == -1) {
+                return errno != EAGAIN && errno != EWOULDBLOCK &&
+                       errno != EINTR;
+            }
+#endif
+            if (read == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void closeSocket(LingerSocket socket) {
+#ifdef _WIN32
+        closesocket(socket);
+#else
+        // Completes a receive io_uring may still have in flight, which would
+        // keep the socket open
+        shutdown(socket, SHUT_RD);
+        ::close(socket);
+#endif
+    }
+
+    static void wakeDrain(void *data) { ((LingeringSockets *)data)->drain(); }
+
+    // Keeps the order, so the oldest socket stays at start
+    void drain() {
+        uint64_t now = timers->now();
+        size_t kept = 0;
+        for (size_t i = 0; i < length; i++) {
+            Lingering lingering = sockets[(start + i) % Capacity];
+            if (drainSocket(lingering.socket) || lingering.deadline <= now) {
+                closeSocket(lingering.socket);
+                continue;
+            }
+            sockets[(start + kept) % Capacity] = lingering;
+            kept++;
+        }
+        length = kept;
+
+        if (length > 0) {
+            timers->arm(&timer, now + DRAIN_MILLIS, Waker(this, wakeDrain));
+        }
+    }
+
+    Lingering sockets[Capacity];
+    size_t start = 0;
+    size_t length = 0;
+    TimerWheel *timers = nullptr;
+    Timer timer;
+};
+
+#endif
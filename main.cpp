@@ -1,21 +1,39 @@
 // Includes required for library to work with gcc
 using namespace std;
 #include <cmath>
+#include <cstring>
 #include <iostream>
 
 #include "stddef.h"
 
 // Library
 #include "buffer.h"
+#include "coroutine.h"
 #include "deser.h"
 #include "http.h"
 #include "http_handler.h"
+#include "http_server.h"
 #include "json.h"
 #include "net.h"
+#include "router.h"
 #include "ser.h"
 
-// Windows
+// Platform
+#ifdef _WIN32
 #include "integration_win.h"
+typedef integration_win::SimpleWinServer<10> PlatformServer;
+#elif defined(ASYNC_HTTP_IO_URING)
+#include "integration_uring.h"
+typedef integration_uring::SimpleUringServer<10> PlatformServer;
+#else
+#include "integration_linux.h"
+typedef integration_linux::SimpleLinuxServer<10> PlatformServer;
+#endif
+
+#ifndef _WIN32
+#include "executor.h"
+#include "sharded_http_server.h"
+#endif
 
 void clearStack() { char array[10000] = {0}; }
 
@@ -87,6 +105,137 @@ struct http_handler<TestHandler> {
     };
 };
 
+struct HelloHandler {};
+
+template <>
+struct http_handler<HelloHandler> {
+    typedef template_utils::pack<> Extractors;
+    typedef const char* Response;
+
+    typedef Instant<Response> HandleFuture;
+
+    static HandleFuture handle() {
+        return Instant<Response>(
+            "HTTP/1.1 200 Ok\r\nContent-Length: 5\r\n\r\nHello");
+    };
+};
+
+struct HeadersHandler {};
+
+template <>
+struct http_handler<HeadersHandler> {
+    typedef template_utils::pack<HttpHeaders<>, RequestArena> Extractors;
+    typedef HttpBodyResponse Response;
+
+    typedef Instant<Response> HandleFuture;
+
+    // Answers with the User-Agent
+    static HandleFuture handle(HttpHeaders<> headers, RequestArena arena) {
+        for (size_t i = 0; i < headers.getLength(); i++) {
+            std::cout << headers.nameAt(i).copyToCString() << " = '"
+                      << headers.valueAt(i).copyToCString() << "'"
+                      << std::endl;
+        }
+
+        // The headers are gone after this call, the arena lives until the
+        // response is written
+        BufferRef body = BufferRef();
+        Optional<BufferRef> agent = headers.get(HeaderId::USER_AGENT);
+        if (agent.isPresent() && arena.arena != nullptr) {
+            char* data = (char*)arena.arena->allocate(agent.get().length, 1);
+            if (data != nullptr) {
+                memcpy(data, agent.get().data, agent.get().length);
+                body = BufferRef(data, agent.get().length);
+            }
+        }
+        return Instant<Response>(HttpBodyResponse{.body = body});
+    };
+};
+
+#ifndef _WIN32
+// Too expensive for the thread of a server, so it runs on an executor
+class CountPrimes : public Future<CountPrimes, size_t> {
+   public:
+    explicit CountPrimes(size_t limit) : limit(limit) {}
+
+    Poll<size_t> poll(Context *cx) {
+        size_t count = 0;
+        for (size_t n = 2; n < limit; n++) {
+            bool prime = true;
+            for (size_t d = 2; d * d <= n && prime; d++) {
+                prime = n % d != 0;
+            }
+            count += prime ? 1 : 0;
+        }
+        return Poll<size_t>::ready(count);
+    }
+
+   private:
+    size_t limit;
+};
+
+static Executor<2> offloadExecutor;
+
+// Answers with the count once the executor is done
+class PrimesResponse : public Future<PrimesResponse, HttpBodyResponse> {
+   public:
+    PrimesResponse(executor::Offloaded<size_t> count, Arena *arena)
+        : count(count), arena(arena) {}
+
+    Poll<HttpBodyResponse> poll(Context *cx) {
+        Poll<Optional<size_t>> poll = count.poll(cx);
+        if (poll.isPending()) {
+            return Poll<HttpBodyResponse>::pending();
+        }
+        BufferRef body = BufferRef();
+        Optional<size_t> result = poll.get();
+        char *data =
+            arena == nullptr ? nullptr : (char *)arena->allocate(24, 1);
+        if (result.isPresent() && data != nullptr) {
+            int length = snprintf(data, 24, "%zu", result.get());
+            body = BufferRef(data, (size_t)length);
+        }
+        return Poll<HttpBodyResponse>::ready(HttpBodyResponse{.body = body});
+    }
+
+   private:
+    executor::Offloaded<size_t> count;
+    Arena *arena;
+};
+
+struct PrimesHandler {};
+
+template <>
+struct http_handler<PrimesHandler> {
+    typedef template_utils::pack<Offload, RequestArena> Extractors;
+    typedef HttpBodyResponse Response;
+
+    typedef PrimesResponse HandleFuture;
+
+    // The connection keeps its thread while a worker counts
+    static HandleFuture handle(Offload offload, RequestArena arena) {
+        auto handle = offloadExecutor.spawn<CountPrimes>((size_t)200000);
+        return PrimesResponse(
+            executor::Offloaded<size_t>(handle, offload.waker), arena.arena);
+    };
+};
+#endif
+
+static constexpr const char ROOT_PATH[] = "/";
+static constexpr const char PERSON_PATH[] = "/person";
+static constexpr const char PRIMES_PATH[] = "/primes";
+
+#ifdef _WIN32
+typedef Router<Route<HttpMethod::GET, ROOT_PATH, HelloHandler>,
+               Route<HttpMethod::POST, PERSON_PATH, TestHandler>>
+    TestRouter;
+#else
+typedef Router<Route<HttpMethod::GET, ROOT_PATH, HelloHandler>,
+               Route<HttpMethod::POST, PERSON_PATH, TestHandler>,
+               Route<HttpMethod::GET, PRIMES_PATH, PrimesHandler>>
+    TestRouter;
+#endif
+
 void testHttpHandler() {
     std::cout << std::endl << "Test Http handler" << std::endl;
 
@@ -119,37 +268,157 @@ void testHttpHandler() {
               << writer.getImpl()->getFilledBuffer().copyToCString() << "\n";
 }
 
-void startHttpServer() {
-    using namespace integration_win;
+void testHttpHeaders() {
+    std::cout << std::endl << "Test Http headers" << std::endl;
 
-    std::cout << "hosting server on port 8000. This will echo the JSON struct PersonId in TestHandler for a post request." << std::endl;
+    HttpRequestStatusLine statusLine = {
+        .version = HttpVersion::HTTP_1_1,
+        .method = HttpMethod::GET,
+    };
 
-    SimpleWinServer<10> server = SimpleWinServer<10>(8000);
+    BufferRef readRef = BufferRef(
+        "Host: localhost\r\n"
+        "user-agent: Mozilla/5.0 (X11; Linux x86_64) \r\n"
+        "X-Custom:  a b  c\r\n"
+        "\r\n");
+    BufferReader reader = readFromBuffer(readRef);
 
-    while (true) {
-        auto result = blockOn(server.accept());
-        if (result.isEmpty()) {
-            break;
-        }
-        size_t clientId = result.get().template at<0>();
-        WinClient* client = result.get().template at<1>();
-        Reader* reader = client->getReader().get();
-        Writer* writer = client->getWriter().get();
-
-        SizedBuffer<20> pathStore;
-        auto statusLineOpt = blockOn(
-            ReadHttpRequestStatusLine<SizedBuffer<20>>(reader, &pathStore));
-        if (statusLineOpt.isEmpty()) {
-            server.freeClient(clientId);
-            continue;
-        }
-        HttpRequestStatusLine statusLine = statusLineOpt.get();
+    SizedBuffer<200> write;
+    BufferWriter writer = writeToBuffer(write.asFullRef());
+    SizedArena<256> arena;
+
+    HandleHttpRequest<HeadersHandler> handle =
+        HandleHttpRequest<HeadersHandler>(statusLine, &reader, &writer,
+                                          nullptr, &arena);
+    blockOn(handle);
+
+    std::cout << "Http Response: " << std::endl
+              << writer.getImpl()->getFilledBuffer().copyToCString() << "\n"
+              << "Arena used: " << arena.getUsed() << std::endl;
+}
+
+// Never completes but always wakes itself, so blockOn never parks
+class Busy : public Future<Busy, void_> {
+   public:
+    explicit Busy(size_t *polls) : polls(polls) {}
+
+    Poll<void_> poll(Context *cx) {
+        (*polls)++;
+        cx->getWaker().wake();
+        return Poll<void_>::pending();
+    }
+
+   private:
+    size_t *polls;
+};
 
-        blockOn(HandleHttpRequest<TestHandler>(statusLine, reader, writer));
+void testTimers() {
+    std::cout << std::endl << "Test timers" << std::endl;
+
+    SpinTimerPark park;
+    uint64_t start = monotonicMillis();
+    blockOn(Sleep(&park.timers, 20), &park);
+    std::cout << "Slept: " << (monotonicMillis() - start >= 20) << std::endl;
+
+    size_t polls = 0;
+    Optional<void_> result =
+        blockOn(Timeout<Busy>(&park.timers, Busy(&polls), 10), &park);
+    std::cout << "Busy timed out: " << result.isEmpty()
+              << ", Polled: " << (polls > 1) << std::endl;
+
+    Optional<void_> slept = blockOn(
+        Timeout<Sleep>(&park.timers, Sleep(&park.timers, 5), 1000), &park);
+    std::cout << "Sleep before timeout: " << slept.isPresent() << std::endl;
+
+    // Deadlines beyond what the top level holds are clamped, so the next
+    // deadline stays ahead and advancing to it ends
+    TimerWheel wheel(1000000000);
+    Timer far;
+    wheel.arm(&far, wheel.now() + 68000000000, Waker());
+    uint64_t deadline = wheel.nextDeadline().get();
+    wheel.advance(wheel.now() + TimerWheel::MAX_DURATION);
+    std::cout << "Far deadline ahead: " << (deadline > 1000000000)
+              << ", Expired: " << far.isExpired() << std::endl;
+}
 
-        server.freeClient(clientId);
+#ifndef _WIN32
+void testExecutor() {
+    std::cout << std::endl << "Test executor" << std::endl;
+
+    static Executor<2, 64> executor;
+    executor.start();
+
+    static const size_t TASKS = 3;
+    SizedBuffer<100> buffers[TASKS];
+    BufferWriter writers[TASKS] = {writeToBuffer(buffers[0].asFullRef()),
+                                   writeToBuffer(buffers[1].asFullRef()),
+                                   writeToBuffer(buffers[2].asFullRef())};
+    PersonId ids[TASKS];
+    Optional<executor::JoinHandle<bool>> handles[TASKS];
+
+    for (size_t i = 0; i < TASKS; i++) {
+        ids[i] = {.name = SizedBuffer<20>(BufferRef("Radiant")), .id = (int)i};
+        handles[i] =
+            executor.spawn<SerializeJson<PersonId>>(&writers[i], &ids[i]);
     }
 
+    for (size_t i = 0; i < TASKS; i++) {
+        executor::JoinHandle<bool> handle = handles[i].get();
+        bool result = blockOn(&handle);
+        std::cout << "Result: " << result << ", JSON: "
+                  << writers[i].getImpl()->getFilledBuffer().copyToCString()
+                  << std::endl;
+    }
+
+    executor.shutdown();
+}
+#endif
+
+#ifdef __cpp_impl_coroutine
+Co<bool> serializeTwice(Arena *arena, Writer *writer, PersonId *id) {
+    bool first = co_await SerializeJson<PersonId>(writer, id);
+    bool second = co_await SerializeJson<PersonId>(writer, id);
+    co_return first && second && co_await writer->flush();
+}
+
+void testCoroutine() {
+    std::cout << std::endl << "Test coroutine" << std::endl;
+
+    SizedArena<1024> arena;
+    SizedBuffer<100> buffer;
+    BufferWriter writer = writeToBuffer(buffer.asFullRef());
+    PersonId id = {.name = SizedBuffer<20>(BufferRef("Radiant")), .id = 1};
+
+    Co<bool> co = serializeTwice(&arena, &writer, &id);
+    size_t frame = arena.getUsed();
+    bool result = blockOn(&co);
+    std::cout << "Result: " << result << ", Frame: " << frame << ", JSON: "
+              << writer.getImpl()->getFilledBuffer().copyToCString()
+              << std::endl;
+}
+#endif
+
+void startHttpServer() {
+    std::cout << "hosting server on port 8000. This will echo the JSON struct PersonId in TestHandler for a post request to /person." << std::endl;
+
+#ifdef _WIN32
+    static PlatformServer server(8000);
+    static http_server::HttpServer<PlatformServer, TestRouter> httpServer =
+        http_server::HttpServer<PlatformServer, TestRouter>(&server);
+
+    blockOn(&httpServer, server.getPark());
+#else
+    // One server per core, GET /primes counts on the executor
+    static http_server::ShardedHttpServer<PlatformServer, TestRouter, 32>
+        shardedServer(8000);
+    offloadExecutor.start();
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    shardedServer.start(cores > 0 ? cores : 1);
+    shardedServer.join();
+    offloadExecutor.shutdown();
+#endif
+
     std::cout << "Closing Server" << std::endl;
 }
 
@@ -168,11 +437,21 @@ int main() {
 
     std::cout << "HandleRequest: " << sizeof(HandleHttpRequest<TestHandler>)
               << std::endl;
+    std::cout << "RouteRequest: " << sizeof(HandleHttpRequest<TestRouter>)
+              << std::endl;
 
     testReflection();
     testSerialize();
     testDeserialize();
     testHttpHandler();
+    testHttpHeaders();
+    testTimers();
+#ifndef _WIN32
+    testExecutor();
+#endif
+#ifdef __cpp_impl_coroutine
+    testCoroutine();
+#endif
 
     startHttpServer();
 
@@ -2,6 +2,7 @@
 #define CPP_ASYNC_HTTP_NET_H
 
 #include "reader.h"
+#include "slab.h"
 #include "utils.h"
 #include "writer.h"
 
@@ -9,6 +10,11 @@ namespace net {
 
 // How Client/Server should be implemented
 class Client {
+    // The types returned by getWriter/getReader. Futures are templated on
+    // these, so they should be final.
+    typedef ::Writer Writer;
+    typedef ::Reader Reader;
+
     Optional<Writer*> getWriter() = delete;
     Optional<Reader*> getReader() = delete;
 
@@ -17,14 +23,37 @@ class Client {
 };
 
 class Server {
-    typedef Client Client;
+    typedef net::Client Client;
+
+    // The index of every clientId returned by accept is smaller than this.
+    static constexpr const size_t MAX_CLIENTS = 0;
+
+    // Futures of this server must be run with blockOn(future, getPark()). Its
+    // unpark is called from other threads to wake the one running the server.
+    typedef SpinPark Park;
+    Park* getPark() = delete;
 
     // Returning empty means that the connection pool is full or the server is
-    // closed(maybe because of an error).
-    typedef Future<void_, Optional<Tuple<size_t, Client*>>> AcceptFuture;
+    // closed(maybe because of an error). HttpServer polls a new AcceptFuture
+    // right after every client, so all waiting connections are accepted
+    // before anything else runs. Accepting must therefore be cheap, e.g. one
+    // non blocking accept4 call per client.
+    typedef Future<void_, Optional<Tuple<SlabHandle, Client*>>> AcceptFuture;
     AcceptFuture accept() = delete;
 
-    void freeClient(size_t clientId) = delete;
+    // Accepts a waiting client only to send it response and close it, while
+    // accept returns empty because the pool is full. Returns false once no
+    // client is waiting, cx must be woken when the next one arrives.
+    bool rejectClient(Context* cx, const char* response,
+                      size_t length) = delete;
+
+    // Must ignore ids of clients that were already freed
+    void freeClient(SlabHandle clientId) = delete;
+
+    // Like freeClient, but the client got its last response and may still be
+    // sending the request. Its socket lingers to read it instead of resetting
+    // the connection(see LingeringSockets).
+    void lingerClient(SlabHandle clientId) = delete;
 
     void close() = delete;
     bool isClosed() = delete;
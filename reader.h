@@ -3,6 +3,7 @@
 
 #include <new>
 
+#include "buffer_pool.h"
 #include "future.h"
 #include "utils.h"
 
@@ -19,7 +20,7 @@ class VirtualReadFuture : public ReadFuture<VirtualReadFuture<Output>, Output> {
    public:
     virtual Reader *getReader() = 0;
 
-    virtual Poll<Output> poll() = 0;
+    virtual Poll<Output> poll(Context *cx) = 0;
 };
 
 class ReadIntoBuffer : public VirtualReadFuture<size_t> {
@@ -30,19 +31,47 @@ class ReadIntoBuffer : public VirtualReadFuture<size_t> {
 
 typedef VirtualReadFuture<Optional<char>> Peek;
 
+// Returns the bytes that are buffered by the reader. Only reads if nothing is
+// buffered. An empty BufferRef means that the reader is closed.
+typedef VirtualReadFuture<BufferRef> FillBuf;
+
 class Reader {
    public:
     virtual ReadIntoBuffer *readIntoBuffer(char *buffer,
                                            size_t bufferLength) = 0;
 
     virtual Peek *peek() = 0;
+
+    // The returned bytes stay valid until the next call on this reader
+    virtual FillBuf *fillBuf() = 0;
+
+    // Marks the first count bytes returned by fillBuf as read
+    virtual void consume(size_t count) = 0;
+
+    // Bytes that can be read without waiting for the underlying source
+    virtual size_t bufferedLength() = 0;
 };
 
-class ReadChar : public ReadFuture<ReadChar, Optional<char>> {
+// The futures returned by the ops of the reader R. For Reader these are the
+// virtual futures, a final reader returns its own impls so the futures below
+// can be templated on it and don't need any virtual calls.
+template <typename R>
+struct reader_ops {
+    typedef typename template_utils::remove_pointer<decltype(
+        template_utils::declval<R &>().readIntoBuffer(nullptr, 0))>::type
+        ReadIntoBuffer;
+    typedef typename template_utils::remove_pointer<decltype(
+        template_utils::declval<R &>().peek())>::type Peek;
+    typedef typename template_utils::remove_pointer<decltype(
+        template_utils::declval<R &>().fillBuf())>::type FillBuf;
+};
+
+template <typename R = Reader>
+class ReadChar : public ReadFuture<ReadChar<R>, Optional<char>> {
    public:
-    explicit ReadChar(Reader *reader) : init({reader}) {}
+    explicit ReadChar(R *reader) : init({reader}) {}
 
-    Reader *getReader() {
+    R *getReader() {
         switch (state) {
             case State::INIT:
                 return init.reader;
@@ -52,16 +81,16 @@ class ReadChar : public ReadFuture<ReadChar, Optional<char>> {
         return nullptr;
     }
 
-    Poll<Optional<char>> poll() {
+    Poll<Optional<char>> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 state = State::AFTER_INIT;
-                Reader *reader = init.reader;
+                R *reader = init.reader;
                 afterInit.read = reader->readIntoBuffer(&afterInit.c, 1);
             }
                 // Fallthrough
             case State::AFTER_INIT:
-                Poll<size_t> poll = afterInit.read->poll();
+                Poll<size_t> poll = afterInit.read->poll(cx);
                 if (poll.isReady()) {
                     if (poll.get() == 0) {
                         return Poll<Optional<char>>::ready(
@@ -74,7 +103,7 @@ class ReadChar : public ReadFuture<ReadChar, Optional<char>> {
                 }
                 break;
         }
-        return Poll<Optional<char>>::ready(Optional<char>::empty());
+        return Poll<Optional<char>>::pending();
     }
 
    private:
@@ -82,20 +111,127 @@ class ReadChar : public ReadFuture<ReadChar, Optional<char>> {
 
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
         struct {
             char c;
-            ReadIntoBuffer *read;
+            typename reader_ops<R>::ReadIntoBuffer *read;
         } afterInit;
     };
 };
 
 // A wrapper around a ReadImpl that provides a simple interface for
 // reading/peeking data ReadImpl must have the function: Optional<size_t>
-// readIntoBuffer(char *buffer, size_t bufferLength)
+// readIntoBuffer(Context *cx, char *buffer, size_t bufferLength) where an empty
+// optional means that the reader is closed. If 0 is returned the impl must wake
+// the waker of cx once there's new data.
 template <typename ReadImpl>
-class SimpleReader : public Reader {
+class SimpleReader final : public Reader {
+   private:
+    // The ops return these directly, so they need to be complete before them
+    class ReadIntoBufferImpl final : public ReadIntoBuffer {
+       public:
+        explicit ReadIntoBufferImpl(SimpleReader<ReadImpl> *reader,
+                                    char *buffer, size_t bufferLength)
+            : reader(reader), buffer(buffer), bufferLength(bufferLength) {}
+
+        SimpleReader<ReadImpl> *getReader() override { return reader; }
+
+        char *getBuffer() override { return buffer; }
+
+        size_t getBufferLength() override { return bufferLength; }
+
+        Poll<size_t> poll(Context *cx) override {
+            switch (reader->hasPeeked) {
+                case true:
+                    reader->hasPeeked = false;
+                    buffer[0] = reader->peekedChar;
+                    offset++;
+                    // Fallthrough
+                case false:
+                    while (offset < bufferLength) {
+                        Optional<size_t> opt = reader->impl.readIntoBuffer(
+                            cx, buffer + offset, bufferLength - offset);
+                        if (opt.isEmpty()) {
+                            return Poll<size_t>::ready(offset);
+                        }
+                        size_t read = opt.get();
+                        if (read == 0) {
+                            // The impl will wake us
+                            return Poll<size_t>::pending();
+                        }
+                        offset += read;
+                    }
+                    break;
+            }
+
+            return Poll<size_t>::ready(offset);
+        }
+
+       private:
+        SimpleReader *reader;
+        char *buffer;
+        size_t bufferLength;
+        size_t offset = 0;
+    };
+
+    class PeekImpl final : public Peek {
+       public:
+        explicit PeekImpl(SimpleReader<ReadImpl> *reader) : reader(reader) {}
+
+        SimpleReader<ReadImpl> *getReader() override { return reader; }
+
+        Poll<Optional<char>> poll(Context *cx) override {
+            if (!reader->hasPeeked) {
+                Optional<size_t> opt =
+                    reader->impl.readIntoBuffer(cx, &reader->peekedChar, 1);
+                if (opt.isPresent()) {
+                    size_t read = opt.get();
+                    if (read == 0) {
+                        return Poll<Optional<char>>::pending();
+                    }
+
+                    reader->hasPeeked = true;
+                    return Poll<Optional<char>>::ready(
+                        Optional<char>::of(reader->peekedChar));
+                } else {
+                    return Poll<Optional<char>>::ready(Optional<char>::empty());
+                }
+            } else {
+                return Poll<Optional<char>>::ready(
+                    Optional<char>::of(reader->peekedChar));
+            }
+        }
+
+       private:
+        SimpleReader *reader;
+    };
+
+    class FillBufImpl final : public FillBuf {
+       public:
+        explicit FillBufImpl(SimpleReader<ReadImpl> *reader)
+            : peek(reader) {}
+
+        SimpleReader<ReadImpl> *getReader() override {
+            return peek.getReader();
+        }
+
+        Poll<BufferRef> poll(Context *cx) override {
+            Poll<Optional<char>> poll = peek.poll(cx);
+            if (poll.isPending()) {
+                return Poll<BufferRef>::pending();
+            }
+            if (poll.get().isEmpty()) {
+                return Poll<BufferRef>::ready(BufferRef());
+            }
+            return Poll<BufferRef>::ready(
+                BufferRef(&getReader()->peekedChar, 1));
+        }
+
+       private:
+        PeekImpl peek;
+    };
+
    public:
     explicit SimpleReader(ReadImpl impl) : impl(impl) {}
 
@@ -131,23 +267,40 @@ class SimpleReader : public Reader {
 
     ReadImpl *getImpl() { return &impl; }
 
-    ReadIntoBuffer *readIntoBuffer(char *buffer, size_t bufferLength) override {
+    ReadIntoBufferImpl *readIntoBuffer(char *buffer,
+                                       size_t bufferLength) override {
         destructPrevOp();
 
         currentOpType = Op::READ;
         void *ptr = (void *)&currentOp;
-        return (ReadIntoBuffer *)new (ptr)
-            ReadIntoBufferImpl(this, buffer, bufferLength);
+        return new (ptr) ReadIntoBufferImpl(this, buffer, bufferLength);
     }
 
-    Peek *peek() override {
+    PeekImpl *peek() override {
         destructPrevOp();
 
         currentOpType = Op::PEEK;
         void *ptr = (void *)&currentOp;
-        return (Peek *)new (ptr) PeekImpl(this);
+        return new (ptr) PeekImpl(this);
+    }
+
+    // Only the peeked char is buffered
+    FillBufImpl *fillBuf() override {
+        destructPrevOp();
+
+        currentOpType = Op::FILL_BUF;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) FillBufImpl(this);
     }
 
+    void consume(size_t count) override {
+        if (count > 0) {
+            hasPeeked = false;
+        }
+    }
+
+    size_t bufferedLength() override { return hasPeeked ? 1 : 0; }
+
    private:
     void copyFrom(SimpleReader<ReadImpl> &other) {
         this->impl = other.impl;
@@ -159,85 +312,312 @@ class SimpleReader : public Reader {
     char peekedChar;
     bool hasPeeked = false;
 
-    class ReadIntoBufferImpl : ReadIntoBuffer {
+    enum class Op { NONE, READ, PEEK, FILL_BUF } currentOpType = Op::NONE;
+    char currentOp[template_utils::max_value<size_t, sizeof(ReadIntoBufferImpl),
+                                             sizeof(PeekImpl),
+                                             sizeof(FillBufImpl)>::value];
+
+    void destructPrevOp() {
+        void *currentOp = this->currentOp;
+        switch (currentOpType) {
+            case Op::READ:
+                ((ReadIntoBufferImpl *)currentOp)->~ReadIntoBufferImpl();
+                break;
+            case Op::PEEK:
+                ((PeekImpl *)currentOp)->~PeekImpl();
+                break;
+            case Op::FILL_BUF:
+                ((FillBufImpl *)currentOp)->~FillBufImpl();
+                break;
+        }
+        currentOpType = Op::NONE;
+    }
+
+    ReadImpl impl;
+};
+
+// A Reader that reads big chunks from a ReadImpl(same as SimpleReader) into a
+// ring buffer and serves peek/readIntoBuffer from it. Reads that are bigger
+// than the buffer go to the ReadImpl directly.
+template <typename ReadImpl, size_t Capacity,
+          typename Storage = InlineBuffer<Capacity>>
+class BufferedReader final : public Reader {
+   private:
+    class ReadIntoBufferImpl final : public ReadIntoBuffer {
        public:
-        explicit ReadIntoBufferImpl(SimpleReader<ReadImpl> *reader,
-                                    char *buffer, size_t bufferLength)
+        explicit ReadIntoBufferImpl(
+            BufferedReader<ReadImpl, Capacity, Storage> *reader, char *buffer,
+            size_t bufferLength)
             : reader(reader), buffer(buffer), bufferLength(bufferLength) {}
 
-        SimpleReader<ReadImpl> *getReader() override { return reader; }
+        BufferedReader<ReadImpl, Capacity, Storage> *getReader() override {
+            return reader;
+        }
 
         char *getBuffer() override { return buffer; }
 
         size_t getBufferLength() override { return bufferLength; }
 
-        Poll<size_t> poll() override {
-            switch (reader->hasPeeked) {
-                case true:
-                    reader->hasPeeked = false;
-                    buffer[0] = reader->peekedChar;
-                    offset++;
-                    // Fallthrough
-                case false:
-                    Optional<size_t> opt = reader->impl.readIntoBuffer(
-                        buffer + offset, bufferLength - offset);
+        Poll<size_t> poll(Context *cx) override {
+            while (true) {
+                offset += reader->takeBuffered(buffer + offset,
+                                               bufferLength - offset);
+                reader->releaseIfEmpty();
+                if (offset == bufferLength) {
+                    return Poll<size_t>::ready(offset);
+                }
+
+                // The ring is empty now
+                Optional<size_t> opt;
+                if (bufferLength - offset >= Capacity) {
+                    opt = reader->impl.readIntoBuffer(cx, buffer + offset,
+                                                      bufferLength - offset);
                     if (opt.isPresent()) {
-                        size_t read = opt.get();
-                        offset += read;
-                    } else {
-                        return Poll<size_t>::ready(offset);
+                        offset += opt.get();
                     }
-                    break;
-            }
+                } else {
+                    opt = reader->fill(cx);
+                }
 
-            if (offset == bufferLength) {
-                return Poll<size_t>::ready(offset);
+                if (opt.isEmpty()) {
+                    return Poll<size_t>::ready(offset);
+                }
+                if (opt.get() == 0) {
+                    // The impl will wake us
+                    return Poll<size_t>::pending();
+                }
             }
-
-            return Poll<size_t>::pending();
         }
 
        private:
-        SimpleReader *reader;
+        BufferedReader<ReadImpl, Capacity, Storage> *reader;
         char *buffer;
         size_t bufferLength;
         size_t offset = 0;
     };
 
-    class PeekImpl : Peek {
+    class PeekImpl final : public Peek {
        public:
-        explicit PeekImpl(SimpleReader<ReadImpl> *reader) : reader(reader) {}
+        explicit PeekImpl(BufferedReader<ReadImpl, Capacity, Storage> *reader)
+            : reader(reader) {}
 
-        SimpleReader<ReadImpl> *getReader() override { return reader; }
-
-        Poll<Optional<char>> poll() override {
-            if (!reader->hasPeeked) {
-                Optional<size_t> opt =
-                    reader->impl.readIntoBuffer(&reader->peekedChar, 1);
-                if (opt.isPresent()) {
-                    size_t read = opt.get();
-                    if (read == 0) {
-                        return Poll<Optional<char>>::pending();
-                    }
+        BufferedReader<ReadImpl, Capacity, Storage> *getReader() override {
+            return reader;
+        }
 
-                    reader->hasPeeked = true;
-                    return Poll<Optional<char>>::ready(
-                        Optional<char>::of(reader->peekedChar));
-                } else {
+        Poll<Optional<char>> poll(Context *cx) override {
+            if (reader->length == 0) {
+                Optional<size_t> opt = reader->fill(cx);
+                if (opt.isEmpty()) {
                     return Poll<Optional<char>>::ready(Optional<char>::empty());
                 }
-            } else {
-                return Poll<Optional<char>>::ready(
-                    Optional<char>::of(reader->peekedChar));
+                if (opt.get() == 0) {
+                    return Poll<Optional<char>>::pending();
+                }
             }
+            return Poll<Optional<char>>::ready(
+                Optional<char>::of(reader->storage.get()[reader->start]));
         }
 
        private:
-        SimpleReader *reader;
+        BufferedReader<ReadImpl, Capacity, Storage> *reader;
     };
 
-    enum class Op { NONE, READ, PEEK } currentOpType = Op::NONE;
-    char currentOp[max(sizeof(ReadIntoBufferImpl), sizeof(PeekImpl))];
+    class FillBufImpl final : public FillBuf {
+       public:
+        explicit FillBufImpl(
+            BufferedReader<ReadImpl, Capacity, Storage> *reader)
+            : reader(reader) {}
+
+        BufferedReader<ReadImpl, Capacity, Storage> *getReader() override {
+            return reader;
+        }
+
+        Poll<BufferRef> poll(Context *cx) override {
+            if (reader->length == 0) {
+                Optional<size_t> opt = reader->fill(cx);
+                if (opt.isEmpty()) {
+                    return Poll<BufferRef>::ready(BufferRef());
+                }
+                if (opt.get() == 0) {
+                    return Poll<BufferRef>::pending();
+                }
+            }
+            size_t contiguous =
+                min(reader->length, Capacity - reader->start);
+            return Poll<BufferRef>::ready(
+                BufferRef(reader->storage.get() + reader->start, contiguous));
+        }
+
+       private:
+        BufferedReader<ReadImpl, Capacity, Storage> *reader;
+    };
+
+   public:
+    static_assert(Capacity > 0, "Capacity must be at least one byte");
+
+    explicit BufferedReader(ReadImpl impl, Storage storage = Storage())
+        : impl(impl), storage(storage) {}
+
+    BufferedReader(BufferedReader<ReadImpl, Capacity, Storage> &other)
+        : impl(other.impl), storage(other.storage) {  // copy constructor
+        copyBufferFrom(other);
+    }
+
+    BufferedReader(BufferedReader<ReadImpl, Capacity, Storage> &&other)
+        : impl(other.impl), storage(other.storage) {  // move constructor
+        copyBufferFrom(other);
+    }
+
+    // copy assignment
+    BufferedReader<ReadImpl, Capacity, Storage> &operator=(
+        BufferedReader<ReadImpl, Capacity, Storage> &other) {
+        copyFrom(other);
+        return *this;
+    }
+
+    // move assignment
+    BufferedReader<ReadImpl, Capacity, Storage> &operator=(
+        BufferedReader<ReadImpl, Capacity, Storage> &&other) {
+        copyFrom(other);
+        return *this;
+    }
+
+    ~BufferedReader() {  // destructor
+        destructPrevOp();
+    }
+
+    ReadImpl *getImpl() { return &impl; }
+
+    // Bytes that can be read without calling the ReadImpl
+    size_t bufferedLength() override { return length; }
+
+    ReadIntoBufferImpl *readIntoBuffer(char *buffer,
+                                       size_t bufferLength) override {
+        destructPrevOp();
+
+        currentOpType = Op::READ;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) ReadIntoBufferImpl(this, buffer, bufferLength);
+    }
+
+    PeekImpl *peek() override {
+        destructPrevOp();
+
+        currentOpType = Op::PEEK;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) PeekImpl(this);
+    }
+
+    // Returns the bytes until the end of the ring, the rest is returned by the
+    // next fillBuf
+    FillBufImpl *fillBuf() override {
+        destructPrevOp();
+
+        currentOpType = Op::FILL_BUF;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) FillBufImpl(this);
+    }
+
+    void consume(size_t count) override {
+        start = (start + count) % Capacity;
+        length -= count;
+        releaseIfEmpty();
+    }
+
+    // Forgets the buffered bytes, e.g. once the connection is closed
+    void dropBuffered() {
+        start = 0;
+        length = 0;
+        storage.release();
+    }
+
+   private:
+    void copyBufferFrom(BufferedReader<ReadImpl, Capacity, Storage> &other) {
+        // Only copy the filled part
+        start = 0;
+        length = 0;
+        currentOpType = Op::NONE;
+        if (other.length == 0) {
+            return;
+        }
+        if (storage.acquire()) {
+            length = other.takeBuffered(storage.get(), other.length);
+            other.putBack(length);
+            return;
+        }
+        // No buffer left for a copy, so the bytes move over with the buffer
+        storage.takeOver(other.storage);
+        start = other.start;
+        length = other.length;
+        other.start = 0;
+        other.length = 0;
+    }
+
+    void copyFrom(BufferedReader<ReadImpl, Capacity, Storage> &other) {
+        destructPrevOp();
+        this->impl = other.impl;
+        this->storage = other.storage;
+        copyBufferFrom(other);
+    }
+
+    // Moves at most bufferLength buffered bytes into buffer
+    size_t takeBuffered(char *buffer, size_t bufferLength) {
+        size_t take = min(length, bufferLength);
+
+        size_t first = min(take, Capacity - start);
+        memcpy(buffer, storage.get() + start, first);
+        memcpy(buffer + first, storage.get(), take - first);
+
+        start = (start + take) % Capacity;
+        length -= take;
+        return take;
+    }
+
+    // Undoes the last takeBuffered of count bytes
+    void putBack(size_t count) {
+        start = (start + Capacity - count) % Capacity;
+        length += count;
+    }
+
+    // Reads as much as possible into the free part of the ring. The ring must
+    // not be full. While the pool has no buffer left this waits like a read,
+    // the pool wakes cx once one was given back.
+    Optional<size_t> fill(Context *cx) {
+        if (length == 0) {
+            // Keep the data contiguous
+            start = 0;
+        }
+        Poll<bool> acquired = storage.pollAcquire(cx);
+        if (acquired.isPending()) {
+            return Optional<size_t>::of(0);
+        }
+        if (!acquired.get()) {
+            return Optional<size_t>::empty();
+        }
+        size_t end = (start + length) % Capacity;
+        size_t free = end < start ? start - end : Capacity - end;
+
+        Optional<size_t> opt =
+            impl.readIntoBuffer(cx, storage.get() + end, free);
+        if (opt.isPresent()) {
+            length += opt.get();
+        }
+        // Nothing to hold while waiting for the next bytes
+        releaseIfEmpty();
+        return opt;
+    }
+
+    void releaseIfEmpty() {
+        if (length == 0) {
+            storage.release();
+        }
+    }
+
+    enum class Op { NONE, READ, PEEK, FILL_BUF } currentOpType = Op::NONE;
+    char currentOp[template_utils::max_value<size_t, sizeof(ReadIntoBufferImpl),
+                                             sizeof(PeekImpl),
+                                             sizeof(FillBufImpl)>::value];
 
     void destructPrevOp() {
         void *currentOp = this->currentOp;
@@ -248,279 +628,350 @@ class SimpleReader : public Reader {
             case Op::PEEK:
                 ((PeekImpl *)currentOp)->~PeekImpl();
                 break;
+            case Op::FILL_BUF:
+                ((FillBufImpl *)currentOp)->~FillBufImpl();
+                break;
         }
         currentOpType = Op::NONE;
     }
 
     ReadImpl impl;
+    size_t start = 0;
+    size_t length = 0;
+    // Only holds a buffer while length > 0 if it's pooled
+    Storage storage;
 };
 
-// F needs to overload: bool operator()(char c);
-template <typename F>
-class ReadWhile : public ReadFuture<ReadWhile<F>, void_> {
-   public:
-    explicit ReadWhile(Reader *reader, F f) : init({reader}), f(f) {}
+// Reads at most limit bytes from the reader R and is closed after them, e.g.
+// for a request body in front of the next request.
+template <typename R = Reader>
+class LimitedReader final : public Reader {
+   private:
+    class ReadIntoBufferImpl final : public ReadIntoBuffer {
+       public:
+        explicit ReadIntoBufferImpl(LimitedReader<R> *reader, char *buffer,
+                                    size_t bufferLength)
+            : reader(reader),
+              buffer(buffer),
+              bufferLength(bufferLength),
+              read(reader->reader->readIntoBuffer(
+                  buffer, min(bufferLength, reader->remaining))) {}
 
-    Reader *getReader() {
-        switch (state) {
-            case State::INIT:
-                return init.reader;
-            case State::PEEK:
-                return peek->getReader();
-            case State::READ:
-                return read.getReader();
+        LimitedReader<R> *getReader() override { return reader; }
+
+        char *getBuffer() override { return buffer; }
+
+        size_t getBufferLength() override { return bufferLength; }
+
+        Poll<size_t> poll(Context *cx) override {
+            Poll<size_t> poll = read->poll(cx);
+            if (poll.isReady()) {
+                reader->remaining -= poll.get();
+            }
+            return poll;
         }
-        return nullptr;
-    }
 
-    F *getFunc() { return &f; }
+       private:
+        LimitedReader<R> *reader;
+        char *buffer;
+        size_t bufferLength;
+        typename reader_ops<R>::ReadIntoBuffer *read;
+    };
 
-    Poll<void_> poll() {
-        switch (state) {
-            case State::INIT:
-                state = State::PEEK;
-                peek = init.reader->peek();
-                // Fallthrough
-            default:
-                return peekAndRead();
+    class PeekImpl final : public Peek {
+       public:
+        explicit PeekImpl(LimitedReader<R> *reader)
+            : reader(reader), peek(reader->reader->peek()) {}
+
+        LimitedReader<R> *getReader() override { return reader; }
+
+        Poll<Optional<char>> poll(Context *cx) override {
+            if (reader->remaining == 0) {
+                return Poll<Optional<char>>::ready(Optional<char>::empty());
+            }
+            return peek->poll(cx);
+        }
+
+       private:
+        LimitedReader<R> *reader;
+        typename reader_ops<R>::Peek *peek;
+    };
+
+    class FillBufImpl final : public FillBuf {
+       public:
+        explicit FillBufImpl(LimitedReader<R> *reader)
+            : reader(reader), fillBuf(reader->reader->fillBuf()) {}
+
+        LimitedReader<R> *getReader() override { return reader; }
+
+        Poll<BufferRef> poll(Context *cx) override {
+            if (reader->remaining == 0) {
+                return Poll<BufferRef>::ready(BufferRef());
+            }
+            Poll<BufferRef> poll = fillBuf->poll(cx);
+            if (poll.isPending()) {
+                return poll;
+            }
+            BufferRef buffered = poll.get();
+            return Poll<BufferRef>::ready(
+                buffered.asRef(min(buffered.length, reader->remaining)));
         }
+
+       private:
+        LimitedReader<R> *reader;
+        typename reader_ops<R>::FillBuf *fillBuf;
+    };
+
+   public:
+    explicit LimitedReader(R *reader, size_t limit)
+        : reader(reader), remaining(limit) {}
+
+    LimitedReader(const LimitedReader<R> &other)
+        : reader(other.reader), remaining(other.remaining) {}
+
+    LimitedReader<R> &operator=(const LimitedReader<R> &other) {
+        destructPrevOp();
+        reader = other.reader;
+        remaining = other.remaining;
+        return *this;
+    }
+
+    ~LimitedReader() { destructPrevOp(); }
+
+    // Bytes that can still be read
+    size_t getRemaining() { return remaining; }
+
+    ReadIntoBufferImpl *readIntoBuffer(char *buffer,
+                                       size_t bufferLength) override {
+        destructPrevOp();
+
+        currentOpType = Op::READ;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) ReadIntoBufferImpl(this, buffer, bufferLength);
+    }
+
+    PeekImpl *peek() override {
+        destructPrevOp();
+
+        currentOpType = Op::PEEK;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) PeekImpl(this);
+    }
+
+    FillBufImpl *fillBuf() override {
+        destructPrevOp();
+
+        currentOpType = Op::FILL_BUF;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) FillBufImpl(this);
+    }
+
+    void consume(size_t count) override {
+        remaining -= count;
+        reader->consume(count);
+    }
+
+    size_t bufferedLength() override {
+        return min(reader->bufferedLength(), remaining);
     }
 
    private:
-    Poll<void_> peekAndRead() {
+    enum class Op { NONE, READ, PEEK, FILL_BUF } currentOpType = Op::NONE;
+    char currentOp[template_utils::max_value<size_t, sizeof(ReadIntoBufferImpl),
+                                             sizeof(PeekImpl),
+                                             sizeof(FillBufImpl)>::value];
+
+    void destructPrevOp() {
+        void *currentOp = this->currentOp;
+        switch (currentOpType) {
+            case Op::READ:
+                ((ReadIntoBufferImpl *)currentOp)->~ReadIntoBufferImpl();
+                break;
+            case Op::PEEK:
+                ((PeekImpl *)currentOp)->~PeekImpl();
+                break;
+            case Op::FILL_BUF:
+                ((FillBufImpl *)currentOp)->~FillBufImpl();
+                break;
+        }
+        currentOpType = Op::NONE;
+    }
+
+    R *reader;
+    size_t remaining;
+};
+
+// Passes the buffered bytes of the reader to scan one slice at a time and
+// consumes the bytes scan used.
+// S must overload: size_t operator()(BufferRef slice) which returns how many
+// bytes of the slice were used. This stops once scan doesn't use the whole
+// slice or the reader is closed.
+template <typename S, typename R = Reader>
+class ReadSlicesWhile : public ReadFuture<ReadSlicesWhile<S, R>, void_> {
+   public:
+    explicit ReadSlicesWhile(R *reader, S scan)
+        : reader(reader), scan(scan) {}
+
+    R *getReader() { return reader; }
+
+    S *getScan() { return &scan; }
+
+    Poll<void_> poll(Context *cx) {
         while (true) {
             switch (state) {
-                case State::PEEK:
-                peek: {
-                    Poll<Optional<char>> poll = peek->poll();
-                    if (poll.isPending()) {
-                        return Poll<void_>::pending();
-                    }
-
-                    Optional<char> opt = poll.get();
-                    if (opt.isPresent()) {
-                        char c = opt.get();
-                        if (f(c)) {
-                            state = State::READ;
-
-                            Reader *reader = peek->getReader();
-                            read = ReadChar(reader);
-                            // Only this case will fallthrough. the others will
-                            // return
-                        } else {
-                            return Poll<void_>::ready(void_());
-                        }
-                    } else {
-                        READY(void_())
-                    }
+                case State::INIT: {
+                    state = State::FILL_BUF;
+                    fillBuf = reader->fillBuf();
                 }
                     // Fallthrough
-                case State::READ: {
-                    Poll<Optional<char>> poll = read.poll();
-                    if (poll.isPending()) {
-                        return Poll<void_>::pending();
+                case State::FILL_BUF: {
+                    AWAIT_PTR(fillBuf, slice)
+                    if (slice.length == 0) {
+                        // Closed
+                        READY(void_())
                     }
 
-                    // We don't care about the result of the read
-
-                    state = State::PEEK;
-
-                    Reader *reader = read.getReader();
-                    peek = reader->peek();
-
-                    goto peek;
+                    size_t used = scan(slice);
+                    reader->consume(used);
+                    if (used < slice.length) {
+                        READY(void_())
+                    }
+                    state = State::INIT;
                 } break;
             }
         }
     }
 
-    enum class State {
-        INIT,
-        PEEK,
-        READ,
-    } state = State::INIT;
+   private:
+    enum class State { INIT, FILL_BUF } state = State::INIT;
+    R *reader;
+    typename reader_ops<R>::FillBuf *fillBuf;
+    S scan;
+};
 
-    union {
-        struct {
-            Reader *reader;
-        } init;
-        Peek *peek;
-        ReadChar read;
+// F needs to overload: bool operator()(char c);
+template <typename F, typename R = Reader>
+class ReadWhile : public ReadFuture<ReadWhile<F, R>, void_> {
+   public:
+    explicit ReadWhile(R *reader, F f) : readSlices(reader, Scan{f}) {}
+
+    R *getReader() { return readSlices.getReader(); }
+
+    F *getFunc() { return &readSlices.getScan()->f; }
+
+    Poll<void_> poll(Context *cx) { return readSlices.poll(cx); }
+
+   private:
+    struct Scan {
+        F f;
+
+        size_t operator()(BufferRef slice) {
+            size_t i = 0;
+            while (i < slice.length && f(slice.data[i])) {
+                i++;
+            }
+            return i;
+        }
     };
-    F f;
+
+    ReadSlicesWhile<Scan, R> readSlices;
 };
 
 // Store must have: bool push(char);
 // F must overload: bool operator()(char);
 // Returns if store had enough space(push always returned true = this will
 // return true)
-template <typename Store, typename F>
+template <typename Store, typename F, typename R = Reader>
 class ReadIntoStoreWhile
-    : public ReadFuture<ReadIntoStoreWhile<Store, F>, bool> {
+    : public ReadFuture<ReadIntoStoreWhile<Store, F, R>, bool> {
    public:
-    ReadIntoStoreWhile(Reader *reader, Store *store, F f)
-        : init{reader, store, f} {}
+    ReadIntoStoreWhile(R *reader, Store *store, F f)
+        : readSlices(reader, Scan{true, store, f}) {}
 
-    Reader *getReader() {
-        switch (state) {
-            case State::INIT:
-                return init.reader;
-            case State::READ_WHILE:
-                return readWhile.getReader();
-        }
-        return nullptr;
-    }
+    R *getReader() { return readSlices.getReader(); }
 
-    Store *getStore() {
-        switch (state) {
-            case State::INIT:
-                return init.store;
-            case State::READ_WHILE:
-                return readWhile.getFunc()->store;
-        }
-        return nullptr;
-    }
-
-    F *getFunc() {
-        switch (state) {
-            case State::INIT:
-                return &init.f;
-            case State::READ_WHILE:
-                return readWhile.getFunc()->f;
-        }
-        return nullptr;
-    }
+    Store *getStore() { return readSlices.getScan()->store; }
 
-    Poll<bool> poll() {
-        switch (state) {
-            case State::INIT: {
-                Reader *reader = init.reader;
-                Store *store = init.store;
-                F f = init.f;
-                auto future = ReadWhile<Read>(reader, Read(store, f));
-                INIT_AWAIT(READ_WHILE, readWhile, future, result)
+    F *getFunc() { return &readSlices.getScan()->f; }
 
-                READY(readWhile.getFunc()->success)
-            }
-        }
-        return Poll<bool>::pending();
+    Poll<bool> poll(Context *cx) {
+        AWAIT(readSlices, result)
+        READY(readSlices.getScan()->success)
     }
 
    private:
-    enum class State { INIT, READ_WHILE } state = State::INIT;
-    struct Read {
-        Read(Store *store, F f) : store(store), f(f) {}
-
-        bool success = true;
+    struct Scan {
+        bool success;
         Store *store;
         F f;
 
-        bool operator()(char c) {
-            if (!f(c)) {
-                return false;
-            }
-            if (!store->push(c)) {
-                success = false;
-                return false;
+        size_t operator()(BufferRef slice) {
+            size_t i = 0;
+            while (i < slice.length && f(slice.data[i])) {
+                if (!store->push(slice.data[i])) {
+                    success = false;
+                    break;
+                }
+                i++;
             }
-            return true;
+            return i;
         }
     };
 
-    union {
-        struct {
-            Reader *reader;
-            Store *store;
-            F f;
-        } init;
-        ReadWhile<Read> readWhile;
-    };
+    ReadSlicesWhile<Scan, R> readSlices;
 };
 
 // F must overload: bool operator()(char);
-template <typename F>
-class ReadIntoWhile : public ReadFuture<ReadIntoWhile<F>, size_t> {
+template <typename F, typename R = Reader>
+class ReadIntoWhile : public ReadFuture<ReadIntoWhile<F, R>, size_t> {
    public:
-    explicit ReadIntoWhile(Reader *reader, char *buffer, size_t length, F f)
-        : init({reader, {buffer, 0, length, f}}) {}
+    explicit ReadIntoWhile(R *reader, char *buffer, size_t length, F f)
+        : readSlices(reader, Scan{buffer, 0, length, f}) {}
 
-    Reader *getReader() { return readWhile.getReader(); }
+    R *getReader() { return readSlices.getReader(); }
 
-    F *getFunc() {
-        switch (state) {
-            case State::INIT: {
-                return init.read;
-            }
-            case State::READ_WHILE: {
-                return readWhile.getFunc();
-            }
-        }
-    }
+    F *getFunc() { return &readSlices.getScan()->f; }
 
-    char *getBuffer() { return readWhile.getFunc()->buffer; }
+    char *getBuffer() { return readSlices.getScan()->buffer; }
 
-    size_t getBufferLength() { return readWhile.getFunc()->bufferLength; }
-
-    Poll<size_t> poll() {
-        switch (state) {
-            case State::INIT: {
-                state = State::READ_WHILE;
-                readWhile = ReadWhile<Read>(init.reader, init.read);
-            }
-                // Fallthrough
-            case State::READ_WHILE: {
-                Poll<void_> poll = readWhile.poll();
-                if (poll.isPending()) {
-                    return Poll<size_t>::pending();
-                }
-                return Poll<size_t>::ready(readWhile.getFunc()->read);
-            }
-        }
+    size_t getBufferLength() { return readSlices.getScan()->bufferLength; }
 
-        return Poll<size_t>::pending();
+    Poll<size_t> poll(Context *cx) {
+        AWAIT(readSlices, result)
+        READY(readSlices.getScan()->read)
     }
 
    private:
-    struct Read {
+    struct Scan {
         char *buffer;
         size_t read;
         size_t bufferLength;
         F f;
 
-        bool operator()(char c) {
-            bool continu = f(c);
-            if (continu) {
-                if (read >= bufferLength) {
-                    return false;
-                }
-                buffer[read] = c;
-                read++;
+        size_t operator()(BufferRef slice) {
+            size_t i = 0;
+            size_t free = bufferLength - read;
+            while (i < slice.length && i < free && f(slice.data[i])) {
+                i++;
             }
-            return continu;
+            // Copy the matching part at once
+            memcpy(buffer + read, slice.data, i);
+            read += i;
+            return i;
         }
     };
 
-    enum class State {
-        INIT,
-        READ_WHILE,
-    } state = State::INIT;
-
-    union {
-        struct {
-            Reader *reader;
-            Read read;
-        } init;
-        ReadWhile<Read> readWhile;
-    };
+    ReadSlicesWhile<Scan, R> readSlices;
 };
 
 // Returns empty if the crlf is invalid or the inReader doesn't have enough
 // data. If found returns true, if not found false(no data consumed).
-class ReadCrlf : public ReadFuture<ReadCrlf, Optional<bool>> {
+template <typename R = Reader>
+class ReadCrlf : public ReadFuture<ReadCrlf<R>, Optional<bool>> {
    public:
-    explicit ReadCrlf(Reader *reader) : init({reader}) {}
+    explicit ReadCrlf(R *reader) : init({reader}) {}
 
-    Reader *getReader() {
+    R *getReader() {
         switch (state) {
             case State::INIT:
                 return init.reader;
@@ -534,14 +985,14 @@ class ReadCrlf : public ReadFuture<ReadCrlf, Optional<bool>> {
         return nullptr;
     }
 
-    Poll<Optional<bool>> poll() {
+    Poll<Optional<bool>> poll(Context *cx) {
         switch (state) {
             case State::INIT:
                 state = State::PEEK;
                 peek = init.reader->peek();
                 // Fallthrough
             case State::PEEK: {
-                Poll<Optional<char>> poll = peek->poll();
+                Poll<Optional<char>> poll = peek->poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<bool>>::pending();
                 }
@@ -559,12 +1010,12 @@ class ReadCrlf : public ReadFuture<ReadCrlf, Optional<bool>> {
 
                 state = State::READ_CR;
 
-                Reader *reader = peek->getReader();
+                R *reader = peek->getReader();
                 read = ReadChar(reader);
             }
                 // Fallthrough
             case State::READ_CR: {
-                Poll<Optional<char>> poll = read.poll();
+                Poll<Optional<char>> poll = read.poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<bool>>::pending();
                 }
@@ -577,12 +1028,12 @@ class ReadCrlf : public ReadFuture<ReadCrlf, Optional<bool>> {
 
                 state = State::READ_LF;
 
-                Reader *reader = read.getReader();
+                R *reader = read.getReader();
                 read = ReadChar(reader);
             }
                 // Fallthrough
             case State::READ_LF: {
-                Poll<Optional<char>> poll = read.poll();
+                Poll<Optional<char>> poll = read.poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<bool>>::pending();
                 }
@@ -610,18 +1061,19 @@ class ReadCrlf : public ReadFuture<ReadCrlf, Optional<bool>> {
 
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
-        Peek *peek;
-        ReadChar read;
+        typename reader_ops<R>::Peek *peek;
+        ReadChar<R> read;
     };
 };
 
-class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
+template <typename R = Reader>
+class ReadNumber : public ReadFuture<ReadNumber<R>, Optional<double>> {
    public:
-    ReadNumber(Reader *reader) : init({reader}) {}
+    ReadNumber(R *reader) : init({reader}) {}
 
-    Reader *getReader() {
+    R *getReader() {
         switch (state) {
             case State::INIT:
                 return init.reader;
@@ -635,17 +1087,17 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
         return nullptr;
     }
 
-    Poll<Optional<double>> poll() {
+    Poll<Optional<double>> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 state = State::PEEK_DECIMAL;
 
-                Reader *reader = init.reader;
+                R *reader = init.reader;
                 peek = reader->peek();
             }
             case State::PEEK_DECIMAL:
             peekDecimal: {
-                Poll<Optional<char>> poll = peek->poll();
+                Poll<Optional<char>> poll = peek->poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<double>>::pending();
                 }
@@ -669,12 +1121,12 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                 state = State::READ_DECIMAL;
 
-                Reader *reader = peek->getReader();
+                R *reader = peek->getReader();
                 readChar = ReadChar(reader);
             }
                 // Fallthrough
             case State::READ_DECIMAL: {
-                Poll<Optional<char>> poll = readChar.poll();
+                Poll<Optional<char>> poll = readChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<double>>::pending();
                 }
@@ -694,7 +1146,7 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                     state = State::PEEK_DECIMAL;
 
-                    Reader *reader = readChar.getReader();
+                    R *reader = readChar.getReader();
                     peek = reader->peek();
                     goto peekDecimal;
                 } else if (c == '-') {
@@ -706,7 +1158,7 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                     state = State::PEEK_DECIMAL;
 
-                    Reader *reader = readChar.getReader();
+                    R *reader = readChar.getReader();
                     peek = reader->peek();
                     goto peekDecimal;
                 } else if (c == '.') {
@@ -714,7 +1166,7 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                     state = State::PEEK_FRACTION;
 
-                    Reader *reader = readChar.getReader();
+                    R *reader = readChar.getReader();
                     peek = reader->peek();
                     // Fallthrough
                 } else {
@@ -728,7 +1180,7 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
             }
             case State::PEEK_FRACTION:
             peekFraction: {
-                Poll<Optional<char>> poll = peek->poll();
+                Poll<Optional<char>> poll = peek->poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<double>>::pending();
                 }
@@ -747,12 +1199,12 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                 state = State::READ_FRACTION;
 
-                Reader *reader = peek->getReader();
+                R *reader = peek->getReader();
                 readChar = ReadChar(reader);
             }
                 // Fallthrough
             case State::READ_FRACTION: {
-                Poll<Optional<char>> poll = readChar.poll();
+                Poll<Optional<char>> poll = readChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<Optional<double>>::pending();
                 }
@@ -771,7 +1223,7 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
                     state = State::PEEK_FRACTION;
 
-                    Reader *reader = readChar.getReader();
+                    R *reader = readChar.getReader();
                     peek = reader->peek();
                     goto peekFraction;
                 } else {
@@ -807,10 +1259,10 @@ class ReadNumber : public ReadFuture<ReadNumber, Optional<double>> {
 
     union {
         struct {
-            Reader *reader;
+            R *reader;
         } init;
-        Peek *peek;
-        ReadChar readChar;
+        typename reader_ops<R>::Peek *peek;
+        ReadChar<R> readChar;
     };
 };
 
@@ -0,0 +1,118 @@
+#ifndef CPP_ASYNC_HTTP_REMOTE_WAKER_H
+#define CPP_ASYNC_HTTP_REMOTE_WAKER_H
+
+#include <atomic>
+
+#include "future.h"
+#include "utils.h"
+
+class RemoteWakeQueue;
+
+// Lets other threads wake a future that's polled by the thread of a reactor,
+// e.g. a handler that waits for a JoinHandle of the Executor. The wakers of a
+// server may only be woken on its own thread, so the future waits with
+// getWaker() instead of the waker of its context. A wake from another thread
+// queues this in the RemoteWakeQueue of the server, which unparks the reactor
+// and wakes the local waker on the next poll.
+//
+// It must not be moved while it's queued, copies are never queued.
+class RemoteWaker {
+   public:
+    RemoteWaker() {}
+    RemoteWaker(const RemoteWaker &other) {}
+    RemoteWaker &operator=(const RemoteWaker &other) { return *this; }
+
+    // On the thread of the queue
+    void setQueue(RemoteWakeQueue *queue) { this->queue = queue; }
+    bool hasQueue() { return queue != nullptr; }
+
+    // The waker that's woken on the thread of the queue
+    void setWaker(Waker waker) { this->waker = waker; }
+
+    // Can be woken from any thread
+    Waker getWaker() { return Waker(this, wakeRemote); }
+
+    // The futures of the server are never destroyed, so a future that leaves
+    // something on another thread behind, like a running task, registers what
+    // has to happen if it's dropped before it completed
+    void setAbandon(void *data, void (*abandonFn)(void *)) {
+        abandonData = data;
+        this->abandonFn = abandonFn;
+    }
+    void clearAbandon() { abandonFn = nullptr; }
+
+    // Called by the owner once the future that waits with this is dropped
+    void abandon() {
+        if (abandonFn != nullptr) {
+            void (*fn)(void *) = abandonFn;
+            abandonFn = nullptr;
+            fn(abandonData);
+        }
+    }
+
+   private:
+    friend class RemoteWakeQueue;
+
+    inline static void wakeRemote(void *data);
+
+    RemoteWakeQueue *queue = nullptr;
+    Waker waker;
+    std::atomic<bool> queued{false};
+    RemoteWaker *next = nullptr;
+
+    void *abandonData = nullptr;
+    void (*abandonFn)(void *) = nullptr;
+};
+
+// The remote wakes of one thread. Other threads push onto a lock free stack
+// and unpark the thread, which takes the whole stack at once.
+class RemoteWakeQueue {
+   public:
+    RemoteWakeQueue() {}
+    RemoteWakeQueue(const RemoteWakeQueue &other) {}
+    RemoteWakeQueue &operator=(const RemoteWakeQueue &other) { return *this; }
+
+    // Woken from other threads after a push, e.g. the unpark of a reactor.
+    // Must be set before the first remote wake.
+    void setUnpark(Waker unpark) { this->unpark = unpark; }
+
+    // Any thread. A waker that's queued already isn't queued twice.
+    void push(RemoteWaker *waker) {
+        if (waker->queued.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        RemoteWaker *first = head.load(std::memory_order_relaxed);
+        do {
+            waker->next = first;
+        } while (!head.compare_exchange_weak(first, waker,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+        unpark.wake();
+    }
+
+    // On the thread of the queue: wakes the local wakers of the queued ones
+    void wakeQueued() {
+        if (head.load(std::memory_order_relaxed) == nullptr) {
+            return;
+        }
+        RemoteWaker *waker = head.exchange(nullptr, std::memory_order_acquire);
+        while (waker != nullptr) {
+            RemoteWaker *next = waker->next;
+            // Wakes after this queue it again
+            waker->queued.store(false, std::memory_order_release);
+            waker->waker.wake();
+            waker = next;
+        }
+    }
+
+   private:
+    std::atomic<RemoteWaker *> head{nullptr};
+    Waker unpark;
+};
+
+inline void RemoteWaker::wakeRemote(void *data) {
+    RemoteWaker *waker = (RemoteWaker *)data;
+    waker->queue->push(waker);
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef CPP_ASYNC_HTTP_ROUTER_H
+#define CPP_ASYNC_HTTP_ROUTER_H
+
+#include <new>
+
+#include "http.h"
+#include "http_handler.h"
+#include "http_head.h"
+#include "utils.h"
+
+// Dispatches requests to one of many http_handlers by method and path:
+//
+//   static constexpr const char USERS[] = "/users";
+//   typedef Router<Route<HttpMethod::GET, USERS, GetUsers>,
+//                  Route<HttpMethod::POST, USERS, AddUser>>
+//       Api;
+//
+// Router can be used everywhere a handler can, e.g. HttpServer<Server, Api>.
+// The paths are put into a trie at compile time so finding the route only
+// looks at every char of the path once. Everything after a '?' is ignored.
+// Requests without a route get a 404.
+
+// Path must point to a char array with static storage duration
+template <HttpMethod Method, const char *Path, typename Handler_>
+struct Route {
+    static constexpr const HttpMethod method = Method;
+    static constexpr const char *path = Path;
+    typedef Handler_ Handler;
+};
+
+template <typename... Routes>
+struct Router {};
+
+namespace router {
+
+constexpr size_t pathLength(const char *path) {
+    size_t length = 0;
+    while (path[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+// Node 0 is the root which is never a child, so 0 means no node
+struct TrieNode {
+    char c;
+    size_t child;
+    size_t sibling;
+    // Index of the route + 1, 0 if no route ends here
+    size_t route;
+};
+
+template <size_t NodesLength>
+struct Trie {
+    TrieNode nodes[NodesLength];
+    size_t length;
+    bool duplicateRoute;
+};
+
+template <size_t NodesLength>
+constexpr size_t findChild(const Trie<NodesLength> &trie, size_t node,
+                           char c) {
+    size_t child = trie.nodes[node].child;
+    while (child != 0 && trie.nodes[child].c != c) {
+        child = trie.nodes[child].sibling;
+    }
+    return child;
+}
+
+template <size_t NodesLength>
+constexpr size_t insertChild(Trie<NodesLength> &trie, size_t node, char c) {
+    size_t child = findChild(trie, node, c);
+    if (child != 0) {
+        return child;
+    }
+    child = trie.length++;
+    trie.nodes[child] = {c, 0, trie.nodes[node].child, 0};
+    trie.nodes[node].child = child;
+    return child;
+}
+
+// The method is the first char of the key followed by the path
+template <size_t NodesLength, size_t RoutesLength>
+constexpr Trie<NodesLength> buildTrie(
+    const HttpMethod (&methods)[RoutesLength],
+    const char *const (&paths)[RoutesLength]) {
+    Trie<NodesLength> trie = {};
+    trie.length = 1;
+    for (size_t i = 0; i < RoutesLength; i++) {
+        size_t node = insertChild(trie, 0, (char)methods[i]);
+        for (size_t j = 0; paths[i][j] != '\0'; j++) {
+            node = insertChild(trie, node, paths[i][j]);
+        }
+
+        if (trie.nodes[node].route != 0) {
+            trie.duplicateRoute = true;
+        }
+        trie.nodes[node].route = i + 1;
+    }
+    return trie;
+}
+
+struct NotFound {};
+
+}  // namespace router
+
+template <>
+struct http_handler<router::NotFound> {
+    typedef template_utils::pack<> Extractors;
+    typedef StatusCodeResponse Response;
+
+    typedef Instant<Response> HandleFuture;
+    static HandleFuture handle() {
+        return Instant<Response>(
+            StatusCodeResponse{.httpVersion = HttpVersion::HTTP_1_1,
+                               .code = 404,
+                               .reason = BufferRef("Not Found")});
+    }
+};
+
+template <typename... Routes>
+struct http_handler<Router<Routes...>> {
+    // Unused, the routes have their own extractors. This only selects the
+    // HandleHttpRequest specialization below.
+    typedef template_utils::pack<> Extractors;
+};
+
+template <typename R, typename W, typename... Routes>
+class HandleHttpRequest<Router<Routes...>, R, W, template_utils::pack<>>
+    : Future<HandleHttpRequest<Router<Routes...>, R, W, template_utils::pack<>>,
+             bool> {
+   private:
+    static constexpr const size_t ROUTES_LENGTH = sizeof...(Routes);
+    static_assert(ROUTES_LENGTH > 0, "A router needs at least one route");
+
+    static constexpr const size_t NODES_LENGTH =
+        1 + (... + (1 + router::pathLength(Routes::path)));
+    static constexpr const HttpMethod METHODS[] = {Routes::method...};
+    static constexpr const char *const PATHS[] = {Routes::path...};
+    static constexpr const router::Trie<NODES_LENGTH> TRIE =
+        router::buildTrie<NODES_LENGTH>(METHODS, PATHS);
+    static_assert(!TRIE.duplicateRoute,
+                  "Two routes have the same method and path");
+
+    // Only one of them is alive at a time, the last one answers with a 404
+    typedef Union<HandleHttpRequest<typename Routes::Handler, R, W>...,
+                  HandleHttpRequest<router::NotFound, R, W>>
+        Handles;
+
+   public:
+    HandleHttpRequest(HttpRequestStatusLine statusLine, R *reader, W *writer,
+                      HttpPipeline *pipeline = nullptr, Arena *arena = nullptr,
+                      RemoteWaker *remoteWaker = nullptr)
+        : route(findRoute(statusLine.method, statusLine.path)) {
+        START_HANDLES<HttpRequestStatusLine>[route](
+            &handles, statusLine, reader, writer, pipeline, arena,
+            remoteWaker);
+    }
+    template <size_t MaxHeaders>
+    HandleHttpRequest(HttpRequestHead<MaxHeaders> *head, R *reader, W *writer,
+                      HttpPipeline *pipeline = nullptr, Arena *arena = nullptr,
+                      RemoteWaker *remoteWaker = nullptr)
+        : route(findRoute(head->statusLine.method, head->statusLine.path)) {
+        START_HANDLES<HttpRequestHead<MaxHeaders> *>[route](
+            &handles, head, reader, writer, pipeline, arena, remoteWaker);
+    }
+
+    Poll<bool> poll(Context *cx) { return POLL_HANDLES[route](&handles, cx); }
+
+    // Returns the index of the route or ROUTES_LENGTH if there is none
+    static size_t findRoute(HttpMethod method, BufferRef path) {
+        size_t node = router::findChild(TRIE, 0, (char)method);
+        for (size_t i = 0; node != 0 && i < path.length; i++) {
+            if (path.data[i] == '?') {
+                break;
+            }
+            node = router::findChild(TRIE, node, path.data[i]);
+        }
+        if (node == 0 || TRIE.nodes[node].route == 0) {
+            return ROUTES_LENGTH;
+        }
+        return TRIE.nodes[node].route - 1;
+    }
+
+   private:
+    template <typename Handle, typename Start>
+    static void startHandle(Handles *handles, Start start, R *reader,
+                            W *writer, HttpPipeline *pipeline, Arena *arena,
+                            RemoteWaker *remoteWaker) {
+        new (handles->template asPtr<Handle>())
+            Handle(start, reader, writer, pipeline, arena, remoteWaker);
+    }
+    template <typename Handle>
+    static Poll<bool> pollHandle(Handles *handles, Context *cx) {
+        return handles->template asPtr<Handle>()->poll(cx);
+    }
+
+    // Indexed by the route, so dispatching doesn't depend on the number of
+    // routes
+    template <typename Start>
+    static constexpr void (*const START_HANDLES[])(Handles *, Start, R *, W *,
+                                                   HttpPipeline *, Arena *,
+                                                   RemoteWaker *) = {
+        &startHandle<HandleHttpRequest<typename Routes::Handler, R, W>,
+                     Start>...,
+        &startHandle<HandleHttpRequest<router::NotFound, R, W>, Start>};
+    static constexpr Poll<bool> (*const POLL_HANDLES[])(Handles *,
+                                                        Context *) = {
+        &pollHandle<HandleHttpRequest<typename Routes::Handler, R, W>>...,
+        &pollHandle<HandleHttpRequest<router::NotFound, R, W>>};
+
+    size_t route;
+    Handles handles;
+};
+
+#endif
@@ -47,10 +47,13 @@ struct Serialize {
 
             // TODO: Do something about this pollNext. This should use if
             // constexpr instead!
-            Poll<bool> pollNext(void_* v) { return Poll<bool>::ready(true); }
+            Poll<bool> pollNext(Context* cx, void_* v) {
+                return Poll<bool>::ready(true);
+            }
             template <size_t MemberIndex2>
-            Poll<bool> pollNext(SerializeMembersFuture<MemberIndex2>* future) {
-                return future->poll();
+            Poll<bool> pollNext(Context* cx,
+                            SerializeMembersFuture<MemberIndex2>* future) {
+                return future->poll(cx);
             }
 
            public:
@@ -58,7 +61,7 @@ struct Serialize {
                 typename Serializer::SerializeStruct* serializeStruct, T* value)
                 : serializeStruct(serializeStruct), value(value) {}
 
-            Poll<bool> poll() {
+            Poll<bool> poll(Context* cx) {
                 switch (state) {
                     case State::INIT: {
                         auto future = serializeStruct->template serializeField<
@@ -81,7 +84,7 @@ struct Serialize {
                         NextFuture future = NextFuture(serializeStruct, value);
                         INIT_STATE(NEXT, nextFuture, future)
 
-                        Poll<bool> poll = pollNext(&nextFuture);
+                        Poll<bool> poll = pollNext(cx, &nextFuture);
                         if (poll.isPending()) {
                             return Poll<bool>::pending();
                         }
@@ -127,7 +130,7 @@ struct Serialize {
         SerializeFuture(Serializer* serializer, T* value)
             : serializer(serializer), value(value) {}
 
-        Poll<bool> poll() {
+        Poll<bool> poll(Context* cx) {
             switch (state) {
                 case State::INIT: {
                     INIT_AWAIT(SERIALIZE_STRUCT, serializeStructFuture,
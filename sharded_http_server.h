@@ -0,0 +1,133 @@
+#ifndef CPP_ASYNC_HTTP_SHARDED_HTTP_SERVER_H
+#define CPP_ASYNC_HTTP_SHARDED_HTTP_SERVER_H
+
+// Linux only(pthreads, SO_REUSEPORT)
+#include <pthread.h>
+#include <sched.h>
+
+#include <new>
+
+#include "future.h"
+#include "http_server.h"
+
+namespace http_server {
+
+// Runs an HttpServer on each of up to MaxShards threads, every thread pinned
+// to its own core. Each shard has its own listen socket bound to the same
+// port with SO_REUSEPORT, so the kernel spreads the connections over them and
+// the shards never talk to each other.
+//
+// Server must be constructible with (int port, bool reusePort), like
+// SimpleLinuxServer. The shards are constructed by their thread so their
+// memory is local to its core. It's big, so make it static:
+//
+//   static ShardedHttpServer<SimpleLinuxServer<10>, Api, 32> server(8000);
+//   server.start(8);
+//   server.join();
+template <typename Server, typename Handler, size_t MaxShards,
+          size_t PathLength = 64, size_t ArenaCapacity = 4096>
+class ShardedHttpServer {
+   private:
+    typedef HttpServer<Server, Handler, PathLength, ArenaCapacity> ShardServer;
+
+    // Own cache lines, so the shards don't share any
+    struct alignas(64) Shard {
+        ShardedHttpServer *owner;
+        size_t index;
+        int cpu;
+        bool started;
+        pthread_t thread;
+
+        alignas(Server) char server[sizeof(Server)];
+        alignas(ShardServer) char httpServer[sizeof(ShardServer)];
+    };
+
+   public:
+    explicit ShardedHttpServer(int port, HttpTimeouts timeouts = HttpTimeouts(),
+                               HttpOverload overload = HttpOverload())
+        : port(port), timeouts(timeouts), overload(overload) {}
+
+    ShardedHttpServer(const ShardedHttpServer &other) = delete;
+    ShardedHttpServer &operator=(const ShardedHttpServer &other) = delete;
+
+    // Starts min(shards, MaxShards) shards. Returns false if not every
+    // thread could be started, the started ones keep running.
+    bool start(size_t shards) {
+        shardsLength = min(shards, MaxShards);
+
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        int cpu = -1;
+
+        bool allStarted = true;
+        for (size_t i = 0; i < shardsLength; i++) {
+            Shard *shard = &this->shards[i];
+            shard->owner = this;
+            shard->index = i;
+            shard->cpu = pin ? nextCpu(&allowed, &cpu) : -1;
+            shard->started =
+                pthread_create(&shard->thread, NULL, runShard, shard) == 0;
+            allStarted = allStarted && shard->started;
+        }
+        return allStarted;
+    }
+
+    // Waits for the shards to finish, which only happens once their servers
+    // are closed
+    void join() {
+        for (size_t i = 0; i < shardsLength; i++) {
+            if (shards[i].started) {
+                pthread_join(shards[i].thread, NULL);
+                shards[i].started = false;
+            }
+        }
+    }
+
+    size_t getShardsLength() { return shardsLength; }
+
+   private:
+    // Returns the allowed cpus one after another, wrapping around if there
+    // are more shards than cpus
+    static int nextCpu(cpu_set_t *allowed, int *cpu) {
+        int count = CPU_COUNT(allowed);
+        if (count == 0) {
+            return -1;
+        }
+        do {
+            *cpu = (*cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(*cpu, allowed));
+        return *cpu;
+    }
+
+    static void *runShard(void *data) {
+        Shard *shard = (Shard *)data;
+
+        if (shard->cpu != -1) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(shard->cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        Server *server = new (shard->server) Server(shard->owner->port, true);
+        ShardServer *httpServer = new (shard->httpServer)
+            ShardServer(server, shard->owner->timeouts, shard->owner->overload);
+
+        blockOn(httpServer, server->getPark());
+
+        httpServer->~ShardServer();
+        server->~Server();
+        return NULL;
+    }
+
+    int port;
+    HttpTimeouts timeouts;
+    HttpOverload overload;
+    size_t shardsLength = 0;
+    Shard shards[MaxShards];
+};
+
+}  // namespace http_server
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef CPP_ASYNC_HTTP_SLAB_H
+#define CPP_ASYNC_HTTP_SLAB_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+// Names a slot of a Slab. Every slot counts its allocations in its
+// generation, so a handle that outlived its slot doesn't match the next user
+// of the slot.
+struct SlabHandle {
+    uint32_t index;
+    uint32_t generation;
+};
+
+// Hands out the slots 0..Capacity-1. The free slots are kept on a stack, so
+// allocating and freeing are O(1) no matter how big the slab is.
+//
+// A slot can be retired first and released later, e.g. once the kernel
+// doesn't use its memory anymore. Its handle is stale from the retire on, but
+// the slot is only allocated again after the release.
+template <size_t Capacity>
+class Slab {
+    static_assert(Capacity > 0 && Capacity < UINT32_MAX,
+                  "The slots are indexed with 32 bits");
+
+   public:
+    Slab() {
+        // Low slots first
+        for (size_t i = 0; i < Capacity; i++) {
+            freeSlots[i] = (uint32_t)(Capacity - 1 - i);
+        }
+    }
+
+    Optional<SlabHandle> allocate() {
+        if (freeLength == 0) {
+            return Optional<SlabHandle>::empty();
+        }
+        uint32_t index = freeSlots[--freeLength];
+        // Odd generations are in use
+        generations[index]++;
+        return Optional<SlabHandle>::of(SlabHandle{index, generations[index]});
+    }
+
+    // Returns false without doing anything if the handle is stale
+    bool free(SlabHandle handle) {
+        if (!retire(handle)) {
+            return false;
+        }
+        release(handle.index);
+        return true;
+    }
+
+    // Returns false without doing anything if the handle is stale
+    bool retire(SlabHandle handle) {
+        if (!isValid(handle)) {
+            return false;
+        }
+        generations[handle.index]++;
+        return true;
+    }
+
+    // Makes a retired slot available again
+    void release(uint32_t index) { freeSlots[freeLength++] = index; }
+
+    bool isValid(SlabHandle handle) {
+        return handle.index < Capacity &&
+               generations[handle.index] == handle.generation &&
+               isInUse(handle.index);
+    }
+
+    bool isInUse(size_t index) { return (generations[index] & 1) != 0; }
+
+    bool isFull() { return freeLength == 0; }
+
+   private:
+    uint32_t generations[Capacity] = {};
+    uint32_t freeSlots[Capacity];
+    size_t freeLength = Capacity;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef CPP_ASYNC_HTTP_TIMER_H
+#define CPP_ASYNC_HTTP_TIMER_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+// Otherwise windows.h pulls in winsock.h, which clashes with winsock2.h
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "future.h"
+#include "utils.h"
+
+// Milliseconds of a clock that never jumps
+static inline uint64_t monotonicMillis() {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000 + (uint64_t)time.tv_nsec / 1000000;
+#endif
+}
+
+class TimerWheel;
+
+// A deadline in a TimerWheel. The timer is a node of a list in the wheel, so
+// arming and cancelling don't allocate. It's cancelled when it's destroyed or
+// assigned to, a copy is never armed.
+class Timer {
+   public:
+    Timer() {}
+    Timer(const Timer &other) {}
+    Timer &operator=(const Timer &other) {
+        cancel();
+        return *this;
+    }
+    ~Timer() { cancel(); }
+
+    inline void cancel();
+
+    bool isArmed() { return wheel != nullptr; }
+    bool isExpired() { return expired; }
+
+    // The waker that's woken once the timer expired
+    void setWaker(Waker waker) { this->waker = waker; }
+
+   private:
+    friend class TimerWheel;
+
+    TimerWheel *wheel = nullptr;
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    uint64_t deadline = 0;
+    uint8_t level = 0;
+    uint8_t slot = 0;
+    bool expired = false;
+    Waker waker;
+};
+
+// Hashed hierarchical timer wheel with a resolution of one millisecond. Each
+// of the LEVELS has 64 slots, a slot of level n spans 64^n milliseconds. A
+// timer goes into the lowest level whose range still contains its deadline
+// and moves down a level whenever its slot is reached, so arming and
+// cancelling are O(1) and the next deadline is found with a few bit scans.
+//
+// The parks of the servers wait at most until the next deadline and advance
+// the wheel afterwards, which wakes the futures of the expired timers. blockOn
+// skips the park while the future keeps waking itself, so the HttpServer,
+// Sleep and Timeout advance it whenever they're polled, too.
+class TimerWheel {
+   public:
+    static constexpr const size_t LEVELS = 6;
+    static constexpr const size_t SLOT_BITS = 6;
+    static constexpr const size_t SLOTS = 1 << SLOT_BITS;
+    // Later deadlines(~2 years) are clamped. The top level wraps around, its
+    // slot of now can't hold a deadline of the next round, so it reaches 63
+    // slots ahead.
+    static constexpr const uint64_t MAX_DURATION =
+        ((uint64_t)1 << (LEVELS * SLOT_BITS)) -
+        ((uint64_t)1 << ((LEVELS - 1) * SLOT_BITS));
+
+    explicit TimerWheel() : elapsed(monotonicMillis()) {}
+    explicit TimerWheel(uint64_t now) : elapsed(now) {}
+
+    // The wheel must not be moved or copied while timers are armed
+    TimerWheel(const TimerWheel &other) : elapsed(other.elapsed) {}
+    TimerWheel &operator=(const TimerWheel &other) {
+        elapsed = other.elapsed;
+        return *this;
+    }
+
+    // The time of the last advance
+    uint64_t now() { return elapsed; }
+
+    // Arms the timer to wake waker at deadline(in monotonicMillis). Returns
+    // false without arming it if the deadline already passed.
+    bool arm(Timer *timer, uint64_t deadline, Waker waker) {
+        timer->cancel();
+        timer->waker = waker;
+        if (deadline <= elapsed) {
+            timer->expired = true;
+            return false;
+        }
+        timer->expired = false;
+        timer->deadline = min(deadline, elapsed + MAX_DURATION);
+        insert(timer);
+        return true;
+    }
+
+    void cancel(Timer *timer) {
+        if (timer->wheel != this) {
+            return;
+        }
+        if (timer->prev != nullptr) {
+            timer->prev->next = timer->next;
+        } else {
+            slots[timer->level][timer->slot] = timer->next;
+            if (timer->next == nullptr) {
+                occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+            }
+        }
+        if (timer->next != nullptr) {
+            timer->next->prev = timer->prev;
+        }
+        timer->wheel = nullptr;
+        timer->prev = nullptr;
+        timer->next = nullptr;
+    }
+
+    // Expires every timer with a deadline up to now and wakes its waker
+    void advance(uint64_t now) {
+        while (true) {
+            Optional<Expiration> expiration = nextExpiration();
+            if (expiration.isEmpty() || expiration.get().deadline > now) {
+                break;
+            }
+            Expiration next = expiration.get();
+            elapsed = max(elapsed, next.deadline);
+
+            Timer *timer = slots[next.level][next.slot];
+            slots[next.level][next.slot] = nullptr;
+            occupied[next.level] &= ~((uint64_t)1 << next.slot);
+            while (timer != nullptr) {
+                Timer *following = timer->next;
+                timer->wheel = nullptr;
+                timer->prev = nullptr;
+                timer->next = nullptr;
+                if (timer->deadline <= elapsed) {
+                    timer->expired = true;
+                    timer->waker.wake();
+                } else {
+                    // Moves down a level
+                    insert(timer);
+                }
+                timer = following;
+            }
+        }
+        elapsed = max(elapsed, now);
+    }
+
+    // The earliest time advance has to be called at, which may be before the
+    // next deadline if that timer needs to move down a level
+    Optional<uint64_t> nextDeadline() {
+        Optional<Expiration> expiration = nextExpiration();
+        if (expiration.isEmpty()) {
+            return Optional<uint64_t>::empty();
+        }
+        return Optional<uint64_t>::of(expiration.get().deadline);
+    }
+
+    // How long a park may sleep, -1 if there's no timer
+    int timeoutMillis(uint64_t now) {
+        Optional<uint64_t> deadline = nextDeadline();
+        if (deadline.isEmpty()) {
+            return -1;
+        }
+        if (deadline.get() <= now) {
+            return 0;
+        }
+        return (int)min(deadline.get() - now, (uint64_t)INT_MAX);
+    }
+
+   private:
+    struct Expiration {
+        size_t level;
+        size_t slot;
+        uint64_t deadline;
+    };
+
+    void insert(Timer *timer) {
+        // The highest bit where the deadline differs from now selects the level
+        uint64_t masked = (elapsed ^ timer->deadline) | (SLOTS - 1);
+        size_t significant = 63 - __builtin_clzll(masked);
+        size_t level = min(significant / SLOT_BITS, LEVELS - 1);
+        size_t slot = (timer->deadline >> (level * SLOT_BITS)) & (SLOTS - 1);
+
+        timer->wheel = this;
+        timer->level = (uint8_t)level;
+        timer->slot = (uint8_t)slot;
+        timer->prev = nullptr;
+        timer->next = slots[level][slot];
+        if (timer->next != nullptr) {
+            timer->next->prev = timer;
+        }
+        slots[level][slot] = timer;
+        occupied[level] |= (uint64_t)1 << slot;
+    }
+
+    // The lowest level with a timer has the earliest one
+    Optional<Expiration> nextExpiration() {
+        for (size_t level = 0; level < LEVELS; level++) {
+            if (occupied[level] == 0) {
+                continue;
+            }
+            size_t shift = level * SLOT_BITS;
+            size_t position = (elapsed >> shift) & (SLOTS - 1);
+            // Rotated so the slots from the current one on come first
+            uint64_t bits = occupied[level];
+            uint64_t rotated =
+                position == 0
+                    ? bits
+                    : (bits >> position) | (bits << (SLOTS - position));
+            size_t slot = (position + __builtin_ctzll(rotated)) & (SLOTS - 1);
+
+            uint64_t levelRange = (uint64_t)1 << (shift + SLOT_BITS);
+            uint64_t deadline =
+                (elapsed & ~(levelRange - 1)) + ((uint64_t)slot << shift);
+            if (slot < position) {
+                deadline += levelRange;
+            }
+            return Optional<Expiration>::of(Expiration{level, slot, deadline});
+        }
+        return Optional<Expiration>::empty();
+    }
+
+    uint64_t elapsed;
+    uint64_t occupied[LEVELS] = {};
+    Timer *slots[LEVELS][SLOTS] = {};
+};
+
+inline void Timer::cancel() {
+    if (wheel != nullptr) {
+        wheel->cancel(this);
+    }
+}
+
+// For servers without a reactor: polls again right away but expires the
+// timers first
+struct SpinTimerPark {
+    TimerWheel timers;
+
+    void park() { timers.advance(monotonicMillis()); }
+    // Never waits
+    void unpark() {}
+};
+
+// Completes after millis milliseconds, which start with the first poll.
+class Sleep : public Future<Sleep, void_> {
+   public:
+    Sleep(TimerWheel *timers, uint64_t millis)
+        : timers(timers), millis(millis) {}
+
+    Poll<void_> poll(Context *cx) {
+        if (!started) {
+            started = true;
+            if (!timers->arm(&timer, timers->now() + millis,
+                             cx->getWaker())) {
+                READY(void_())
+            }
+            return Poll<void_>::pending();
+        }
+        timers->advance(monotonicMillis());
+        if (timer.isExpired()) {
+            READY(void_())
+        }
+        timer.setWaker(cx->getWaker());
+        return Poll<void_>::pending();
+    }
+
+   private:
+    TimerWheel *timers;
+    uint64_t millis;
+    bool started = false;
+    Timer timer;
+};
+
+// Completes with the output of future or with an empty optional if that takes
+// longer than millis milliseconds, starting with the first poll.
+template <typename F>
+class Timeout
+    : public Future<Timeout<F>, Optional<typename template_utils::future_output<
+                                    F>::type>> {
+   private:
+    typedef typename template_utils::future_output<F>::type Output;
+
+   public:
+    Timeout(TimerWheel *timers, F future, uint64_t millis)
+        : timers(timers), future(future), millis(millis) {}
+
+    Poll<Optional<Output>> poll(Context *cx) {
+        if (!started) {
+            started = true;
+            timers->arm(&timer, timers->now() + millis, cx->getWaker());
+        } else {
+            timer.setWaker(cx->getWaker());
+            // The future may have woken itself, then the park didn't advance
+            timers->advance(monotonicMillis());
+        }
+
+        Poll<Output> poll = future.poll(cx);
+        if (poll.isReady()) {
+            timer.cancel();
+            READY(Optional<Output>::of(poll.get()))
+        }
+        if (timer.isExpired()) {
+            READY(Optional<Output>::empty())
+        }
+        return Poll<Optional<Output>>::pending();
+    }
+
+   private:
+    TimerWheel *timers;
+    F future;
+    uint64_t millis;
+    bool started = false;
+    Timer timer;
+};
+
+#endif
@@ -95,6 +95,21 @@ struct remove_pointer<T *const volatile> {
     typedef T type;
 };
 
+template <typename T>
+struct remove_reference {
+    typedef T type;
+};
+
+template <typename T>
+struct remove_reference<T &> {
+    typedef T type;
+};
+
+template <typename T>
+struct remove_reference<T &&> {
+    typedef T type;
+};
+
 template <typename T1, typename T2>
 struct is_type_equal {
     static constexpr const bool value = false;
@@ -160,6 +175,18 @@ struct unpack<pack<Ts...>, UnpackInto> {
     typedef typename UnpackInto::template type<Ts...> type;
 };
 
+// index_pack<0, ..., N - 1> to expand a pack together with its indices
+template <size_t... Indices>
+struct index_pack {};
+
+template <size_t N, size_t... Indices>
+struct make_index_pack : make_index_pack<N - 1, N - 1, Indices...> {};
+
+template <size_t... Indices>
+struct make_index_pack<0, Indices...> {
+    typedef index_pack<Indices...> type;
+};
+
 template <typename T, T... Values>
 struct t_pack {
     static const bool exists = false;
@@ -364,6 +391,12 @@ class Tuple {
         // this is empty
         return nullptr;
     }
+
+    // Caller must have: Return call();
+    template <typename Caller, typename Return>
+    inline Return call(Caller caller) {
+        return caller.call();
+    }
 };
 
 template <typename T, typename... Ts>
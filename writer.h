@@ -3,12 +3,14 @@
 
 #include <new>
 
+#include "buffer_pool.h"
 #include "future.h"
 #include "utils.h"
 
 class Writer;
 
-// TODO: remove virtual functions and use templates instead!
+// The futures below are templated on the writer. Writer itself is only the
+// virtual adapter, a final writer lets them call its ops directly.
 
 template <typename Derived, typename Output>
 class WriteFuture : public Future<Derived, Output> {
@@ -22,7 +24,7 @@ class VirtualWriteFuture
    public:
     virtual Writer *getWriter() = 0;
 
-    virtual Poll<Output> poll() = 0;
+    virtual Poll<Output> poll(Context *cx) = 0;
 };
 
 class WriteFromBuffer : public VirtualWriteFuture<size_t> {
@@ -32,17 +34,89 @@ class WriteFromBuffer : public VirtualWriteFuture<size_t> {
     virtual size_t getBufferLength() = 0;
 };
 
+// Returns false if the buffered data couldn't be written
+class Flush : public VirtualWriteFuture<bool> {};
+
 class Writer {
    public:
     virtual WriteFromBuffer *writeFromBuffer(const char *buffer,
                                              size_t bufferLength) = 0;
+
+    // Writes everything that was buffered by the writer
+    virtual Flush *flush() = 0;
+};
+
+// The futures returned by the ops of the writer W, see reader_ops
+template <typename W>
+struct writer_ops {
+    typedef typename template_utils::remove_pointer<decltype(
+        template_utils::declval<W &>().writeFromBuffer(nullptr, 0))>::type
+        WriteFromBuffer;
+    typedef typename template_utils::remove_pointer<decltype(
+        template_utils::declval<W &>().flush())>::type Flush;
 };
 
-// WriteImpl must have the function Optional<size_t> writeFromBuffer(const char*
-// buffer, size_t bufferLength) where an empty optional means that the writer is
-// full.
+// WriteImpl must have the function Optional<size_t> writeFromBuffer(Context*
+// cx, const char* buffer, size_t bufferLength) where an empty optional means
+// that the writer is full. If 0 is returned the impl must wake the waker of cx
+// once it can be written to again.
 template <typename WriteImpl>
-class SimpleWriter : public Writer {
+class SimpleWriter final : public Writer {
+   private:
+    // The ops return these directly, so they need to be complete before them
+
+    // Nothing is buffered so this is always done
+    class FlushImpl final : public Flush {
+       public:
+        explicit FlushImpl(SimpleWriter<WriteImpl> *writer) : writer(writer) {}
+
+        SimpleWriter<WriteImpl> *getWriter() override { return writer; }
+
+        Poll<bool> poll(Context *cx) override {
+            return Poll<bool>::ready(true);
+        }
+
+       private:
+        SimpleWriter<WriteImpl> *writer;
+    };
+
+    class WriteFromBufferImpl final : public WriteFromBuffer {
+       public:
+        WriteFromBufferImpl(SimpleWriter<WriteImpl> *writer, const char *buffer,
+                            size_t length)
+            : writer(writer), buffer(buffer), length(length) {}
+
+        SimpleWriter<WriteImpl> *getWriter() override { return writer; }
+
+        const char *getBuffer() override { return buffer; }
+
+        size_t getBufferLength() override { return length; }
+
+        Poll<size_t> poll(Context *cx) override {
+            while (written < length) {
+                Optional<size_t> write = writer->impl.writeFromBuffer(
+                    cx, buffer + written, length - written);
+                if (!write.isPresent()) {
+                    return Poll<size_t>::ready(written);
+                }
+                if (write.get() == 0) {
+                    // The impl will wake us
+                    return Poll<size_t>::pending();
+                }
+
+                written += write.get();
+            }
+
+            return Poll<size_t>::ready(written);
+        }
+
+       private:
+        SimpleWriter<WriteImpl> *writer;
+        const char *buffer;
+        size_t length;
+        size_t written = 0;
+    };
+
    public:
     explicit SimpleWriter(WriteImpl impl) : impl(impl) {}
 
@@ -70,15 +144,17 @@ class SimpleWriter : public Writer {
 
     WriteImpl *getImpl() { return &impl; }
 
-    WriteFromBuffer *writeFromBuffer(const char *buffer,
-                                     size_t length) override {
+    WriteFromBufferImpl *writeFromBuffer(const char *buffer,
+                                         size_t length) override {
+        destructOp();
         isWriting = true;
 
         void *ptr = (void *)&writeOp;
-        return (WriteFromBuffer *)new (ptr)
-            WriteFromBufferImpl(this, buffer, length);
+        return new (ptr) WriteFromBufferImpl(this, buffer, length);
     }
 
+    FlushImpl *flush() override { return &flushOp; }
+
    private:
     void copyFrom(SimpleWriter<WriteImpl> &other) {
         impl = other.impl;
@@ -86,57 +162,276 @@ class SimpleWriter : public Writer {
     }
 
     WriteImpl impl;
+    FlushImpl flushOp = FlushImpl(this);
 
-    class WriteFromBufferImpl : public WriteFromBuffer {
+    void destructOp() {
+        if (isWriting) {
+            ((WriteFromBufferImpl *)&writeOp)->~WriteFromBufferImpl();
+            isWriting = false;
+        }
+    }
+
+    bool isWriting = false;
+    char writeOp[sizeof(WriteFromBufferImpl)];
+};
+
+// A Writer that collects the writes in a buffer and only writes to the
+// WriteImpl(same as SimpleWriter) once the buffer is full or on flush. Writes
+// that are bigger than the buffer go to the WriteImpl directly.
+template <typename WriteImpl, size_t Capacity,
+          typename Storage = InlineBuffer<Capacity>>
+class BufferedWriter final : public Writer {
+   private:
+    class WriteFromBufferImpl final : public WriteFromBuffer {
        public:
-        WriteFromBufferImpl(SimpleWriter<WriteImpl> *writer, const char *buffer,
-                            size_t length)
+        WriteFromBufferImpl(
+            BufferedWriter<WriteImpl, Capacity, Storage> *writer,
+            const char *buffer, size_t length)
             : writer(writer), buffer(buffer), length(length) {}
 
-        SimpleWriter<WriteImpl> *getWriter() override { return writer; }
+        BufferedWriter<WriteImpl, Capacity, Storage> *getWriter() override {
+            return writer;
+        }
 
         const char *getBuffer() override { return buffer; }
 
         size_t getBufferLength() override { return length; }
 
-        Poll<size_t> poll() override {
-            Optional<size_t> write = writer->impl.writeFromBuffer(
-                buffer + written, length - written);
-            if (!write.isPresent()) {
-                return Poll<size_t>::ready(written);
+        Poll<size_t> poll(Context *cx) override {
+            if (length == 0) {
+                return Poll<size_t>::ready(0);
             }
+            while (true) {
+                // Nothing is buffered without a buffer, so the bytes can be
+                // written directly. A direct write must be finished before
+                // anything is buffered, the impl may still use the bytes.
+                if (direct || !writer->storage.acquire(length - written)) {
+                    Optional<size_t> write = writer->impl.writeFromBuffer(
+                        cx, buffer + written, length - written);
+                    if (write.isEmpty()) {
+                        return Poll<size_t>::ready(written);
+                    }
+                    direct = write.get() == 0;
+                    if (direct) {
+                        return Poll<size_t>::pending();
+                    }
+                    written += write.get();
+                    if (written == length) {
+                        return Poll<size_t>::ready(written);
+                    }
+                    continue;
+                }
 
-            written += write.get();
-            if (written == length) {
-                return Poll<size_t>::ready(written);
-            }
+                size_t copy = min(length - written,
+                                  writer->storage.capacity() - writer->length);
+                memcpy(writer->storage.get() + writer->length,
+                       buffer + written, copy);
+                writer->length += copy;
+                written += copy;
+                if (written == length) {
+                    return Poll<size_t>::ready(written);
+                }
 
-            return Poll<size_t>::pending();
+                // The buffer is full
+                Optional<bool> flushed = writer->writeBuffered(cx);
+                if (flushed.isEmpty()) {
+                    return Poll<size_t>::ready(written);
+                }
+                if (!flushed.get()) {
+                    return Poll<size_t>::pending();
+                }
+
+                // Don't copy what wouldn't fit anyways
+                while (length - written >= Capacity) {
+                    Optional<size_t> write = writer->impl.writeFromBuffer(
+                        cx, buffer + written, length - written);
+                    if (write.isEmpty()) {
+                        return Poll<size_t>::ready(written);
+                    }
+                    if (write.get() == 0) {
+                        direct = true;
+                        return Poll<size_t>::pending();
+                    }
+                    written += write.get();
+                }
+            }
         }
 
        private:
-        SimpleWriter<WriteImpl> *writer;
+        BufferedWriter<WriteImpl, Capacity, Storage> *writer;
         const char *buffer;
         size_t length;
         size_t written = 0;
+        bool direct = false;
+    };
+
+    class FlushImpl final : public Flush {
+       public:
+        explicit FlushImpl(BufferedWriter<WriteImpl, Capacity, Storage> *writer)
+            : writer(writer) {}
+
+        BufferedWriter<WriteImpl, Capacity, Storage> *getWriter() override {
+            return writer;
+        }
+
+        Poll<bool> poll(Context *cx) override {
+            Optional<bool> flushed = writer->writeBuffered(cx);
+            if (flushed.isEmpty()) {
+                return Poll<bool>::ready(false);
+            }
+            if (!flushed.get()) {
+                return Poll<bool>::pending();
+            }
+            return Poll<bool>::ready(true);
+        }
+
+       private:
+        BufferedWriter<WriteImpl, Capacity, Storage> *writer;
     };
 
+   public:
+    static_assert(Capacity > 0, "Capacity must be at least one byte");
+
+    explicit BufferedWriter(WriteImpl impl, Storage storage = Storage())
+        : impl(impl), storage(storage) {}
+
+    BufferedWriter(BufferedWriter<WriteImpl, Capacity, Storage> &other)
+        : impl(other.impl), storage(other.storage) {  // copy constructor
+        copyBufferFrom(other);
+    }
+
+    BufferedWriter(BufferedWriter<WriteImpl, Capacity, Storage> &&other)
+        : impl(other.impl), storage(other.storage) {  // move constructor
+        copyBufferFrom(other);
+    }
+
+    // copy assignment
+    BufferedWriter<WriteImpl, Capacity, Storage> &operator=(
+        BufferedWriter<WriteImpl, Capacity, Storage> &other) {
+        copyFrom(other);
+        return *this;
+    }
+
+    // move assignment
+    BufferedWriter<WriteImpl, Capacity, Storage> &operator=(
+        BufferedWriter<WriteImpl, Capacity, Storage> &&other) {
+        copyFrom(other);
+        return *this;
+    }
+
+    ~BufferedWriter() { destructOp(); }
+
+    WriteImpl *getImpl() { return &impl; }
+
+    // Bytes that are waiting for a flush
+    size_t bufferedLength() { return length - start; }
+
+    WriteFromBufferImpl *writeFromBuffer(const char *buffer,
+                                         size_t length) override {
+        destructOp();
+
+        currentOpType = Op::WRITE;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) WriteFromBufferImpl(this, buffer, length);
+    }
+
+    FlushImpl *flush() override {
+        destructOp();
+
+        currentOpType = Op::FLUSH;
+        void *ptr = (void *)&currentOp;
+        return new (ptr) FlushImpl(this);
+    }
+
+    // Forgets the bytes that weren't written yet, e.g. once the connection is
+    // closed. The impl must not use the buffer anymore.
+    void dropBuffered() {
+        start = 0;
+        length = 0;
+        storage.release();
+    }
+
+   private:
+    void copyBufferFrom(BufferedWriter<WriteImpl, Capacity, Storage> &other) {
+        // Only copy the part that wasn't written yet
+        start = 0;
+        length = 0;
+        size_t pending = other.length - other.start;
+        currentOpType = Op::NONE;
+        if (pending == 0) {
+            return;
+        }
+        if (storage.acquire(pending)) {
+            length = min(pending, storage.capacity());
+            memcpy(storage.get(), other.storage.get() + other.start, length);
+            return;
+        }
+        // No buffer left for a copy, so the bytes move over with the buffer
+        storage.takeOver(other.storage);
+        start = other.start;
+        length = other.length;
+        other.start = 0;
+        other.length = 0;
+    }
+
+    void copyFrom(BufferedWriter<WriteImpl, Capacity, Storage> &other) {
+        destructOp();
+        impl = other.impl;
+        storage = other.storage;
+        copyBufferFrom(other);
+    }
+
+    // Writes the buffer to the impl. Returns empty if the impl is closed, true
+    // if everything was written and false if the impl will wake cx.
+    Optional<bool> writeBuffered(Context *cx) {
+        while (start < length) {
+            Optional<size_t> write = impl.writeFromBuffer(
+                cx, storage.get() + start, length - start);
+            if (write.isEmpty()) {
+                return Optional<bool>::empty();
+            }
+            if (write.get() == 0) {
+                return Optional<bool>::of(false);
+            }
+            start += write.get();
+        }
+        start = 0;
+        length = 0;
+        // The impl is done with the buffer
+        storage.release();
+        return Optional<bool>::of(true);
+    }
+
+    enum class Op { NONE, WRITE, FLUSH } currentOpType = Op::NONE;
+    char currentOp[max(sizeof(WriteFromBufferImpl), sizeof(FlushImpl))];
+
     void destructOp() {
-        if (isWriting) {
-            ((WriteFromBufferImpl *)&writeOp)->~WriteFromBufferImpl();
-            isWriting = false;
+        void *currentOp = this->currentOp;
+        switch (currentOpType) {
+            case Op::WRITE:
+                ((WriteFromBufferImpl *)currentOp)->~WriteFromBufferImpl();
+                break;
+            case Op::FLUSH:
+                ((FlushImpl *)currentOp)->~FlushImpl();
+                break;
         }
+        currentOpType = Op::NONE;
     }
 
-    bool isWriting = false;
-    char writeOp[sizeof(WriteFromBufferImpl)];
+    WriteImpl impl;
+    // Everything before start was already written to the impl
+    size_t start = 0;
+    size_t length = 0;
+    // Only holds a buffer while length > 0 if it's pooled
+    Storage storage;
 };
 
-class WriteChar : public WriteFuture<WriteChar, bool> {
+template <typename W = Writer>
+class WriteChar : public WriteFuture<WriteChar<W>, bool> {
    public:
-    WriteChar(Writer *writer, char c) : init({writer}), c(c) {}
+    WriteChar(W *writer, char c) : init({writer}), c(c) {}
 
-    Writer *getWriter() {
+    W *getWriter() {
         switch (state) {
             case State::INIT:
                 return init.writer;
@@ -146,14 +441,14 @@ class WriteChar : public WriteFuture<WriteChar, bool> {
         return nullptr;
     }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT:
                 state = State::WRITE;
 
                 write = init.writer->writeFromBuffer(&c, 1);
             case State::WRITE: {
-                Poll<size_t> poll = write->poll();
+                Poll<size_t> poll = write->poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -172,17 +467,18 @@ class WriteChar : public WriteFuture<WriteChar, bool> {
     char c;
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteFromBuffer *write;
+        typename writer_ops<W>::WriteFromBuffer *write;
     };
 };
 
+template <typename W = Writer>
 class WriteCrlf {
    public:
-    explicit WriteCrlf(Writer *writer) : init({writer}) {}
+    explicit WriteCrlf(W *writer) : init({writer}) {}
 
-    Writer *getWriter() {
+    W *getWriter() {
         switch (state) {
             case State::INIT:
                 return init.writer;
@@ -191,17 +487,17 @@ class WriteCrlf {
         }
     }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
                 state = State::CR;
 
-                Writer *writer = init.writer;
+                W *writer = init.writer;
                 writeChar = WriteChar(writer, '\r');
             }
                 // Fallthrough
             case State::CR: {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -212,12 +508,12 @@ class WriteCrlf {
 
                 state = State::LF;
 
-                Writer *writer = writeChar.getWriter();
+                W *writer = writeChar.getWriter();
                 writeChar = WriteChar(writer, '\n');
             }
                 // Fallthrough
             case State::LF: {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -236,19 +532,19 @@ class WriteCrlf {
 
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteChar writeChar;
+        WriteChar<W> writeChar;
     };
 };
 
-template <int Base>
-class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
+template <int Base, typename W = Writer>
+class WriteDouble : public WriteFuture<WriteDouble<Base, W>, bool> {
    public:
-    WriteDouble(Writer *writer, double number)
+    WriteDouble(W *writer, double number)
         : init({writer}), number(number) {}
 
-    Writer *getWriter() {
+    W *getWriter() {
         switch (state) {
             case State::INIT:
                 return init.writer;
@@ -261,10 +557,10 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
         return nullptr;
     }
 
-    Poll<bool> poll() {
+    Poll<bool> poll(Context *cx) {
         switch (state) {
             case State::INIT: {
-                Writer *writer = init.writer;
+                W *writer = init.writer;
                 if (number == 0) {
                     state = State::WRITE_ZERO;
 
@@ -285,7 +581,7 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
             }
             case State::WRITE_NEGATIVE:
             writeNegative : {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -304,14 +600,14 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
                 numberInfo.reversedNumber /= Base;
                 numberInfo.decimalPoint--;
 
-                Writer *writer = getWriter();
+                W *writer = getWriter();
 
                 state = State::WRITE_DECIMAL;
 
                 writeChar = WriteChar(writer, getDigit(digit));
             }
             case State::WRITE_DECIMAL: {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -328,7 +624,7 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
                 }
                 if (numberInfo.decimalPoint == 0) {
                     numberInfo.decimalPoint--;
-                    Writer *writer = getWriter();
+                    W *writer = getWriter();
 
                     state = State::WRITE_FRACTION;
 
@@ -339,7 +635,7 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
                 int digit = numberInfo.reversedNumber % Base;
                 numberInfo.reversedNumber /= Base;
 
-                Writer *writer = getWriter();
+                W *writer = getWriter();
 
                 state = State::WRITE_FRACTION;
 
@@ -347,7 +643,7 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
             }
             case State::WRITE_FRACTION:
             writeFraction : {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -360,7 +656,7 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
             }
             case State::WRITE_ZERO:
             writeZero : {
-                Poll<bool> poll = writeChar.poll();
+                Poll<bool> poll = writeChar.poll(cx);
                 if (poll.isPending()) {
                     return Poll<bool>::pending();
                 }
@@ -432,9 +728,9 @@ class WriteDouble : public WriteFuture<WriteDouble<10>, bool> {
 
     union {
         struct {
-            Writer *writer;
+            W *writer;
         } init;
-        WriteChar writeChar;
+        WriteChar<W> writeChar;
     };
 };
 